@@ -0,0 +1,514 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include "platform.h"
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+#include "poller.h"
+#include "protocol.h"
+#include "histogram.h"
+
+// Load generator for the chat server. Opens many framed connections,
+// logs them in, has some of them send at a fixed rate and measures how
+// long each message takes to reach every member of its room.
+
+typedef std::chrono::steady_clock Clock;
+
+struct BenchConfig {
+    std::string host;
+    int port;
+    int clients;      // connections to open
+    int senders;      // how many of them send
+    int rooms;        // clients are spread over this many rooms
+    double rate;      // messages per second, all senders together
+    int duration;     // seconds of sending
+    int message_size; // bytes of text per message
+    int threads;
+    int server_pid;   // report the server's memory too (Linux)
+
+    BenchConfig()
+        : host("127.0.0.1"), port(8080), clients(1000), senders(10), rooms(1), rate(1000),
+          duration(10), message_size(64), threads(1), server_pid(0) {}
+};
+
+// One simulated user
+struct BenchConnection {
+    SOCKET socket;
+    int room;
+    bool sender;
+    bool ready;          // logged in and in its room
+    size_t prompt_left;  // plain-text prompt bytes still to skip
+    InputBuffer input;
+    std::string output;
+    size_t output_offset;
+    bool write_interest;
+
+    BenchConnection()
+        : socket(INVALID_SOCKET), room(0), sender(false), ready(false),
+          prompt_left(strlen(PROMPT)), output_offset(0), write_interest(false) {}
+};
+
+static uint64_t nowNanos() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        Clock::now().time_since_epoch()).count();
+}
+
+static std::string roomName(int room) {
+    return "bench" + std::to_string(room);
+}
+
+// Resident memory of a process in KB, 0 if unknown
+static long residentKb(const std::string& pid) {
+    std::ifstream status("/proc/" + pid + "/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.compare(0, 6, "VmRSS:") == 0) {
+            return std::atol(line.c_str() + 6);
+        }
+    }
+    return 0;
+}
+
+// Allow as many sockets as the hard limit permits
+static void raiseFileLimit() {
+#ifndef _WIN32
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+#endif
+}
+
+// One event loop driving a share of the connections
+class BenchThread {
+private:
+    const BenchConfig& config;
+    std::string run_id;
+    std::string run_tag; // "bench <run id> ", marks this run's messages
+    Poller poller;
+    std::vector<std::unique_ptr<BenchConnection>> connections;
+    std::map<SOCKET, BenchConnection*> by_socket;
+    std::vector<BenchConnection*> senders;
+    size_t next_sender;
+    size_t closed; // connections lost after connecting
+
+    bool queueFrame(BenchConnection& conn, uint8_t type, std::string_view payload);
+    bool flushOutput(BenchConnection& conn);
+    void handleReadable(BenchConnection& conn);
+    void handleFrame(BenchConnection& conn, uint8_t type, std::string_view payload);
+    void closeConnection(BenchConnection& conn);
+    void poll(int timeout_ms);
+
+public:
+    // Results
+    Histogram latency;            // nanoseconds, send to delivery
+    uint64_t sent;
+    std::vector<uint64_t> sent_per_room;
+    uint64_t delivered;
+    uint64_t ready_count;
+    uint64_t failed;
+
+    BenchThread(const BenchConfig& bench_config, const std::string& id);
+
+    // Connect and log in connections [first, first + count) with the given stride
+    void connectClients(int first, int stride, int count);
+    bool allReady() const;
+    void waitReady(const std::atomic<bool>& stop);
+    void send(uint64_t start_ns, uint64_t end_ns, double thread_rate);
+    void drain(uint64_t end_ns);
+};
+
+BenchThread::BenchThread(const BenchConfig& bench_config, const std::string& id)
+    : config(bench_config), run_id(id), run_tag("bench " + id + " "), next_sender(0), closed(0), sent(0),
+      sent_per_room(bench_config.rooms, 0), delivered(0), ready_count(0), failed(0) {
+    poller.open();
+}
+
+bool BenchThread::queueFrame(BenchConnection& conn, uint8_t type, std::string_view payload) {
+    char header[FRAME_HEADER_SIZE];
+    writeFrameHeader(header, type, (uint32_t)payload.size());
+    conn.output.append(header, FRAME_HEADER_SIZE);
+    conn.output.append(payload.data(), payload.size());
+    return flushOutput(conn);
+}
+
+bool BenchThread::flushOutput(BenchConnection& conn) {
+    while (conn.output_offset < conn.output.size()) {
+        int sent_now = ::send(conn.socket, conn.output.data() + conn.output_offset,
+                              (int)(conn.output.size() - conn.output_offset), SEND_FLAGS);
+        if (sent_now < 0) {
+            if (!socketWouldBlock()) {
+                return false;
+            }
+            break;
+        }
+        conn.output_offset += sent_now;
+    }
+    if (conn.output_offset == conn.output.size()) {
+        conn.output.clear();
+        conn.output_offset = 0;
+    }
+
+    bool want_write = !conn.output.empty();
+    if (want_write != conn.write_interest) {
+        poller.modify(conn.socket, Poller::READABLE | (want_write ? Poller::WRITABLE : 0));
+        conn.write_interest = want_write;
+    }
+    return true;
+}
+
+void BenchThread::connectClients(int first, int stride, int count) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(config.port);
+    inet_pton(AF_INET, config.host.c_str(), &addr.sin_addr);
+
+    // Skip any history: resume from a sequence id no room reaches
+    char resume[8];
+    uint64_t far_seq = (uint64_t)1 << 62;
+    for (int i = 0; i < 8; i++) {
+        resume[i] = (char)((far_seq >> (56 - 8 * i)) & 0xff);
+    }
+
+    for (int n = 0; n < count; n++) {
+        int index = first + n * stride;
+        std::unique_ptr<BenchConnection> conn(new BenchConnection());
+        conn->room = index % config.rooms;
+        conn->sender = index < config.senders;
+
+        conn->socket = socket(AF_INET, SOCK_STREAM, 0);
+        if (conn->socket == INVALID_SOCKET ||
+            connect(conn->socket, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+            !setNonBlocking(conn->socket) || !poller.add(conn->socket, Poller::READABLE)) {
+            if (conn->socket != INVALID_SOCKET) {
+                closesocket(conn->socket);
+            }
+            failed++;
+            continue;
+        }
+
+        // Pipeline the whole login; the server handles frames in order
+        std::string room = roomName(conn->room);
+        uint8_t version = PROTOCOL_VERSION;
+        std::string username = "b" + run_id + "_" + std::to_string(index);
+        bool ok = queueFrame(*conn, FRAME_HELLO, std::string_view((const char*)&version, 1)) &&
+                  queueFrame(*conn, FRAME_RESUME, std::string_view(resume, 8)) &&
+                  queueFrame(*conn, FRAME_RESUME, std::string(resume, 8) + room) &&
+                  queueFrame(*conn, FRAME_TEXT, username) &&
+                  queueFrame(*conn, FRAME_TEXT, "/join " + room) &&
+                  queueFrame(*conn, FRAME_TEXT, "/leave lobby");
+        if (!ok) {
+            closesocket(conn->socket);
+            failed++;
+            continue;
+        }
+
+        by_socket[conn->socket] = conn.get();
+        if (conn->sender) {
+            senders.push_back(conn.get());
+        }
+        connections.push_back(std::move(conn));
+
+        // Keep up with replies so socket buffers never fill up
+        if (n % 64 == 63) {
+            poll(0);
+        }
+    }
+}
+
+bool BenchThread::allReady() const {
+    return ready_count + closed >= connections.size();
+}
+
+void BenchThread::waitReady(const std::atomic<bool>& stop) {
+    while (!allReady() && !stop) {
+        poll(10);
+    }
+}
+
+void BenchThread::poll(int timeout_ms) {
+    std::vector<Poller::Event> ready;
+    poller.wait(ready, timeout_ms);
+    for (const auto& event : ready) {
+        auto it = by_socket.find(event.fd);
+        if (it == by_socket.end()) {
+            continue;
+        }
+        BenchConnection& conn = *it->second;
+        if (event.events & (Poller::READABLE | Poller::CLOSED)) {
+            handleReadable(conn);
+        }
+        if (conn.socket != INVALID_SOCKET && (event.events & Poller::WRITABLE) && !flushOutput(conn)) {
+            closeConnection(conn);
+        }
+    }
+}
+
+void BenchThread::handleReadable(BenchConnection& conn) {
+    const size_t READ_CHUNK = 64 * 1024;
+    char* space = conn.input.reserve(READ_CHUNK);
+    int bytes_read = recv(conn.socket, space, (int)READ_CHUNK, 0);
+    if (bytes_read < 0 && socketWouldBlock()) {
+        return;
+    }
+    if (bytes_read <= 0) {
+        closeConnection(conn);
+        return;
+    }
+
+    // The prompt comes before any frame
+    size_t skip = std::min(conn.prompt_left, (size_t)bytes_read);
+    conn.prompt_left -= skip;
+    if (skip > 0) {
+        memmove(space, space + skip, bytes_read - skip);
+    }
+    conn.input.commit(bytes_read - skip);
+
+    uint8_t type;
+    std::string_view payload;
+    InputBuffer::Result result;
+    while ((result = conn.input.nextFrame(type, payload)) == InputBuffer::COMPLETE) {
+        handleFrame(conn, type, payload);
+    }
+    if (result == InputBuffer::INVALID) {
+        std::cerr << "Protocol error from server" << std::endl;
+        closeConnection(conn);
+    }
+}
+
+void BenchThread::handleFrame(BenchConnection& conn, uint8_t type, std::string_view payload) {
+    if (type == FRAME_NOTICE) {
+        if (!conn.ready && payload.compare(0, 11, "Now talking") == 0) {
+            conn.ready = true;
+            ready_count++;
+        } else if (payload.compare(0, 8, "Username") == 0 || payload.compare(0, 8, "Protocol") == 0) {
+            std::cerr << "Login failed: " << payload;
+        }
+        return;
+    }
+
+    RecordView record;
+    if (type != FRAME_RECORD || !parseRecord(payload, record) ||
+        record.content.compare(0, run_tag.size(), run_tag) != 0) {
+        return; // Join notices and other runs' messages
+    }
+    std::string_view content = record.content;
+    uint64_t sent_ns = std::strtoull(std::string(content.substr(run_tag.size(), 20)).c_str(), NULL, 10);
+    uint64_t now = nowNanos();
+    latency.record(now > sent_ns ? now - sent_ns : 0);
+    delivered++;
+}
+
+void BenchThread::closeConnection(BenchConnection& conn) {
+    if (conn.socket == INVALID_SOCKET) {
+        return;
+    }
+    poller.remove(conn.socket);
+    by_socket.erase(conn.socket);
+    closesocket(conn.socket);
+    conn.socket = INVALID_SOCKET;
+    if (conn.ready) {
+        ready_count--;
+    }
+    closed++;
+    failed++;
+}
+
+void BenchThread::send(uint64_t start_ns, uint64_t end_ns, double thread_rate) {
+    std::string text;
+    uint64_t now;
+    while ((now = nowNanos()) < end_ns) {
+        // Catch up with the schedule; a stalled loop sends a burst
+        uint64_t due = (uint64_t)((double)(now - start_ns) / 1e9 * thread_rate);
+        while (sent < due && !senders.empty()) {
+            BenchConnection& conn = *senders[next_sender++ % senders.size()];
+            if (conn.socket == INVALID_SOCKET) {
+                continue;
+            }
+            text = run_tag + std::to_string(nowNanos()) + " ";
+            if ((int)text.size() < config.message_size) {
+                text.append(config.message_size - text.size(), 'x');
+            }
+            if (!queueFrame(conn, FRAME_TEXT, text)) {
+                closeConnection(conn);
+                continue;
+            }
+            sent++;
+            sent_per_room[conn.room]++;
+        }
+        poll(1);
+    }
+}
+
+void BenchThread::drain(uint64_t end_ns) {
+    while (nowNanos() < end_ns) {
+        poll(10);
+    }
+}
+
+void printUsage(const char* program) {
+    std::cout << "Usage: " << program << " [options]" << std::endl;
+    std::cout << "  --host IP          server address (default 127.0.0.1)" << std::endl;
+    std::cout << "  --port N           server port (default 8080)" << std::endl;
+    std::cout << "  --clients N        connections to open (default 1000)" << std::endl;
+    std::cout << "  --senders N        connections that send (default 10)" << std::endl;
+    std::cout << "  --rooms N          rooms the clients are spread over (default 1)" << std::endl;
+    std::cout << "  --rate N           messages per second, all senders (default 1000)" << std::endl;
+    std::cout << "  --duration S       seconds of sending (default 10)" << std::endl;
+    std::cout << "  --size N           bytes per message (default 64)" << std::endl;
+    std::cout << "  --threads N        client event loops (default 1)" << std::endl;
+    std::cout << "  --server-pid PID   also report the server's memory" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    BenchConfig config;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--host" && has_value) {
+            config.host = argv[++i];
+        } else if (arg == "--port" && has_value) {
+            config.port = std::atoi(argv[++i]);
+        } else if (arg == "--clients" && has_value) {
+            config.clients = std::atoi(argv[++i]);
+        } else if (arg == "--senders" && has_value) {
+            config.senders = std::atoi(argv[++i]);
+        } else if (arg == "--rooms" && has_value) {
+            config.rooms = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--rate" && has_value) {
+            config.rate = std::atof(argv[++i]);
+        } else if (arg == "--duration" && has_value) {
+            config.duration = std::atoi(argv[++i]);
+        } else if (arg == "--size" && has_value) {
+            config.message_size = std::atoi(argv[++i]);
+        } else if (arg == "--threads" && has_value) {
+            config.threads = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--server-pid" && has_value) {
+            config.server_pid = std::atoi(argv[++i]);
+        } else {
+            printUsage(argv[0]);
+            return arg == "--help" ? 0 : 1;
+        }
+    }
+    config.senders = std::min(config.senders, config.clients);
+    config.threads = std::min(config.threads, std::max(1, config.clients));
+
+    if (!initSockets()) {
+        std::cerr << "WSAStartup failed" << std::endl;
+        return 1;
+    }
+    raiseFileLimit();
+
+    // Tag this run's messages so history and other runs are ignored
+    std::string run_id = std::to_string(nowNanos() % 1000000007);
+
+    std::vector<std::unique_ptr<BenchThread>> workers;
+    for (int t = 0; t < config.threads; t++) {
+        workers.push_back(std::unique_ptr<BenchThread>(new BenchThread(config, run_id)));
+    }
+
+    // Phase 1: connect and log in
+    std::cout << "Connecting " << config.clients << " clients to " << config.host << ":"
+              << config.port << " in " << config.rooms << " room(s)..." << std::endl;
+    std::atomic<bool> give_up(false);
+    auto connect_start = Clock::now();
+    std::vector<std::thread> threads;
+    for (int t = 0; t < config.threads; t++) {
+        int count = config.clients / config.threads + (t < config.clients % config.threads ? 1 : 0);
+        threads.emplace_back([&, t, count]() {
+            workers[t]->connectClients(t, config.threads, count);
+            workers[t]->waitReady(give_up);
+        });
+    }
+    std::thread watchdog([&]() {
+        auto deadline = Clock::now() + std::chrono::seconds(60);
+        while (Clock::now() < deadline && !give_up) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        give_up = true;
+    });
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    double connect_seconds = std::chrono::duration<double>(Clock::now() - connect_start).count();
+    bool timed_out = give_up.exchange(true);
+    watchdog.join();
+    threads.clear();
+
+    uint64_t ready = 0, failed = 0;
+    for (auto& worker : workers) {
+        ready += worker->ready_count;
+        failed += worker->failed;
+    }
+    printf("Connected %llu clients in %.2f s (%.0f logins/s), %llu failed%s\n",
+           (unsigned long long)ready, connect_seconds, ready / connect_seconds,
+           (unsigned long long)failed, timed_out ? ", gave up waiting" : "");
+
+    // Phase 2: send at the configured rate, then give stragglers 2 s
+    uint64_t start_ns = nowNanos();
+    uint64_t end_ns = start_ns + (uint64_t)config.duration * 1000000000ull;
+    uint64_t drain_ns = end_ns + 2000000000ull;
+    for (int t = 0; t < config.threads; t++) {
+        threads.emplace_back([&, t]() {
+            workers[t]->send(start_ns, end_ns, config.rate / config.threads);
+            workers[t]->drain(drain_ns);
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    // Report
+    Histogram latency;
+    uint64_t sent = 0, delivered = 0;
+    std::vector<uint64_t> sent_per_room(config.rooms, 0);
+    for (auto& worker : workers) {
+        latency.merge(worker->latency);
+        sent += worker->sent;
+        delivered += worker->delivered;
+        for (int r = 0; r < config.rooms; r++) {
+            sent_per_room[r] += worker->sent_per_room[r];
+        }
+    }
+    uint64_t expected = 0;
+    for (int r = 0; r < config.rooms; r++) {
+        uint64_t members = config.clients / config.rooms + (r < config.clients % config.rooms ? 1 : 0);
+        expected += sent_per_room[r] * members;
+    }
+
+    double seconds = config.duration;
+    printf("Sent %llu messages in %d s (%.0f msgs/s)\n", (unsigned long long)sent, config.duration,
+           sent / seconds);
+    printf("Delivered %llu of %llu expected (%.0f msgs/s fan-out)\n", (unsigned long long)delivered,
+           (unsigned long long)expected, delivered / seconds);
+    printf("Latency ms: p50 %.3f  p99 %.3f  p999 %.3f  max %.3f\n",
+           latency.percentile(50) / 1e6, latency.percentile(99) / 1e6,
+           latency.percentile(99.9) / 1e6, latency.max() / 1e6);
+
+    long bench_kb = residentKb("self");
+    long server_kb = config.server_pid > 0 ? residentKb(std::to_string(config.server_pid)) : 0;
+    if (bench_kb > 0) {
+        printf("Memory: bench %.1f MB", bench_kb / 1024.0);
+        if (server_kb > 0) {
+            printf(", server %.1f MB (%.1f KB per client)", server_kb / 1024.0,
+                   (double)server_kb / std::max<uint64_t>(1, ready));
+        }
+        printf("\n");
+    }
+
+    workers.clear();
+    cleanupSockets();
+    return 0;
+}
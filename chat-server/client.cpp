@@ -1,10 +1,23 @@
 #include <iostream>
+#include <fstream>
 #include <string>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <memory>
 #include <thread>
 #include <atomic>
 #include <mutex>
-#include <winsock2.h>
-#include <ws2tcpip.h>
+#include <chrono>
+#include <ctime>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include "platform.h"
+#include "poller.h"
+#include "protocol.h"
+#include "histogram.h"
+#include "compression.h"
 
 class ChatClient {
 private:
@@ -46,7 +59,7 @@ private:
     
 public:
     ChatClient(const std::string& ip, int port)
-        : server_ip(ip), server_port(port), running(false) {
+        : client_socket(INVALID_SOCKET), server_ip(ip), server_port(port), running(false) {
     }
     
     ~ChatClient() {
@@ -59,8 +72,7 @@ public:
     
     bool connect() {
         // Initialize Winsock
-        WSADATA wsaData;
-        if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        if (!initSockets()) {
             std::cerr << "WSAStartup failed" << std::endl;
             return false;
         }
@@ -69,7 +81,7 @@ public:
         client_socket = socket(AF_INET, SOCK_STREAM, 0);
         if (client_socket == INVALID_SOCKET) {
             std::cerr << "Error creating socket: " << WSAGetLastError() << std::endl;
-            WSACleanup();
+            cleanupSockets();
             return false;
         }
         
@@ -82,7 +94,8 @@ public:
         if (inet_pton(AF_INET, server_ip.c_str(), &server_addr.sin_addr) <= 0) {
             std::cerr << "Invalid address or address not supported" << std::endl;
             closesocket(client_socket);
-            WSACleanup();
+            client_socket = INVALID_SOCKET;
+            cleanupSockets();
             return false;
         }
         
@@ -90,7 +103,8 @@ public:
         if (::connect(client_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
             std::cerr << "Connection failed: " << WSAGetLastError() << std::endl;
             closesocket(client_socket);
-            WSACleanup();
+            client_socket = INVALID_SOCKET;
+            cleanupSockets();
             return false;
         }
         
@@ -143,14 +157,449 @@ public:
     }
     
     void disconnect() {
+        if (client_socket == INVALID_SOCKET) {
+            return;
+        }
         running = false;
         
+        // Unblock the receive thread
+        shutdown(client_socket, SHUT_RDWR);
         if (receive_thread.joinable()) {
             receive_thread.join();
         }
         
         closesocket(client_socket);
-        WSACleanup();
+        client_socket = INVALID_SOCKET;
+        cleanupSockets();
+    }
+};
+
+// Settings of the non-interactive mode
+struct ScriptOptions {
+    std::string path;     // script file, "-" = standard input
+    std::string username;
+    double rate;          // lines per second, 0 = as fast as possible
+    int repeat;           // times to run a script file
+    int timeout_ms;       // wait this long for outstanding echoes at the end
+    bool print;           // show what the server sends
+    bool compress;        // ask the server to compress what it sends
+
+    ScriptOptions() : rate(0), repeat(1), timeout_ms(5000), print(false), compress(false) {}
+};
+
+// Headless client for automation and traffic replay. Logs in with the
+// framed protocol, then sends the script's lines as fast as allowed
+// without waiting for replies. Every chat line's round trip is measured
+// until the server delivers it back to this connection.
+//
+// Script lines are sent as typed (chat text or commands). Empty lines and
+// lines starting with '#' are skipped; "@sleep MS" pauses the script.
+class ScriptClient {
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    // Stop reading the script while this much is waiting for the socket
+    static const size_t MAX_OUTPUT = 1024 * 1024;
+
+    const ScriptOptions& options;
+    SOCKET client_socket;
+    Poller poller;
+    std::istream* script;
+    std::ifstream script_file;
+    int runs_left;
+
+    size_t prompt_left; // plain-text prompt bytes still to skip
+    InputBuffer input;
+    // With compression asked for, the server's HELLO is read here first:
+    // it says whether the bytes after it are compressed
+    bool awaiting_hello;
+    std::string hello;
+#ifdef HAVE_ZLIB
+    std::unique_ptr<Inflater> inflater;
+#endif
+    std::vector<char> received_chunk;
+    std::string decompressed;
+    std::string output;
+    size_t output_offset;
+    bool write_interest;
+
+    bool logged_in;
+    bool script_done;
+    bool connected;
+    int64_t login_time_ms;  // wall clock; older records are history
+    Clock::time_point next_send;
+    Clock::time_point last_progress;
+
+    // Send times of chat lines waiting for their echo, by text
+    std::unordered_map<std::string, std::deque<Clock::time_point>> pending;
+    size_t pending_count;
+
+    static int64_t wallClockMs() {
+        return (int64_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    void queueFrame(uint8_t type, std::string_view payload) {
+        char header[FRAME_HEADER_SIZE];
+        writeFrameHeader(header, type, (uint32_t)payload.size());
+        output.append(header, FRAME_HEADER_SIZE);
+        output.append(payload.data(), payload.size());
+    }
+
+    bool flushOutput() {
+        while (output_offset < output.size()) {
+            int sent_now = ::send(client_socket, output.data() + output_offset,
+                                  (int)(output.size() - output_offset), SEND_FLAGS);
+            if (sent_now < 0) {
+                if (!socketWouldBlock()) {
+                    return false;
+                }
+                break;
+            }
+            output_offset += sent_now;
+        }
+        if (output_offset == output.size()) {
+            output.clear();
+            output_offset = 0;
+        }
+
+        bool want_write = !output.empty();
+        if (want_write != write_interest) {
+            poller.modify(client_socket, Poller::READABLE | (want_write ? Poller::WRITABLE : 0));
+            write_interest = want_write;
+        }
+        return true;
+    }
+
+    // Next line to send, or false at the end of the script
+    bool nextLine(std::string& line) {
+        while (true) {
+            if (std::getline(*script, line)) {
+                if (!line.empty() && line.back() == '\r') {
+                    line.pop_back();
+                }
+                return true;
+            }
+            if (--runs_left <= 0 || script != &script_file) {
+                return false;
+            }
+            script_file.clear();
+            script_file.seekg(0);
+        }
+    }
+
+    // Queue script lines that are due
+    void sendDue() {
+        Clock::time_point now = Clock::now();
+        std::string line;
+        while (!script_done && output.size() < MAX_OUTPUT && now >= next_send) {
+            if (!nextLine(line)) {
+                script_done = true;
+                last_progress = now;
+                break;
+            }
+            if (line.empty() || line[0] == '#') {
+                continue;
+            }
+            if (line.compare(0, 7, "@sleep ") == 0) {
+                next_send = now + std::chrono::milliseconds(std::atol(line.c_str() + 7));
+                break;
+            }
+
+            queueFrame(FRAME_TEXT, line);
+            if (line[0] == '/') {
+                commands++;
+            } else {
+                pending[line].push_back(now);
+                pending_count++;
+                sent++;
+            }
+            if (options.rate > 0) {
+                next_send = std::max(next_send, now - std::chrono::milliseconds(100)) +
+                            std::chrono::microseconds((int64_t)(1e6 / options.rate));
+            }
+        }
+        if (!flushOutput()) {
+            connected = false;
+        }
+    }
+
+    // Reads the HELLO answer out of data; false until it is complete
+    bool readHello(std::string_view& data) {
+        hello.append(data.data(), data.size());
+        data = std::string_view();
+        if (hello.size() < FRAME_HEADER_SIZE) {
+            return false;
+        }
+        uint32_t length = ((uint32_t)(uint8_t)hello[0] << 24) | ((uint32_t)(uint8_t)hello[1] << 16) |
+                          ((uint32_t)(uint8_t)hello[2] << 8) | (uint32_t)(uint8_t)hello[3];
+        if ((uint8_t)hello[4] != FRAME_HELLO || length > 2) {
+            // Refused (a NOTICE says why); parse it as it is
+            awaiting_hello = false;
+            data = hello;
+            return true;
+        }
+        if (hello.size() < FRAME_HEADER_SIZE + length) {
+            return false;
+        }
+        awaiting_hello = false;
+        bool granted = length == 2 && ((uint8_t)hello[FRAME_HEADER_SIZE + 1] & HELLO_DEFLATE);
+#ifdef HAVE_ZLIB
+        if (granted) {
+            inflater.reset(new Inflater());
+        }
+#endif
+        if (!granted) {
+            std::cerr << "The server does not compress, continuing without" << std::endl;
+        }
+        data = std::string_view(hello).substr(FRAME_HEADER_SIZE + length);
+        return true;
+    }
+
+    // Received bytes of a connection that asked for compression, handed
+    // to the frame parser once decompressed
+    bool decode(std::string_view data) {
+        bytes_received += data.size();
+        if (awaiting_hello && !readHello(data)) {
+            return true;
+        }
+#ifdef HAVE_ZLIB
+        if (inflater) {
+            decompressed.clear();
+            if (!inflater->write(decompressed, data.data(), data.size())) {
+                return false;
+            }
+            data = decompressed;
+        }
+#endif
+        bytes_decoded += data.size();
+        if (!data.empty()) {
+            memcpy(input.reserve(data.size()), data.data(), data.size());
+            input.commit(data.size());
+        }
+        return true;
+    }
+
+    void handleReadable() {
+        const size_t READ_CHUNK = 64 * 1024;
+        char* space = options.compress ? received_chunk.data() : input.reserve(READ_CHUNK);
+        int bytes_read = recv(client_socket, space, (int)READ_CHUNK, 0);
+        if (bytes_read < 0 && socketWouldBlock()) {
+            return;
+        }
+        if (bytes_read <= 0) {
+            std::cerr << "Disconnected from server." << std::endl;
+            connected = false;
+            return;
+        }
+
+        // The prompt comes before any frame
+        size_t skip = std::min(prompt_left, (size_t)bytes_read);
+        prompt_left -= skip;
+        if (options.compress) {
+            if (!decode(std::string_view(space + skip, bytes_read - skip))) {
+                std::cerr << "Corrupt compressed data from server" << std::endl;
+                connected = false;
+                return;
+            }
+        } else {
+            if (skip > 0) {
+                memmove(space, space + skip, bytes_read - skip);
+            }
+            input.commit(bytes_read - skip);
+        }
+
+        uint8_t type;
+        std::string_view payload;
+        InputBuffer::Result result;
+        while ((result = input.nextFrame(type, payload)) == InputBuffer::COMPLETE) {
+            handleFrame(type, payload);
+        }
+        if (result == InputBuffer::INVALID) {
+            std::cerr << "Protocol error from server" << std::endl;
+            connected = false;
+        }
+        input.release();
+    }
+
+    void handleFrame(uint8_t type, std::string_view payload) {
+        if (type == FRAME_NOTICE) {
+            if (!logged_in && payload.compare(0, 7, "Welcome") == 0) {
+                logged_in = true;
+                login_time_ms = wallClockMs();
+                next_send = Clock::now();
+            } else if (!logged_in && (payload.compare(0, 8, "Username") == 0 ||
+                                      payload.compare(0, 8, "Protocol") == 0)) {
+                std::cerr << "Login failed: " << payload;
+            }
+            if (options.print) {
+                std::cout << payload << std::flush;
+            }
+            return;
+        }
+
+        RecordView record;
+        if (type != FRAME_RECORD || !parseRecord(payload, record)) {
+            return;
+        }
+        received++;
+        if (options.print) {
+            printRecord(record);
+        }
+
+        // Our own chat lines come back once the room has them; replayed
+        // history from before this login does not count
+        if (record.sender != options.username || record.time_ms < login_time_ms - 1000) {
+            return;
+        }
+        auto it = pending.find(std::string(record.content));
+        if (it == pending.end()) {
+            return;
+        }
+        Clock::time_point now = Clock::now();
+        latency.record((uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+            now - it->second.front()).count());
+        it->second.pop_front();
+        if (it->second.empty()) {
+            pending.erase(it);
+        }
+        pending_count--;
+        echoed++;
+        last_progress = now;
+    }
+
+    static void printRecord(const RecordView& record) {
+        time_t seconds = (time_t)(record.time_ms / 1000);
+        char stamp[16];
+        strftime(stamp, sizeof(stamp), "%H:%M:%S", localtime(&seconds));
+        std::cout << "[" << stamp << "] ";
+        if (record.room != "lobby") {
+            std::cout << "#" << record.room << " ";
+        }
+        std::cout << record.sender << ": " << record.content << "\n";
+    }
+
+    bool finished() const {
+        if (!connected) {
+            return true;
+        }
+        if (!script_done || !output.empty()) {
+            return false;
+        }
+        return pending_count == 0 ||
+               Clock::now() - last_progress >= std::chrono::milliseconds(options.timeout_ms);
+    }
+
+public:
+    // Results
+    uint64_t sent;     // chat lines
+    uint64_t commands; // lines starting with '/'
+    uint64_t echoed;
+    uint64_t received; // RECORD frames from anyone
+    uint64_t bytes_received; // with compression: on the wire...
+    uint64_t bytes_decoded;  // ...and decompressed
+    Histogram latency; // nanoseconds, send until echoed
+
+    explicit ScriptClient(const ScriptOptions& script_options)
+        : options(script_options), client_socket(INVALID_SOCKET), script(nullptr),
+          runs_left(script_options.repeat), prompt_left(strlen(PROMPT)),
+          awaiting_hello(script_options.compress), output_offset(0),
+          write_interest(false), logged_in(false), script_done(false), connected(false),
+          login_time_ms(0), pending_count(0), sent(0), commands(0), echoed(0), received(0),
+          bytes_received(0), bytes_decoded(0) {
+        if (options.compress) {
+            received_chunk.resize(64 * 1024);
+        }
+    }
+
+    ~ScriptClient() {
+        if (client_socket != INVALID_SOCKET) {
+            closesocket(client_socket);
+        }
+    }
+
+    bool connect(const std::string& server_ip, int server_port) {
+        if (options.path == "-") {
+            script = &std::cin;
+        } else {
+            script_file.open(options.path);
+            if (!script_file) {
+                std::cerr << "Cannot open script " << options.path << std::endl;
+                return false;
+            }
+            script = &script_file;
+        }
+
+        struct sockaddr_in server_addr;
+        memset(&server_addr, 0, sizeof(server_addr));
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_port = htons(server_port);
+        if (inet_pton(AF_INET, server_ip.c_str(), &server_addr.sin_addr) <= 0) {
+            std::cerr << "Invalid address or address not supported" << std::endl;
+            return false;
+        }
+        client_socket = socket(AF_INET, SOCK_STREAM, 0);
+        if (client_socket == INVALID_SOCKET ||
+            ::connect(client_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+            std::cerr << "Connection failed: " << WSAGetLastError() << std::endl;
+            return false;
+        }
+        // Lines are batched here already; do not let Nagle hold them back
+        int no_delay = 1;
+        setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, (const char*)&no_delay, sizeof(no_delay));
+        if (!setNonBlocking(client_socket) || !poller.open() ||
+            !poller.add(client_socket, Poller::READABLE)) {
+            std::cerr << "Setting up the connection failed" << std::endl;
+            return false;
+        }
+        connected = true;
+
+        // Login is pipelined; the script starts once the server welcomes us
+        char hello[2] = {(char)PROTOCOL_VERSION, (char)HELLO_DEFLATE};
+        queueFrame(FRAME_HELLO, std::string_view(hello, options.compress ? 2 : 1));
+        queueFrame(FRAME_TEXT, options.username);
+        return flushOutput();
+    }
+
+    void run() {
+        std::vector<Poller::Event> ready;
+        while (!finished()) {
+            if (logged_in) {
+                sendDue();
+            }
+
+            int timeout_ms = 100;
+            if (logged_in && !script_done && output.size() < MAX_OUTPUT) {
+                auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(next_send - Clock::now());
+                timeout_ms = (int)std::max<int64_t>(0, std::min<int64_t>(wait.count(), 100));
+            }
+            poller.wait(ready, timeout_ms);
+            for (const auto& event : ready) {
+                if (event.events & (Poller::READABLE | Poller::CLOSED)) {
+                    handleReadable();
+                }
+                if (connected && (event.events & Poller::WRITABLE) && !flushOutput()) {
+                    connected = false;
+                }
+            }
+        }
+    }
+
+    void report(double seconds) const {
+        printf("Sent %llu chat lines and %llu commands in %.2f s (%.0f lines/s)\n",
+               (unsigned long long)sent, (unsigned long long)commands, seconds,
+               seconds > 0 ? (double)sent / seconds : 0.0);
+        printf("Echoed %llu of %llu, %llu messages received\n", (unsigned long long)echoed,
+               (unsigned long long)sent, (unsigned long long)received);
+        if (latency.count() > 0) {
+            printf("Round trip ms: p50 %.3f  p90 %.3f  p99 %.3f  p999 %.3f  max %.3f\n",
+                   latency.percentile(50) / 1e6, latency.percentile(90) / 1e6,
+                   latency.percentile(99) / 1e6, latency.percentile(99.9) / 1e6, latency.max() / 1e6);
+        }
+        if (options.compress && bytes_decoded > 0) {
+            printf("Received %llu bytes for %llu decompressed (%.1f%%)\n", (unsigned long long)bytes_received,
+                   (unsigned long long)bytes_decoded, 100.0 * (double)bytes_received / (double)bytes_decoded);
+        }
     }
 };
 
@@ -161,17 +610,82 @@ void printHelp() {
     std::cout << "Any other text is sent to all connected users." << std::endl;
 }
 
+void printUsage(const char* program) {
+    std::cout << "Usage: " << program << " [server_ip] [port] [options]" << std::endl;
+    std::cout << "  --script FILE     run without a terminal: send the lines of FILE" << std::endl;
+    std::cout << "                    (- = standard input) and report round-trip times" << std::endl;
+    std::cout << "  --user NAME       username in script mode (default script<number>)" << std::endl;
+    std::cout << "  --rate N          script lines per second (default: as fast as possible)" << std::endl;
+    std::cout << "  --repeat N        run the script file N times (default 1)" << std::endl;
+    std::cout << "  --timeout-ms N    wait for missing echoes at the end (default 5000)" << std::endl;
+    std::cout << "  --print           print what the server sends" << std::endl;
+    std::cout << "  --compress        ask the server to compress what it sends" << std::endl;
+}
+
+int runScript(const std::string& server_ip, int server_port, const ScriptOptions& options) {
+    if (!initSockets()) {
+        std::cerr << "WSAStartup failed" << std::endl;
+        return 1;
+    }
+    int status = 1;
+    {
+        ScriptClient client(options);
+        if (client.connect(server_ip, server_port)) {
+            auto start = std::chrono::steady_clock::now();
+            client.run();
+            client.report(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+            status = client.echoed == client.sent ? 0 : 2;
+        }
+    }
+    cleanupSockets();
+    return status;
+}
+
 int main(int argc, char* argv[]) {
     std::string server_ip = "127.0.0.1"; // Default to localhost
     int server_port = 8080; // Default port
-    
+    ScriptOptions script;
+    int positional = 0;
+
     // Parse command line arguments
-    if (argc > 1) {
-        server_ip = argv[1];
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--script" && has_value) {
+            script.path = argv[++i];
+        } else if (arg == "--user" && has_value) {
+            script.username = argv[++i];
+        } else if (arg == "--rate" && has_value) {
+            script.rate = std::atof(argv[++i]);
+        } else if (arg == "--repeat" && has_value) {
+            script.repeat = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--timeout-ms" && has_value) {
+            script.timeout_ms = std::atoi(argv[++i]);
+        } else if (arg == "--print") {
+            script.print = true;
+        } else if (arg == "--compress") {
+#ifndef HAVE_ZLIB
+            std::cerr << "Built without zlib, --compress is not available" << std::endl;
+            return 1;
+#endif
+            script.compress = true;
+        } else if (!arg.empty() && arg[0] != '-' && positional == 0) {
+            server_ip = arg;
+            positional++;
+        } else if (!arg.empty() && arg[0] != '-' && positional == 1) {
+            server_port = std::stoi(arg);
+            positional++;
+        } else {
+            printUsage(argv[0]);
+            return arg == "--help" ? 0 : 1;
+        }
     }
-    
-    if (argc > 2) {
-        server_port = std::stoi(argv[2]);
+
+    if (!script.path.empty()) {
+        if (script.username.empty()) {
+            script.username = "script" + std::to_string(std::chrono::system_clock::now().time_since_epoch().count() % 1000000);
+        }
+        return runScript(server_ip, server_port, script);
     }
     
     std::cout << "Simple Chat Client" << std::endl;
@@ -189,4 +703,4 @@ int main(int argc, char* argv[]) {
     
     std::cout << "Client disconnected" << std::endl;
     return 0;
-} 
\ No newline at end of file
+}
@@ -0,0 +1,818 @@
+#include "cluster.h"
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+
+#ifndef _WIN32
+#include <netdb.h>
+#endif
+
+// Relay sequence a node asks for when it has never heard of the peer:
+// nothing old, only what is relayed from now on
+static const uint64_t ONLY_NEW = UINT64_MAX;
+
+static int64_t wallClockMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+static bool parseAddress(const std::string& address, struct sockaddr_in& out) {
+    size_t colon = address.rfind(':');
+    if (colon == std::string::npos || colon == 0 || colon + 1 == address.size()) {
+        return false;
+    }
+    std::string host = address.substr(0, colon);
+    int port = atoi(address.c_str() + colon + 1);
+    if (port <= 0 || port > 65535) {
+        return false;
+    }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* result = nullptr;
+    if (getaddrinfo(host.c_str(), nullptr, &hints, &result) != 0 || !result) {
+        return false;
+    }
+    memcpy(&out, result->ai_addr, sizeof(out));
+    out.sin_port = htons(port);
+    freeaddrinfo(result);
+    return true;
+}
+
+// Cluster implementation
+Cluster::Cluster(ChatServer& owner, uint32_t node, int cluster_port, const std::vector<std::string>& peer_addresses)
+    : server(owner), node_id(node), incarnation((uint64_t)wallClockMs()), port(cluster_port),
+      listen_socket(INVALID_SOCKET), running(false), wake_pending(false), metrics(nullptr), next_seq(1) {
+    for (const auto& address : peer_addresses) {
+        Peer peer;
+        peer.address = address;
+        memset(&peer.addr, 0, sizeof(peer.addr));
+        peer.socket = INVALID_SOCKET;
+        peer.node = 0;
+        peers.push_back(peer);
+    }
+}
+
+Cluster::~Cluster() {
+    stop();
+    while (!links.empty()) {
+        closeLink(links.begin()->first);
+    }
+    poller.close();
+    if (listen_socket != INVALID_SOCKET) {
+        closesocket(listen_socket);
+    }
+}
+
+bool Cluster::listen() {
+    if (!poller.open()) {
+        std::cerr << "Error creating the cluster poller" << std::endl;
+        return false;
+    }
+    for (auto& peer : peers) {
+        if (!parseAddress(peer.address, peer.addr)) {
+            std::cerr << "Invalid peer address (expected host:port): " << peer.address << std::endl;
+            return false;
+        }
+    }
+    if (port <= 0) {
+        return true; // Only dials out
+    }
+    if (listen_socket != INVALID_SOCKET) {
+        // Handed over by the previous process, already bound and listening
+        if (!poller.add(listen_socket, Poller::READABLE)) {
+            std::cerr << "Error adopting the cluster port " << port << ": " << WSAGetLastError() << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    listen_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_socket == INVALID_SOCKET) {
+        std::cerr << "Error creating cluster socket: " << WSAGetLastError() << std::endl;
+        return false;
+    }
+    int opt = 1;
+    setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, (char*)&opt, sizeof(opt));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+
+    if (bind(listen_socket, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        ::listen(listen_socket, SOMAXCONN) < 0 || !setNonBlocking(listen_socket) ||
+        !poller.add(listen_socket, Poller::READABLE)) {
+        std::cerr << "Error setting up the cluster port " << port << ": " << WSAGetLastError() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void Cluster::start() {
+    running = true;
+    relay_thread = std::thread(&Cluster::serve, this);
+}
+
+void Cluster::stop() {
+    running = false;
+    poller.wakeup();
+    if (relay_thread.joinable()) {
+        relay_thread.join();
+    }
+}
+
+void Cluster::exportState(std::string& state, std::vector<std::string>& relayed) {
+    // The sequencer was drained into our queue after the thread stopped
+    drainEvents();
+    putVarint(state, node_id);
+    putVarint(state, incarnation);
+    putVarint(state, next_seq);
+    putVarint(state, origins.size());
+    for (const auto& origin : origins) {
+        putVarint(state, origin.first);
+        putVarint(state, origin.second.incarnation);
+        putVarint(state, origin.second.last_seq);
+    }
+    putVarint(state, local_users.size());
+    for (const auto& user : local_users) {
+        putVarint(state, (uint64_t)user.second);
+        putString(state, user.first);
+    }
+    for (const auto& entry : backlog) {
+        std::string encoded;
+        putVarint(encoded, entry.seq);
+        putString(encoded, entry.recipient);
+        encoded += entry.frame;
+        relayed.push_back(std::move(encoded));
+    }
+}
+
+SOCKET Cluster::getListenSocket() const {
+    return listen_socket;
+}
+
+bool Cluster::restoreState(std::string_view state, SOCKET listener) {
+    uint64_t node, restored_incarnation, restored_seq, count;
+    if (!getVarint(state, node) || !getVarint(state, restored_incarnation) ||
+        !getVarint(state, restored_seq) || !getVarint(state, count)) {
+        if (listener != INVALID_SOCKET) {
+            closesocket(listener);
+        }
+        return false;
+    }
+    // A listener on another port than ours is of no use
+    struct sockaddr_in bound;
+    socklen_t length = sizeof(bound);
+    if (listener != INVALID_SOCKET &&
+        (getsockname(listener, (struct sockaddr*)&bound, &length) != 0 || ntohs(bound.sin_port) != port)) {
+        closesocket(listener);
+        listener = INVALID_SOCKET;
+    }
+    listen_socket = listener;
+
+    std::unordered_map<uint32_t, OriginState> restored_origins;
+    for (uint64_t i = 0; i < count; i++) {
+        uint64_t origin, origin_incarnation, last_seq;
+        if (!getVarint(state, origin) || !getVarint(state, origin_incarnation) || !getVarint(state, last_seq)) {
+            return false;
+        }
+        restored_origins[(uint32_t)origin] = OriginState{origin_incarnation, last_seq};
+    }
+    if (!getVarint(state, count)) {
+        return false;
+    }
+    for (uint64_t i = 0; i < count; i++) {
+        uint64_t login_ms;
+        std::string_view username;
+        if (!getVarint(state, login_ms) || !getString(state, username)) {
+            return false;
+        }
+        local_users[std::string(username)] = (int64_t)login_ms;
+    }
+
+    // The users are ours either way, the sequences only as the same node
+    if (node != node_id) {
+        std::cout << "The previous process was cluster node " << node << ", not continuing its relay state"
+                  << std::endl;
+        return true;
+    }
+    incarnation = restored_incarnation;
+    next_seq = restored_seq;
+    origins.swap(restored_origins);
+    return true;
+}
+
+bool Cluster::restoreRelayed(std::string_view entry) {
+    uint64_t seq;
+    std::string_view recipient;
+    if (!getVarint(entry, seq) || !getString(entry, recipient) || entry.size() < FRAME_HEADER_SIZE) {
+        return false;
+    }
+    if (seq >= next_seq) {
+        return true; // Not ours (see restoreState())
+    }
+    backlog.push_back(Relayed{seq, std::string(entry), std::string(recipient)});
+    if (backlog.size() > BACKLOG_MESSAGES) {
+        backlog.pop_front();
+    }
+    return true;
+}
+
+void Cluster::relay(const SharedBuffer& encoded) {
+    push(Event{Event::RELAY, encoded, std::string(), 0});
+}
+
+void Cluster::announceLogin(const std::string& username) {
+    push(Event{Event::ONLINE, nullptr, username, wallClockMs()});
+}
+
+void Cluster::announceLogout(const std::string& username) {
+    push(Event{Event::OFFLINE, nullptr, username, 0});
+}
+
+bool Cluster::isRemoteUser(const std::string& username) {
+    return remote_users.find(username) != nullptr;
+}
+
+void Cluster::push(Event event) {
+    events.push(std::move(event));
+    // One wakeup per burst: the relay thread clears the flag before draining
+    if (!wake_pending.exchange(true)) {
+        poller.wakeup();
+    }
+}
+
+void Cluster::serve() {
+    metrics = &threadMetrics();
+    std::vector<Poller::Event> ready;
+    while (running) {
+        connectPeers();
+        poller.wait(ready, nextTimeout());
+        for (const auto& event : ready) {
+            if (event.fd == listen_socket) {
+                acceptLinks();
+                continue;
+            }
+            auto it = links.find(event.fd);
+            if (it == links.end()) {
+                continue;
+            }
+            Link& link = *it->second;
+            if (link.connecting) {
+                finishConnect(link);
+                continue;
+            }
+            if (event.events & (Poller::READABLE | Poller::CLOSED)) {
+                handleReadable(link);
+            }
+            if ((event.events & Poller::WRITABLE) && !link.failed) {
+                flushLink(link);
+            }
+        }
+        wake_pending.store(false);
+        drainEvents();
+        reapLinks();
+    }
+}
+
+int Cluster::nextTimeout() const {
+    int timeout = -1;
+    Clock::time_point now = Clock::now();
+    for (const auto& peer : peers) {
+        if (peer.socket != INVALID_SOCKET) {
+            continue;
+        }
+        int wait = (int)std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::milliseconds>(
+            peer.retry_at - now).count());
+        if (timeout < 0 || wait < timeout) {
+            timeout = wait;
+        }
+    }
+    return timeout;
+}
+
+void Cluster::connectPeers() {
+    Clock::time_point now = Clock::now();
+    for (size_t i = 0; i < peers.size(); i++) {
+        Peer& peer = peers[i];
+        if (peer.socket != INVALID_SOCKET || now < peer.retry_at) {
+            continue;
+        }
+        peer.retry_at = now + std::chrono::milliseconds(RECONNECT_MS);
+        if (peer.node != 0 && linkedTo(peer.node)) {
+            continue; // It dialed us and that link won
+        }
+
+        SOCKET socket = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (socket == INVALID_SOCKET) {
+            continue;
+        }
+        if (!setNonBlocking(socket) ||
+            (connect(socket, (struct sockaddr*)&peer.addr, sizeof(peer.addr)) != 0 && !connectPending())) {
+            closesocket(socket);
+            continue;
+        }
+        addLink(socket, (int)i, true);
+    }
+}
+
+void Cluster::acceptLinks() {
+    while (true) {
+        SOCKET socket = accept(listen_socket, NULL, NULL);
+        if (socket == INVALID_SOCKET) {
+            return;
+        }
+        if (!setNonBlocking(socket)) {
+            closesocket(socket);
+            continue;
+        }
+        addLink(socket, -1, false);
+    }
+}
+
+void Cluster::addLink(SOCKET socket, int peer, bool connecting) {
+    if (!poller.add(socket, connecting ? Poller::READABLE | Poller::WRITABLE : Poller::READABLE)) {
+        closesocket(socket);
+        return;
+    }
+    // Relayed messages are small and latency matters
+    int nodelay = 1;
+    setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, (char*)&nodelay, sizeof(nodelay));
+
+    std::unique_ptr<Link> link(new Link());
+    link->socket = socket;
+    link->peer = peer;
+    link->connecting = connecting;
+    link->node = 0;
+    link->live = false;
+    link->failed = false;
+    link->output_offset = 0;
+    link->write_interest = connecting;
+    if (peer >= 0) {
+        peers[peer].socket = socket;
+    }
+    Link& added = *link;
+    links[socket] = std::move(link);
+    if (!connecting) {
+        sendHello(added);
+    }
+}
+
+void Cluster::finishConnect(Link& link) {
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if (getsockopt(link.socket, SOL_SOCKET, SO_ERROR, (char*)&error, &length) != 0 || error != 0) {
+        link.failed = true; // Peer not up (yet), retried later
+        return;
+    }
+    link.connecting = false;
+    sendHello(link);
+}
+
+void Cluster::sendHello(Link& link) {
+    std::string payload;
+    putVarint(payload, node_id);
+    putVarint(payload, incarnation);
+    sendFrame(link, LINK_HELLO, payload);
+}
+
+void Cluster::handleReadable(Link& link) {
+    char buffer[64 * 1024];
+    while (true) {
+        int bytes_read = recv(link.socket, buffer, sizeof(buffer), 0);
+        if (bytes_read < 0 && socketWouldBlock()) {
+            break;
+        }
+        if (bytes_read <= 0) {
+            link.failed = true;
+            return;
+        }
+        link.input.append(buffer, bytes_read);
+    }
+
+    size_t position = 0;
+    while (link.input.size() - position >= FRAME_HEADER_SIZE) {
+        const unsigned char* header = (const unsigned char*)link.input.data() + position;
+        uint32_t length = ((uint32_t)header[0] << 24) | ((uint32_t)header[1] << 16) |
+                          ((uint32_t)header[2] << 8) | (uint32_t)header[3];
+        if (length > MAX_LINK_PAYLOAD) {
+            std::cerr << "Oversized frame on a cluster link" << std::endl;
+            link.failed = true;
+            return;
+        }
+        if (link.input.size() - position < FRAME_HEADER_SIZE + length) {
+            break;
+        }
+        std::string_view payload(link.input.data() + position + FRAME_HEADER_SIZE, length);
+        if (!handleFrame(link, header[4], payload)) {
+            link.failed = true;
+            return;
+        }
+        position += FRAME_HEADER_SIZE + length;
+    }
+    link.input.erase(0, position);
+}
+
+bool Cluster::handleFrame(Link& link, uint8_t type, std::string_view payload) {
+    if (link.node == 0 && type != LINK_HELLO) {
+        return false;
+    }
+    switch (type) {
+    case LINK_HELLO:
+        return link.node == 0 && handleHello(link, payload);
+    case LINK_SYNC: {
+        uint64_t resume;
+        if (!getVarint(payload, resume)) {
+            return false;
+        }
+        if (!link.live) {
+            handleSync(link, resume);
+        }
+        return true;
+    }
+    case LINK_MESSAGE:
+        return handleMessage(payload);
+    case LINK_PRESENCE:
+        return handlePresence(link, payload);
+    default:
+        return true; // From a newer node; ignored
+    }
+}
+
+bool Cluster::handleHello(Link& link, std::string_view payload) {
+    uint64_t node, peer_incarnation;
+    if (!getVarint(payload, node) || !getVarint(payload, peer_incarnation) || node == 0 || node > UINT32_MAX) {
+        return false;
+    }
+    if (node == node_id) {
+        std::cerr << "Cluster link to a node with our own id " << node_id << ", closing it" << std::endl;
+        return false;
+    }
+
+    auto known = origins.find((uint32_t)node);
+    bool restarted = known != origins.end() && known->second.incarnation != peer_incarnation;
+
+    // Both ends dialed each other at once: keep the link the lower id
+    // dialed, the peer decides the same way. A link to an earlier run of
+    // the peer is stale anyway.
+    uint32_t dialer = link.peer >= 0 ? node_id : (uint32_t)node;
+    for (auto& entry : links) {
+        Link& other = *entry.second;
+        if (&other == &link || other.failed || other.node != node) {
+            continue;
+        }
+        if (restarted || dialer == std::min(node_id, (uint32_t)node)) {
+            other.failed = true;
+        } else {
+            return false;
+        }
+    }
+    link.node = (uint32_t)node;
+    if (link.peer >= 0) {
+        peers[link.peer].node = link.node;
+    }
+
+    // Ask for what we missed while disconnected
+    uint64_t resume;
+    if (known == origins.end()) {
+        origins[link.node] = OriginState{peer_incarnation, 0};
+        resume = ONLY_NEW;
+    } else if (restarted) {
+        known->second = OriginState{peer_incarnation, 0};
+        resume = 0;
+    } else {
+        resume = known->second.last_seq;
+    }
+    // Our users first: the peer filters the direct messages it replays
+    // by who lives here
+    for (const auto& user : local_users) {
+        sendPresence(link, true, user.first, user.second);
+    }
+    std::string sync;
+    putVarint(sync, resume);
+    sendFrame(link, LINK_SYNC, sync);
+    std::cout << "Linked to cluster node " << node
+              << (link.peer >= 0 ? " at " + peers[link.peer].address : std::string()) << std::endl;
+    return true;
+}
+
+void Cluster::handleSync(Link& link, uint64_t resume) {
+    if (resume != ONLY_NEW) {
+        if (!backlog.empty() && resume + 1 < backlog.front().seq) {
+            std::cerr << "Node " << link.node << " missed " << backlog.front().seq - resume - 1
+                      << " relayed messages (backlog exceeded)" << std::endl;
+        }
+        // The peer announced its users before this, see handleHello()
+        for (const auto& entry : backlog) {
+            if (entry.seq <= resume) {
+                continue;
+            }
+            if (!entry.recipient.empty()) {
+                std::shared_ptr<RemoteUser> user = remote_users.find(entry.recipient);
+                if (!user || user->node != link.node) {
+                    continue;
+                }
+            }
+            sendRaw(link, entry.frame);
+            metrics->relayed_out.add(1);
+        }
+    }
+    link.live = true;
+}
+
+bool Cluster::handleMessage(std::string_view payload) {
+    uint64_t origin, seq;
+    if (!getVarint(payload, origin) || !getVarint(payload, seq)) {
+        return false;
+    }
+    Message msg;
+    if (!decodeRecord(payload, msg) || !msg.room || msg.room->empty()) {
+        std::cerr << "Corrupt message on a cluster link" << std::endl;
+        return false;
+    }
+    if (origin == node_id) {
+        return true;
+    }
+    OriginState& state = origins[(uint32_t)origin];
+    if (seq <= state.last_seq) {
+        metrics->relay_duplicates.add(1);
+        return true;
+    }
+    state.last_seq = seq;
+    metrics->relayed_in.add(1);
+
+    // The decoded text points into the link's input buffer
+    Message local(msg.sender, msg.content.view());
+    local.room = msg.room;
+    local.time_ms = msg.time_ms;
+
+    const std::string& room = *msg.room;
+    if (room[0] == '@') {
+        std::shared_ptr<Client> target = server.clients.find(room.substr(1));
+        if (target) {
+            server.shards[target->getShard()]->post(Broadcast{nullptr, 0, local.encode(), target});
+        }
+        return true;
+    }
+    if (!validRoomName(room)) {
+        std::cerr << "Relayed message for an invalid room name ignored" << std::endl;
+        return true;
+    }
+    // Sequenced into our copy of the room, not relayed again
+    server.sequencer.submit(server.openRoom(room), std::move(local), false);
+    return true;
+}
+
+bool Cluster::handlePresence(Link& link, std::string_view payload) {
+    uint64_t login_ms;
+    if (payload.empty()) {
+        return false;
+    }
+    bool online = payload[0] != 0;
+    payload.remove_prefix(1);
+    if (!getVarint(payload, login_ms) || payload.empty()) {
+        return false;
+    }
+    std::string username(payload);
+    auto claim = std::make_pair((int64_t)login_ms, link.node);
+
+    std::shared_ptr<RemoteUser> existing = remote_users.find(username);
+    if (!online) {
+        if (existing && existing->node == link.node) {
+            remote_users.erase(username, existing);
+        }
+        users_by_node[link.node].erase(username);
+        return true;
+    }
+
+    // Earlier login wins, then the lower node id
+    auto local = local_users.find(username);
+    if (local != local_users.end()) {
+        if (std::make_pair(local->second, node_id) < claim) {
+            return true; // Ours stays; the peer disconnects its user
+        }
+        evictLocal(username, link.node);
+    }
+    if (existing) {
+        if (existing->node != link.node && std::make_pair(existing->login_ms, existing->node) < claim) {
+            return true; // A third node holds it
+        }
+        remote_users.erase(username, existing);
+        users_by_node[existing->node].erase(username);
+    }
+    remote_users.insert(username, std::make_shared<RemoteUser>(RemoteUser{link.node, (int64_t)login_ms}));
+    users_by_node[link.node].insert(username);
+    return true;
+}
+
+void Cluster::drainEvents() {
+    Event event;
+    while (events.pop(event)) {
+        switch (event.kind) {
+        case Event::RELAY:
+            relayMessage(event.encoded);
+            break;
+        case Event::ONLINE:
+            userOnline(event.username, event.login_ms);
+            break;
+        case Event::OFFLINE:
+            userOffline(event.username);
+            break;
+        }
+    }
+}
+
+void Cluster::relayMessage(const SharedBuffer& encoded) {
+    // The RECORD payload goes out as it is, after our origin and sequence
+    const unsigned char* header = (const unsigned char*)encoded->data();
+    uint32_t length = ((uint32_t)header[0] << 24) | ((uint32_t)header[1] << 16) |
+                      ((uint32_t)header[2] << 8) | (uint32_t)header[3];
+    std::string_view record(encoded->data() + FRAME_HEADER_SIZE, length);
+
+    uint64_t seq = next_seq++;
+    std::string frame(FRAME_HEADER_SIZE, '\0');
+    putVarint(frame, node_id);
+    putVarint(frame, seq);
+    frame.append(record.data(), record.size());
+    writeFrameHeader(&frame[0], LINK_MESSAGE, (uint32_t)(frame.size() - FRAME_HEADER_SIZE));
+
+    // A direct message only goes to the recipient's node, if we know it
+    uint32_t only_node = 0;
+    std::string recipient;
+    RecordView view;
+    if (parseRecord(record, view) && !view.room.empty() && view.room[0] == '@') {
+        recipient = std::string(view.room.substr(1));
+        std::shared_ptr<RemoteUser> user = remote_users.find(recipient);
+        if (user) {
+            only_node = user->node;
+        }
+    }
+
+    for (auto& entry : links) {
+        Link& link = *entry.second;
+        if (link.live && !link.failed && (only_node == 0 || link.node == only_node)) {
+            sendRaw(link, frame);
+            metrics->relayed_out.add(1);
+        }
+    }
+    backlog.push_back(Relayed{seq, std::move(frame), std::move(recipient)});
+    if (backlog.size() > BACKLOG_MESSAGES) {
+        backlog.pop_front();
+    }
+}
+
+void Cluster::userOnline(const std::string& username, int64_t login_ms) {
+    std::shared_ptr<RemoteUser> remote = remote_users.find(username);
+    if (remote) {
+        // Both nodes accepted the name before hearing of the other
+        if (std::make_pair(remote->login_ms, remote->node) < std::make_pair(login_ms, node_id)) {
+            local_users[username] = login_ms;
+            evictLocal(username, remote->node);
+            return;
+        }
+        remote_users.erase(username, remote);
+        users_by_node[remote->node].erase(username);
+    }
+    local_users[username] = login_ms;
+    for (auto& entry : links) {
+        Link& link = *entry.second;
+        if (link.node != 0 && !link.failed) {
+            sendPresence(link, true, username, login_ms);
+        }
+    }
+}
+
+void Cluster::userOffline(const std::string& username) {
+    // Not there if the name was lost to another node
+    if (local_users.erase(username) == 0) {
+        return;
+    }
+    for (auto& entry : links) {
+        Link& link = *entry.second;
+        if (link.node != 0 && !link.failed) {
+            sendPresence(link, false, username, 0);
+        }
+    }
+}
+
+void Cluster::evictLocal(const std::string& username, uint32_t winner) {
+    local_users.erase(username);
+    std::shared_ptr<Client> client = server.clients.find(username);
+    if (!client) {
+        return;
+    }
+    std::cout << "Username " << username << " is taken on node " << winner
+              << ", disconnecting the local user" << std::endl;
+    Broadcast evict = {nullptr, 0, nullptr, client};
+    evict.disconnect = true;
+    server.shards[client->getShard()]->post(evict);
+}
+
+void Cluster::sendPresence(Link& link, bool online, const std::string& username, int64_t login_ms) {
+    std::string payload(1, online ? '\1' : '\0');
+    putVarint(payload, (uint64_t)login_ms);
+    payload += username;
+    sendFrame(link, LINK_PRESENCE, payload);
+}
+
+void Cluster::sendFrame(Link& link, uint8_t type, std::string_view payload) {
+    char header[FRAME_HEADER_SIZE];
+    writeFrameHeader(header, type, (uint32_t)payload.size());
+    link.output.append(header, FRAME_HEADER_SIZE);
+    link.output.append(payload.data(), payload.size());
+    flushLink(link);
+}
+
+void Cluster::sendRaw(Link& link, const std::string& frame) {
+    link.output += frame;
+    flushLink(link);
+}
+
+void Cluster::flushLink(Link& link) {
+    while (link.output_offset < link.output.size()) {
+        int sent = send(link.socket, link.output.data() + link.output_offset,
+                        (int)(link.output.size() - link.output_offset), SEND_FLAGS);
+        if (sent < 0) {
+            if (!socketWouldBlock()) {
+                link.failed = true;
+                return;
+            }
+            break;
+        }
+        link.output_offset += sent;
+    }
+
+    size_t pending = link.output.size() - link.output_offset;
+    if (pending == 0) {
+        link.output.clear();
+        link.output_offset = 0;
+    } else if (pending > MAX_LINK_OUTPUT) {
+        std::cerr << "Cluster node " << link.node << " is not keeping up, dropping the link" << std::endl;
+        link.failed = true;
+        return;
+    } else if (link.output_offset > pending) {
+        link.output.erase(0, link.output_offset);
+        link.output_offset = 0;
+    }
+
+    bool wants_write = pending > 0;
+    if (wants_write != link.write_interest) {
+        link.write_interest = wants_write;
+        poller.modify(link.socket, wants_write ? Poller::READABLE | Poller::WRITABLE : Poller::READABLE);
+    }
+}
+
+void Cluster::reapLinks() {
+    std::vector<SOCKET> failed;
+    for (const auto& entry : links) {
+        if (entry.second->failed) {
+            failed.push_back(entry.first);
+        }
+    }
+    for (SOCKET socket : failed) {
+        closeLink(socket);
+    }
+}
+
+void Cluster::closeLink(SOCKET socket) {
+    auto it = links.find(socket);
+    if (it == links.end()) {
+        return;
+    }
+    poller.remove(socket);
+    closesocket(socket);
+    uint32_t node = it->second->node;
+    if (it->second->peer >= 0) {
+        peers[it->second->peer].socket = INVALID_SOCKET;
+    }
+    links.erase(it);
+
+    if (node == 0 || linkedTo(node)) {
+        return; // Still linked through the one that won a dial race
+    }
+    // Its users are gone with it; they are announced again on reconnect
+    std::cout << "Lost link to cluster node " << node << std::endl;
+    auto users = users_by_node.find(node);
+    if (users != users_by_node.end()) {
+        for (const auto& username : users->second) {
+            std::shared_ptr<RemoteUser> user = remote_users.find(username);
+            if (user && user->node == node) {
+                remote_users.erase(username, user);
+            }
+        }
+        users_by_node.erase(users);
+    }
+}
+
+bool Cluster::linkedTo(uint32_t node) const {
+    for (const auto& entry : links) {
+        if (entry.second->node == node && !entry.second->failed) {
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,193 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <deque>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <chrono>
+#include <cstdint>
+#include "platform.h"
+#include "poller.h"
+#include "mpsc_queue.h"
+#include "server.h"
+
+// Federation of server processes. Every node dials the peers it is given
+// and accepts links from the others, forming a full mesh; a node relays
+// what its own clients send and never forwards what it received.
+//
+// Link frames use the client frame layout (protocol.h) with these types:
+enum LinkFrameType : uint8_t {
+    LINK_HELLO = 1,    // [varint node id][varint incarnation], sent by both ends first
+    LINK_SYNC = 2,     // [varint last relay sequence received from the peer], see Cluster
+    LINK_MESSAGE = 3,  // [varint origin node][varint relay sequence][RECORD payload]
+    LINK_PRESENCE = 4  // [u8 online][varint login time, ms since epoch][username]
+};
+
+const uint32_t MAX_LINK_PAYLOAD = 1024 * 1024;
+
+// A username logged in on another node
+struct RemoteUser {
+    uint32_t node;
+    int64_t login_ms;
+};
+
+// Relay thread of one node. Room messages are sent once per peer link,
+// however many of the peer's users are in the room; the peer sequences
+// them into its own copy of the room (sequence ids stay per node).
+//
+// Every relayed message carries its origin node and a relay sequence that
+// counts up per origin. Receivers drop anything at or below the highest
+// sequence they have seen from that origin, so a message that arrives
+// twice (two links racing, replay after a reconnect) is delivered once.
+// On reconnect a node asks for everything after the last sequence it has
+// and the peer replays that from a bounded backlog, leaving out direct
+// messages to users who are not on the reconnecting node.
+//
+// Usernames are unique across the cluster: logins and logouts are
+// gossiped, and when two nodes accepted the same name at once the earlier
+// login (then the lower node id) keeps it and the other is disconnected.
+class Cluster {
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    // Messages kept for peers that reconnect
+    static constexpr size_t BACKLOG_MESSAGES = 10000;
+    // A peer this far behind is cut off and catches up after reconnecting
+    static constexpr size_t MAX_LINK_OUTPUT = 64 * 1024 * 1024;
+    static constexpr int RECONNECT_MS = 1000;
+
+    // Work handed over by the shards and the sequencer
+    struct Event {
+        enum Kind { RELAY, ONLINE, OFFLINE } kind;
+        SharedBuffer encoded; // RELAY: Message::encode() output
+        std::string username;
+        int64_t login_ms;
+    };
+
+    // A configured peer we keep dialing
+    struct Peer {
+        std::string address;
+        struct sockaddr_in addr;
+        SOCKET socket; // INVALID_SOCKET while not connected
+        uint32_t node; // learned from its HELLO, 0 until then
+        Clock::time_point retry_at;
+    };
+
+    struct Link {
+        SOCKET socket;
+        int peer;        // index in peers if we dialed, -1 if accepted
+        bool connecting; // non-blocking connect in progress
+        uint32_t node;   // 0 until the peer's HELLO
+        bool live;       // synced, gets new messages
+        std::string input;
+        std::string output;
+        size_t output_offset;
+        bool write_interest;
+        bool failed;     // closed after the current loop iteration
+    };
+
+    // One of our relayed messages, kept for replay
+    struct Relayed {
+        uint64_t seq;
+        std::string frame;
+        std::string recipient; // direct messages only
+    };
+
+    // What we received from an origin node
+    struct OriginState {
+        uint64_t incarnation;
+        uint64_t last_seq;
+    };
+
+    ChatServer& server;
+    uint32_t node_id;
+    uint64_t incarnation; // start time; tells peers we restarted
+    int port;
+    SOCKET listen_socket;
+    Poller poller;
+    std::atomic<bool> running;
+    std::atomic<bool> wake_pending;
+    std::thread relay_thread;
+    ThreadMetrics* metrics; // set once the relay thread runs
+
+    MpscQueue<Event> events;
+    std::vector<Peer> peers;
+    std::map<SOCKET, std::unique_ptr<Link>> links;
+
+    // Our relayed messages, newest last, for replay
+    uint64_t next_seq;
+    std::deque<Relayed> backlog;
+    std::unordered_map<uint32_t, OriginState> origins;
+
+    // Relay thread only: our logged in users, and every node's
+    std::unordered_map<std::string, int64_t> local_users;
+    std::unordered_map<uint32_t, std::unordered_set<std::string>> users_by_node;
+    // Read by the shards at login
+    StripedMap<RemoteUser> remote_users;
+
+    void push(Event event);
+    void serve();
+    int nextTimeout() const;
+    void connectPeers();
+    void acceptLinks();
+    void addLink(SOCKET socket, int peer, bool connecting);
+    void finishConnect(Link& link);
+    void sendHello(Link& link);
+    void handleReadable(Link& link);
+    // False on a protocol error, which fails the link
+    bool handleFrame(Link& link, uint8_t type, std::string_view payload);
+    bool handleHello(Link& link, std::string_view payload);
+    void handleSync(Link& link, uint64_t resume);
+    bool handleMessage(std::string_view payload);
+    bool handlePresence(Link& link, std::string_view payload);
+    void drainEvents();
+    void relayMessage(const SharedBuffer& encoded);
+    void userOnline(const std::string& username, int64_t login_ms);
+    void userOffline(const std::string& username);
+    // Disconnect our user holding a name another node won
+    void evictLocal(const std::string& username, uint32_t winner);
+    void sendPresence(Link& link, bool online, const std::string& username, int64_t login_ms);
+    void sendFrame(Link& link, uint8_t type, std::string_view payload);
+    void sendRaw(Link& link, const std::string& frame);
+    void flushLink(Link& link);
+    void reapLinks();
+    void closeLink(SOCKET socket);
+    bool linkedTo(uint32_t node) const;
+
+public:
+    // peer_addresses are "host:port" (IPv4)
+    Cluster(ChatServer& owner, uint32_t node, int cluster_port, const std::vector<std::string>& peer_addresses);
+    ~Cluster();
+
+    // Binds the cluster port, or uses the listener restoreState() adopted
+    bool listen();
+    void start();
+    void stop();
+
+    // Hot restart (handoff.h), while the relay thread is stopped: relays
+    // what is still queued, then appends our incarnation, relay sequence,
+    // per-origin sequences and users to state and the backlog entries to
+    // relayed. A successor restoring them continues as the same node, so
+    // peers and this node replay what the other missed once relinked.
+    void exportState(std::string& state, std::vector<std::string>& relayed);
+    SOCKET getListenSocket() const;
+    // Successor side, before listen(); takes ownership of listener (may be
+    // INVALID_SOCKET). State of another node id is ignored.
+    bool restoreState(std::string_view state, SOCKET listener);
+    bool restoreRelayed(std::string_view entry);
+
+    // Thread-safe. A room message sequenced here, or a direct message
+    // (room "@user") for a user on another node
+    void relay(const SharedBuffer& encoded);
+    // Logins and logouts on this node
+    void announceLogin(const std::string& username);
+    void announceLogout(const std::string& username);
+    // Whether another node has a user of that name
+    bool isRemoteUser(const std::string& username);
+};
@@ -0,0 +1,109 @@
+#include "compression.h"
+
+#ifdef HAVE_ZLIB
+#include <cstring>
+
+// Deflater implementation
+Deflater::Deflater(int level) : ready(false) {
+    memset(&stream, 0, sizeof(stream));
+    ready = deflateInit2(&stream, level, Z_DEFLATED, WINDOW_BITS, MEMORY_LEVEL, Z_DEFAULT_STRATEGY) == Z_OK;
+}
+
+Deflater::Deflater(const Deflater& other) : ready(false) {
+    memset(&stream, 0, sizeof(stream));
+    ready = other.ready && deflateCopy(&stream, const_cast<z_streamp>(&other.stream)) == Z_OK;
+}
+
+Deflater::~Deflater() {
+    if (ready) {
+        deflateEnd(&stream);
+    }
+}
+
+bool Deflater::valid() const {
+    return ready;
+}
+
+bool Deflater::run(std::string& out, const char* data, size_t length, int mode) {
+    if (!ready) {
+        return false;
+    }
+    stream.next_in = (Bytef*)data;
+    stream.avail_in = (uInt)length;
+    while (true) {
+        // Room for the input at the worst ratio, then more if it was not enough
+        size_t start = out.size();
+        size_t space = deflateBound(&stream, stream.avail_in) + 64;
+        out.resize(start + space);
+        stream.next_out = (Bytef*)&out[start];
+        stream.avail_out = (uInt)space;
+        int result = deflate(&stream, mode);
+        out.resize(start + space - stream.avail_out);
+        if (result == Z_STREAM_ERROR) {
+            return false;
+        }
+        if (stream.avail_in == 0 && stream.avail_out > 0) {
+            break;
+        }
+    }
+    if (mode == Z_FINISH) {
+        deflateReset(&stream);
+    }
+    return true;
+}
+
+bool Deflater::write(std::string& out, const char* data, size_t length) {
+    return run(out, data, length, Z_NO_FLUSH);
+}
+
+bool Deflater::flush(std::string& out) {
+    return run(out, nullptr, 0, Z_SYNC_FLUSH);
+}
+
+bool Deflater::finish(std::string& out) {
+    return run(out, nullptr, 0, Z_FINISH);
+}
+
+// Inflater implementation
+Inflater::Inflater() : ready(false) {
+    memset(&stream, 0, sizeof(stream));
+    ready = inflateInit(&stream) == Z_OK;
+}
+
+Inflater::~Inflater() {
+    if (ready) {
+        inflateEnd(&stream);
+    }
+}
+
+bool Inflater::valid() const {
+    return ready;
+}
+
+bool Inflater::write(std::string& out, const char* data, size_t length) {
+    const size_t CHUNK = 64 * 1024;
+    if (!ready) {
+        return false;
+    }
+    stream.next_in = (Bytef*)data;
+    stream.avail_in = (uInt)length;
+    bool output_full = false;
+    while (stream.avail_in > 0 || output_full) {
+        size_t start = out.size();
+        out.resize(start + CHUNK);
+        stream.next_out = (Bytef*)&out[start];
+        stream.avail_out = (uInt)CHUNK;
+        int result = inflate(&stream, Z_SYNC_FLUSH);
+        output_full = stream.avail_out == 0;
+        out.resize(start + CHUNK - stream.avail_out);
+        if (result == Z_STREAM_END) {
+            inflateReset(&stream); // The server started a new stream
+        } else if (result != Z_OK && result != Z_BUF_ERROR) {
+            return false;
+        } else if (result == Z_BUF_ERROR && !output_full) {
+            break; // Needs more input
+        }
+    }
+    return true;
+}
+#endif
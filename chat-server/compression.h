@@ -0,0 +1,66 @@
+#pragma once
+
+#include <string>
+#include <cstddef>
+
+#if !defined(_WIN32) && defined(__has_include)
+#if __has_include(<zlib.h>)
+#define HAVE_ZLIB 1
+#endif
+#endif
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+
+// Stream compression of the server's side of a framed connection
+// (protocol.h). A connection keeps one deflate stream for its lifetime,
+// so every block is compressed against the window of everything sent
+// before it: repeated names, rooms and words cost a few bits each.
+//
+// The window is smaller than zlib's default to keep a compressed
+// connection at about 50 KB instead of 256 KB; chat lines rarely repeat
+// anything further back.
+class Deflater {
+private:
+    static const int WINDOW_BITS = 13;
+    static const int MEMORY_LEVEL = 5;
+
+    z_stream stream;
+    bool ready;
+
+    bool run(std::string& out, const char* data, size_t length, int mode);
+
+public:
+    explicit Deflater(int level);
+    // Continues other's stream independently of it (check valid())
+    Deflater(const Deflater& other);
+    ~Deflater();
+    Deflater& operator=(const Deflater&) = delete;
+
+    bool valid() const;
+    // Compress data onto out; it may stay buffered until the next flush
+    bool write(std::string& out, const char* data, size_t length);
+    // End the block so the peer can decode everything written so far
+    bool flush(std::string& out);
+    // End the stream (hot restart); the peer starts a new one after it
+    bool finish(std::string& out);
+};
+
+// The client's side: decompresses what the server sends, and starts over
+// when a stream ends and another one follows.
+class Inflater {
+private:
+    z_stream stream;
+    bool ready;
+
+public:
+    Inflater();
+    ~Inflater();
+    Inflater(const Inflater&) = delete;
+    Inflater& operator=(const Inflater&) = delete;
+
+    bool valid() const;
+    // Append the decompressed bytes to out; false if the data is corrupt
+    bool write(std::string& out, const char* data, size_t length);
+};
+#endif
@@ -0,0 +1,378 @@
+#include "handoff.h"
+#include "protocol.h"
+#include <iostream>
+#include <cstring>
+
+#ifndef _WIN32
+#include <sys/un.h>
+#endif
+
+void appendConnectionState(std::string& out, const ConnectionState& state) {
+    putVarint(out, (uint64_t)state.shard);
+    out += (char)state.login_state;
+    out += (char)state.wire_mode;
+    out += (char)(state.local ? 1 : 0);
+    out += (char)(state.compressed ? 1 : 0);
+    putString(out, state.username);
+    putString(out, state.current_room);
+    putVarint(out, state.rooms.size());
+    for (const auto& room : state.rooms) {
+        putString(out, room.first);
+        putVarint(out, room.second);
+    }
+    putString(out, state.input);
+    putString(out, state.output);
+}
+
+bool parseConnectionState(std::string_view& in, ConnectionState& state) {
+    uint64_t shard, room_count;
+    std::string_view username, current_room, input, output;
+    if (!getVarint(in, shard) || in.size() < 4) {
+        return false;
+    }
+    state.shard = (int)shard;
+    state.login_state = (uint8_t)in[0];
+    state.wire_mode = (uint8_t)in[1];
+    state.local = in[2] != 0;
+    state.compressed = in[3] != 0;
+    in.remove_prefix(4);
+    if (!getString(in, username) || !getString(in, current_room) || !getVarint(in, room_count)) {
+        return false;
+    }
+    state.username = std::string(username);
+    state.current_room = std::string(current_room);
+    state.rooms.clear();
+    for (uint64_t i = 0; i < room_count; i++) {
+        std::string_view room;
+        uint64_t seq;
+        if (!getString(in, room) || !getVarint(in, seq)) {
+            return false;
+        }
+        state.rooms.emplace_back(std::string(room), seq);
+    }
+    if (!getString(in, input) || !getString(in, output)) {
+        return false;
+    }
+    state.input = std::string(input);
+    state.output = std::string(output);
+    return true;
+}
+
+#ifndef _WIN32
+
+// HandoffChannel implementation
+HandoffChannel::HandoffChannel(SOCKET socket) : channel(socket), input_offset(0) {
+}
+
+HandoffChannel::~HandoffChannel() {
+    // Sockets nobody claimed
+    for (SOCKET socket : received) {
+        closesocket(socket);
+    }
+    if (channel != INVALID_SOCKET) {
+        closesocket(channel);
+    }
+}
+
+SOCKET HandoffChannel::connectTo(const std::string& path) {
+    struct sockaddr_un addr;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        std::cerr << "Handoff socket path is too long: " << path << std::endl;
+        return INVALID_SOCKET;
+    }
+    SOCKET socket = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (socket == INVALID_SOCKET) {
+        return INVALID_SOCKET;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.c_str(), path.size());
+    if (connect(socket, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        std::cerr << "Cannot reach the running server at " << path << ": " << strerror(errno) << std::endl;
+        closesocket(socket);
+        return INVALID_SOCKET;
+    }
+    return socket;
+}
+
+bool HandoffChannel::valid() const {
+    return channel != INVALID_SOCKET;
+}
+
+void HandoffChannel::setTimeout(int timeout_ms) {
+    struct timeval timeout;
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_usec = (timeout_ms % 1000) * 1000;
+    setsockopt(channel, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(channel, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+bool HandoffChannel::sendAll(const char* data, size_t length, const std::vector<SOCKET>& sockets) {
+    // Sockets ride on the first sendmsg(), attached to its first byte
+    bool attach = !sockets.empty();
+    while (length > 0 || attach) {
+        struct iovec slice;
+        slice.iov_base = (void*)data;
+        slice.iov_len = length;
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &slice;
+        msg.msg_iovlen = 1;
+
+        std::vector<char> control;
+        if (attach) {
+            control.assign(CMSG_SPACE(sockets.size() * sizeof(int)), 0);
+            msg.msg_control = control.data();
+            msg.msg_controllen = control.size();
+            struct cmsghdr* header = CMSG_FIRSTHDR(&msg);
+            header->cmsg_level = SOL_SOCKET;
+            header->cmsg_type = SCM_RIGHTS;
+            header->cmsg_len = CMSG_LEN(sockets.size() * sizeof(int));
+            memcpy(CMSG_DATA(header), sockets.data(), sockets.size() * sizeof(int));
+        }
+
+        ssize_t sent = sendmsg(channel, &msg, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "Handoff send failed: " << strerror(errno) << std::endl;
+            return false;
+        }
+        attach = false;
+        data += sent;
+        length -= sent;
+    }
+    return true;
+}
+
+bool HandoffChannel::send(uint8_t type, std::string_view payload, const std::vector<SOCKET>& sockets) {
+    char header[FRAME_HEADER_SIZE];
+    writeFrameHeader(header, type, (uint32_t)payload.size());
+    if (!sockets.empty()) {
+        // Whatever is buffered goes first, then this frame with its sockets
+        if (!flush()) {
+            return false;
+        }
+        std::string frame(header, FRAME_HEADER_SIZE);
+        frame.append(payload.data(), payload.size());
+        return sendAll(frame.data(), frame.size(), sockets);
+    }
+    pending.append(header, FRAME_HEADER_SIZE);
+    pending.append(payload.data(), payload.size());
+    return pending.size() < 256 * 1024 || flush();
+}
+
+bool HandoffChannel::flush() {
+    bool sent = sendAll(pending.data(), pending.size(), std::vector<SOCKET>());
+    pending.clear();
+    return sent;
+}
+
+bool HandoffChannel::receive() {
+    char buffer[64 * 1024];
+    struct iovec slice;
+    slice.iov_base = buffer;
+    slice.iov_len = sizeof(buffer);
+    char control[CMSG_SPACE(MAX_SOCKETS_PER_FRAME * sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &slice;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t bytes_read;
+    do {
+        bytes_read = recvmsg(channel, &msg, MSG_CMSG_CLOEXEC);
+    } while (bytes_read < 0 && errno == EINTR);
+    if (bytes_read < 0) {
+        std::cerr << "Handoff receive failed: " << strerror(errno) << std::endl;
+    }
+    if (bytes_read <= 0) {
+        return false;
+    }
+    for (struct cmsghdr* header = CMSG_FIRSTHDR(&msg); header; header = CMSG_NXTHDR(&msg, header)) {
+        if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS) {
+            size_t count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            const int* sockets = (const int*)CMSG_DATA(header);
+            for (size_t i = 0; i < count; i++) {
+                received.push_back(sockets[i]);
+            }
+        }
+    }
+    if (msg.msg_flags & MSG_CTRUNC) {
+        std::cerr << "Handoff lost sockets (control data truncated)" << std::endl;
+        return false;
+    }
+    if (input_offset > 0) {
+        input.erase(0, input_offset);
+        input_offset = 0;
+    }
+    input.append(buffer, bytes_read);
+    return true;
+}
+
+bool HandoffChannel::next(uint8_t& type, std::string& payload) {
+    while (true) {
+        size_t available = input.size() - input_offset;
+        if (available >= FRAME_HEADER_SIZE) {
+            const unsigned char* header = (const unsigned char*)input.data() + input_offset;
+            uint32_t length = ((uint32_t)header[0] << 24) | ((uint32_t)header[1] << 16) |
+                              ((uint32_t)header[2] << 8) | (uint32_t)header[3];
+            if (available >= FRAME_HEADER_SIZE + length) {
+                type = header[4];
+                payload.assign(input.data() + input_offset + FRAME_HEADER_SIZE, length);
+                input_offset += FRAME_HEADER_SIZE + length;
+                return true;
+            }
+        }
+        if (!receive()) {
+            return false;
+        }
+    }
+}
+
+bool HandoffChannel::takeSockets(size_t count, std::vector<SOCKET>& out) {
+    if (received.size() < count) {
+        return false;
+    }
+    for (size_t i = 0; i < count; i++) {
+        out.push_back(received.front());
+        received.pop_front();
+    }
+    return true;
+}
+
+// HandoffEndpoint implementation
+HandoffEndpoint::HandoffEndpoint() : listen_socket(INVALID_SOCKET), running(false), handed_off(false) {
+}
+
+HandoffEndpoint::~HandoffEndpoint() {
+    stop();
+    poller.close();
+    if (listen_socket != INVALID_SOCKET) {
+        closesocket(listen_socket);
+        // After a handoff the path belongs to the successor
+        if (!handed_off) {
+            unlink(path.c_str());
+        }
+    }
+}
+
+bool HandoffEndpoint::listen(const std::string& socket_path, std::function<bool(SOCKET)> on_successor) {
+    struct sockaddr_un addr;
+    if (socket_path.size() >= sizeof(addr.sun_path)) {
+        std::cerr << "Handoff socket path is too long: " << socket_path << std::endl;
+        return false;
+    }
+    path = socket_path;
+    handler = std::move(on_successor);
+
+    listen_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_socket == INVALID_SOCKET) {
+        std::cerr << "Error creating the handoff socket: " << strerror(errno) << std::endl;
+        return false;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.c_str(), path.size());
+
+    // A predecessor's socket file (it is gone, or it handed off to us)
+    unlink(path.c_str());
+    if (bind(listen_socket, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        ::listen(listen_socket, 1) < 0 || !setNonBlocking(listen_socket) ||
+        !poller.open() || !poller.add(listen_socket, Poller::READABLE)) {
+        std::cerr << "Error setting up the handoff socket " << path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void HandoffEndpoint::start() {
+    running = true;
+    serve_thread = std::thread(&HandoffEndpoint::serve, this);
+}
+
+void HandoffEndpoint::stop() {
+    running = false;
+    poller.wakeup();
+    if (serve_thread.joinable()) {
+        serve_thread.join();
+    }
+}
+
+void HandoffEndpoint::serve() {
+    std::vector<Poller::Event> ready;
+    while (running && !handed_off) {
+        poller.wait(ready, -1);
+        if (ready.empty()) {
+            continue;
+        }
+        SOCKET successor = accept(listen_socket, NULL, NULL);
+        if (successor == INVALID_SOCKET) {
+            continue;
+        }
+        // The handoff itself blocks; the server is paused meanwhile
+        int flags = fcntl(successor, F_GETFL, 0);
+        fcntl(successor, F_SETFL, flags & ~O_NONBLOCK);
+        if (handler(successor)) {
+            handed_off = true;
+        }
+    }
+}
+
+#else
+
+HandoffChannel::HandoffChannel(SOCKET socket) : channel(socket), input_offset(0) {
+}
+
+HandoffChannel::~HandoffChannel() {
+}
+
+SOCKET HandoffChannel::connectTo(const std::string&) {
+    std::cerr << "Hot restart needs Unix sockets (not available on Windows)" << std::endl;
+    return INVALID_SOCKET;
+}
+
+bool HandoffChannel::valid() const {
+    return false;
+}
+
+void HandoffChannel::setTimeout(int) {
+}
+
+bool HandoffChannel::send(uint8_t, std::string_view, const std::vector<SOCKET>&) {
+    return false;
+}
+
+bool HandoffChannel::flush() {
+    return false;
+}
+
+bool HandoffChannel::next(uint8_t&, std::string&) {
+    return false;
+}
+
+bool HandoffChannel::takeSockets(size_t, std::vector<SOCKET>&) {
+    return false;
+}
+
+HandoffEndpoint::HandoffEndpoint() : listen_socket(INVALID_SOCKET), running(false), handed_off(false) {
+}
+
+HandoffEndpoint::~HandoffEndpoint() {
+}
+
+bool HandoffEndpoint::listen(const std::string&, std::function<bool(SOCKET)>) {
+    std::cerr << "Hot restart needs Unix sockets (not available on Windows)" << std::endl;
+    return false;
+}
+
+void HandoffEndpoint::start() {
+}
+
+void HandoffEndpoint::stop() {
+}
+
+#endif
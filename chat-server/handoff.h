@@ -0,0 +1,133 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <cstdint>
+#include "platform.h"
+#include "poller.h"
+
+// Hot restart. A server started with --handoff-socket PATH waits for its
+// successor on a Unix socket there; the successor (started with
+// --takeover) connects, and the old process stops reading, sequences what
+// is still queued and sends over the channel, in the client frame layout
+// (protocol.h):
+//
+//   HANDOFF_HELLO       [u8 version][varint shard count], answering the
+//                       successor's [u8 version]
+//   HANDOFF_LISTENERS   no payload; one listening socket per shard attached
+//   HANDOFF_ROOM        [varint last sequence id][room name], then its history as
+//   HANDOFF_RECORD      RECORD payloads (message_log.h), oldest first
+//   HANDOFF_CONNECTIONS [varint count][ConnectionState]..., sockets attached
+//   HANDOFF_CLUSTER     [varint listener count (0 or 1)][Cluster state],
+//                       the cluster port's listener attached, then
+//   HANDOFF_RELAYED     one per relay backlog entry, see Cluster::exportState()
+//   HANDOFF_DONE        end of the snapshot; the successor answers with
+//                       HANDOFF_DONE once it is ready to serve, the old
+//                       process confirms with HANDOFF_DONE and exits, and
+//                       only then does the successor start serving
+//
+// Sockets travel as SCM_RIGHTS ancillary data, so connections stay open
+// and clients notice nothing. The old process changes nothing it would
+// need to go on serving, so if the successor fails or does not answer
+// within HANDOFF_TIMEOUT_MS it resumes; a successor without the
+// confirmation gives up.
+enum HandoffFrameType : uint8_t {
+    HANDOFF_HELLO = 1,
+    HANDOFF_LISTENERS = 2,
+    HANDOFF_ROOM = 3,
+    HANDOFF_RECORD = 4,
+    HANDOFF_CONNECTIONS = 5,
+    HANDOFF_DONE = 6,
+    HANDOFF_CLUSTER = 7,
+    HANDOFF_RELAYED = 8
+};
+
+const uint8_t HANDOFF_VERSION = 3;
+const int HANDOFF_TIMEOUT_MS = 30000;
+
+// What a connection needs to continue in another process
+struct ConnectionState {
+    SOCKET socket;
+    int shard;
+    uint8_t login_state; // LoginState
+    uint8_t wire_mode;   // WireMode
+    bool local;
+    bool compressed; // negotiated HELLO_DEFLATE; output ends its stream
+    std::string username;
+    std::string current_room;
+    // Subscribed rooms and the last sequence id the client was sent
+    std::vector<std::pair<std::string, uint64_t>> rooms;
+    std::string input;  // received, not parsed yet
+    std::string output; // queued, not sent yet
+
+    ConnectionState() : socket(INVALID_SOCKET), shard(0), login_state(0), wire_mode(0), local(false), compressed(false) {}
+};
+
+void appendConnectionState(std::string& out, const ConnectionState& state);
+bool parseConnectionState(std::string_view& in, ConnectionState& state);
+
+// Blocking framed channel over a connected Unix socket
+class HandoffChannel {
+private:
+    SOCKET channel;
+    std::string pending;          // frames not sent yet
+    std::string input;
+    size_t input_offset;
+    std::deque<SOCKET> received;  // sockets that arrived, in order
+
+    bool sendAll(const char* data, size_t length, const std::vector<SOCKET>& sockets);
+    bool receive();
+
+public:
+    // Sockets attached to one frame; SCM_MAX_FD is 253
+    static const size_t MAX_SOCKETS_PER_FRAME = 200;
+
+    explicit HandoffChannel(SOCKET socket);
+    ~HandoffChannel();
+
+    HandoffChannel(const HandoffChannel&) = delete;
+    HandoffChannel& operator=(const HandoffChannel&) = delete;
+
+    // Connects to the old server's handoff socket; check valid()
+    static SOCKET connectTo(const std::string& path);
+    bool valid() const;
+    // Sends and receives fail after blocking this long
+    void setTimeout(int timeout_ms);
+
+    // Frames are buffered until flush() or a frame with sockets
+    bool send(uint8_t type, std::string_view payload, const std::vector<SOCKET>& sockets = {});
+    bool flush();
+    // Next frame and the sockets attached to it (count taken from the
+    // sender's frame, so sockets and payload stay paired)
+    bool next(uint8_t& type, std::string& payload);
+    bool takeSockets(size_t count, std::vector<SOCKET>& out);
+};
+
+// Listens on the handoff socket and runs handler for a successor. The
+// handler returns true once the state was handed over; the endpoint then
+// leaves the socket path to the successor.
+class HandoffEndpoint {
+private:
+    std::string path;
+    SOCKET listen_socket;
+    Poller poller;
+    std::atomic<bool> running;
+    std::atomic<bool> handed_off;
+    std::thread serve_thread;
+    std::function<bool(SOCKET)> handler;
+
+    void serve();
+
+public:
+    HandoffEndpoint();
+    ~HandoffEndpoint();
+
+    bool listen(const std::string& socket_path, std::function<bool(SOCKET)> on_successor);
+    void start();
+    void stop();
+};
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+// Log-linear histogram in the style of HdrHistogram. Values are grouped by
+// power of two and every power of two is split into 32 linear sub-buckets,
+// so a reported value is within about 3% of the recorded one. Recording is
+// a couple of instructions; not thread-safe, merge per-thread copies.
+class Histogram {
+private:
+    static constexpr int SUB_BITS = 5;
+    static constexpr uint64_t SUB_COUNT = 1 << SUB_BITS;
+    static constexpr size_t BUCKETS = (64 - SUB_BITS + 1) * SUB_COUNT;
+
+    std::vector<uint64_t> counts;
+    uint64_t total;
+    uint64_t max_value;
+
+    static size_t bucketOf(uint64_t value) {
+        if (value < SUB_COUNT) {
+            return (size_t)value;
+        }
+        int shift = 63 - __builtin_clzll(value) - SUB_BITS;
+        return (size_t)((shift + 1) * SUB_COUNT + ((value >> shift) - SUB_COUNT));
+    }
+
+    // Highest value that lands in a bucket
+    static uint64_t valueOf(size_t bucket) {
+        if (bucket < SUB_COUNT) {
+            return bucket;
+        }
+        int shift = (int)(bucket / SUB_COUNT) - 1;
+        uint64_t sub = bucket % SUB_COUNT + SUB_COUNT;
+        return ((sub + 1) << shift) - 1;
+    }
+
+public:
+    Histogram() : counts(BUCKETS, 0), total(0), max_value(0) {}
+
+    void record(uint64_t value) {
+        counts[bucketOf(value)]++;
+        total++;
+        if (value > max_value) {
+            max_value = value;
+        }
+    }
+
+    void merge(const Histogram& other) {
+        for (size_t i = 0; i < BUCKETS; i++) {
+            counts[i] += other.counts[i];
+        }
+        total += other.total;
+        if (other.max_value > max_value) {
+            max_value = other.max_value;
+        }
+    }
+
+    void clear() {
+        std::fill(counts.begin(), counts.end(), 0);
+        total = 0;
+        max_value = 0;
+    }
+
+    uint64_t count() const { return total; }
+    uint64_t max() const { return max_value; }
+
+    // Value at or below which `percent` of the recorded values fall
+    uint64_t percentile(double percent) const {
+        if (total == 0) {
+            return 0;
+        }
+        uint64_t target = (uint64_t)(percent / 100.0 * (double)total + 0.5);
+        if (target == 0) {
+            target = 1;
+        }
+        uint64_t seen = 0;
+        for (size_t i = 0; i < BUCKETS; i++) {
+            seen += counts[i];
+            if (seen >= target) {
+                uint64_t value = valueOf(i);
+                return value < max_value ? value : max_value;
+            }
+        }
+        return max_value;
+    }
+
+    friend class AtomicHistogram;
+};
+
+// Histogram with one recording thread that other threads may read at any
+// time. Recording uses plain relaxed loads and stores, no locked
+// instructions; a reader may miss values recorded while it copies.
+class AtomicHistogram {
+private:
+    std::atomic<uint64_t> counts[Histogram::BUCKETS];
+    std::atomic<uint64_t> max_value;
+
+public:
+    AtomicHistogram() : max_value(0) {
+        for (auto& count : counts) {
+            count.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    // Owning thread only
+    void record(uint64_t value) {
+        std::atomic<uint64_t>& count = counts[Histogram::bucketOf(value)];
+        count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        if (value > max_value.load(std::memory_order_relaxed)) {
+            max_value.store(value, std::memory_order_relaxed);
+        }
+    }
+
+    // Add the current counts to out
+    void copyTo(Histogram& out) const {
+        for (size_t i = 0; i < Histogram::BUCKETS; i++) {
+            uint64_t count = counts[i].load(std::memory_order_relaxed);
+            out.counts[i] += count;
+            out.total += count;
+        }
+        uint64_t max = max_value.load(std::memory_order_relaxed);
+        if (max > out.max_value) {
+            out.max_value = max;
+        }
+    }
+};
@@ -0,0 +1,289 @@
+#include "io_ring.h"
+
+#ifdef HAVE_IO_URING
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+
+// Reserved user_data of the wakeup eventfd poll
+static const uint64_t WAKEUP_DATA = ~(uint64_t)0;
+
+static int ioUringSetup(unsigned entries, struct io_uring_params* params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int ioUringEnter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags,
+                        const void* arg, size_t arg_size) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+static int ioUringRegister(int fd, unsigned opcode, const void* arg, unsigned count) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+IoRing::IoRing()
+    : ring_fd(-1), wakeup_fd(-1), rings(MAP_FAILED), rings_size(0), sq_head(nullptr),
+      sq_tail(nullptr), sq_mask(0), sq_entries(0), sqes((struct io_uring_sqe*)MAP_FAILED),
+      sqes_size(0), pending(0), cq_head(nullptr),
+      cq_tail(nullptr), cq_mask(0), cqes(nullptr), buf_ring((struct io_uring_buf_ring*)MAP_FAILED),
+      buf_ring_size(0), buf_count(0), buf_size(0), wakeup_value(0) {
+}
+
+IoRing::~IoRing() {
+    close();
+}
+
+bool IoRing::open(unsigned entries, unsigned buffers, unsigned buffer_size) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    // Room for every multishot receive plus a burst of sends
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = entries * 4;
+
+    ring_fd = ioUringSetup(entries, &params);
+    if (ring_fd < 0) {
+        std::cerr << "io_uring_setup failed: " << strerror(errno) << std::endl;
+        return false;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG) ||
+        !(params.features & IORING_FEAT_NODROP)) {
+        std::cerr << "io_uring is too old (needs a 6.0+ kernel)" << std::endl;
+        close();
+        return false;
+    }
+
+    // Submission and completion rings share one mapping
+    rings_size = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                          params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe));
+    rings = mmap(NULL, rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                 ring_fd, IORING_OFF_SQ_RING);
+    sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = (struct io_uring_sqe*)mmap(NULL, sqes_size, PROT_READ | PROT_WRITE,
+                                      MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (rings == MAP_FAILED || sqes == MAP_FAILED) {
+        std::cerr << "Mapping the io_uring failed: " << strerror(errno) << std::endl;
+        close();
+        return false;
+    }
+
+    char* sq = (char*)rings;
+    sq_head = (unsigned*)(sq + params.sq_off.head);
+    sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+    sq_entries = params.sq_entries;
+    // Slot i of the submission queue always holds sqes[i]
+    unsigned* array = (unsigned*)(sq + params.sq_off.array);
+    for (unsigned i = 0; i < sq_entries; i++) {
+        array[i] = i;
+    }
+
+    char* cq = (char*)rings;
+    cq_head = (unsigned*)(cq + params.cq_off.head);
+    cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    // Provided buffer ring (group 0), shared by every receive
+    buf_count = buffers;
+    buf_size = buffer_size;
+    buf_ring_size = buf_count * sizeof(struct io_uring_buf);
+    buf_ring = (struct io_uring_buf_ring*)mmap(NULL, buf_ring_size, PROT_READ | PROT_WRITE,
+                                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf_ring == MAP_FAILED) {
+        close();
+        return false;
+    }
+    buf_data.resize((size_t)buf_count * buf_size);
+    for (unsigned i = 0; i < buf_count; i++) {
+        addBuffer(i, i);
+    }
+    __atomic_store_n(&buf_ring->tail, (uint16_t)buf_count, __ATOMIC_RELEASE);
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)buf_ring;
+    reg.ring_entries = buf_count;
+    reg.bgid = 0;
+    if (ioUringRegister(ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        std::cerr << "Registering the io_uring buffer ring failed: " << strerror(errno) << std::endl;
+        close();
+        return false;
+    }
+
+    wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeup_fd < 0) {
+        close();
+        return false;
+    }
+    armWakeup();
+    return true;
+}
+
+void IoRing::close() {
+    if (ring_fd >= 0) {
+        ::close(ring_fd); // Cancels whatever is still in flight
+        ring_fd = -1;
+    }
+    if (wakeup_fd >= 0) {
+        ::close(wakeup_fd);
+        wakeup_fd = -1;
+    }
+    if (rings != MAP_FAILED) {
+        munmap(rings, rings_size);
+        rings = MAP_FAILED;
+    }
+    if (sqes != MAP_FAILED) {
+        munmap(sqes, sqes_size);
+        sqes = (struct io_uring_sqe*)MAP_FAILED;
+    }
+    if (buf_ring != MAP_FAILED) {
+        munmap(buf_ring, buf_ring_size);
+        buf_ring = (struct io_uring_buf_ring*)MAP_FAILED;
+    }
+    pending = 0;
+}
+
+struct io_uring_sqe* IoRing::nextSqe() {
+    unsigned tail = *sq_tail;
+    if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+        // Queue full: hand the batch to the kernel and carry on
+        enter(pending, 0, 0);
+    }
+    struct io_uring_sqe* sqe = &sqes[tail & sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    pending++;
+    return sqe;
+}
+
+void IoRing::accept(SOCKET listener, uint64_t user_data) {
+    struct io_uring_sqe* sqe = nextSqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listener;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = user_data;
+}
+
+void IoRing::recv(SOCKET socket, uint64_t user_data) {
+    struct io_uring_sqe* sqe = nextSqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = socket;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = user_data;
+}
+
+void IoRing::sendmsg(SOCKET socket, const struct msghdr* msg, uint64_t user_data) {
+    struct io_uring_sqe* sqe = nextSqe();
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = socket;
+    sqe->addr = (uint64_t)(uintptr_t)msg;
+    sqe->len = 1;
+    sqe->msg_flags = SEND_FLAGS;
+    sqe->user_data = user_data;
+}
+
+void IoRing::pollWritable(SOCKET socket, uint64_t user_data) {
+    struct io_uring_sqe* sqe = nextSqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = socket;
+    sqe->poll32_events = POLLOUT;
+    sqe->user_data = user_data;
+}
+
+void IoRing::armWakeup() {
+    struct io_uring_sqe* sqe = nextSqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = wakeup_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = WAKEUP_DATA;
+}
+
+int IoRing::enter(unsigned to_submit, unsigned min_complete, int timeout_ms) {
+    struct __kernel_timespec timeout;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    unsigned flags = IORING_ENTER_EXT_ARG;
+    if (min_complete > 0) {
+        flags |= IORING_ENTER_GETEVENTS;
+        if (timeout_ms >= 0) {
+            timeout.tv_sec = timeout_ms / 1000;
+            timeout.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+            arg.ts = (uint64_t)(uintptr_t)&timeout;
+        }
+    }
+    int submitted = ioUringEnter(ring_fd, to_submit, min_complete, flags, &arg, sizeof(arg));
+    if (submitted < 0) {
+        if (errno != EINTR && errno != ETIME && errno != EBUSY && errno != EAGAIN) {
+            std::cerr << "io_uring_enter failed: " << strerror(errno) << std::endl;
+        }
+        return 0;
+    }
+    pending -= std::min(pending, (unsigned)submitted);
+    return submitted;
+}
+
+int IoRing::wait(std::vector<Completion>& ready, int timeout_ms) {
+    ready.clear();
+    bool have_completions = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE) != *cq_head;
+    if (pending > 0 || !have_completions) {
+        enter(pending, have_completions ? 0 : 1, timeout_ms);
+    }
+
+    unsigned head = *cq_head;
+    unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    bool rearm_wakeup = false;
+    for (; head != tail; head++) {
+        const struct io_uring_cqe& cqe = cqes[head & cq_mask];
+        if (cqe.user_data == WAKEUP_DATA) {
+            while (read(wakeup_fd, &wakeup_value, sizeof(wakeup_value)) > 0) {
+            }
+            rearm_wakeup = rearm_wakeup || !(cqe.flags & IORING_CQE_F_MORE);
+            continue;
+        }
+        ready.push_back(Completion{cqe.user_data, cqe.res, cqe.flags});
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+    if (rearm_wakeup) {
+        armWakeup();
+    }
+    return (int)ready.size();
+}
+
+void IoRing::wakeup() {
+    uint64_t one = 1;
+    if (write(wakeup_fd, &one, sizeof(one)) < 0) {
+        // Counter is saturated, a wakeup is pending anyway
+    }
+}
+
+const char* IoRing::buffer(const Completion& completion) const {
+    unsigned id = completion.flags >> IORING_CQE_BUFFER_SHIFT;
+    return buf_data.data() + (size_t)id * buf_size;
+}
+
+void IoRing::recycle(const Completion& completion) {
+    if (!(completion.flags & IORING_CQE_F_BUFFER)) {
+        return;
+    }
+    uint16_t tail = buf_ring->tail;
+    addBuffer(tail, completion.flags >> IORING_CQE_BUFFER_SHIFT);
+    __atomic_store_n(&buf_ring->tail, (uint16_t)(tail + 1), __ATOMIC_RELEASE);
+}
+
+void IoRing::addBuffer(unsigned slot, unsigned id) {
+    // Not buf_ring->bufs: in C++ the header's flexible array sits after an
+    // empty struct, one slot off from where the kernel reads
+    struct io_uring_buf& buf = ((struct io_uring_buf*)buf_ring)[slot & (buf_count - 1)];
+    buf.addr = (uint64_t)(uintptr_t)(buf_data.data() + (size_t)id * buf_size);
+    buf.len = buf_size;
+    buf.bid = (uint16_t)id;
+}
+#endif
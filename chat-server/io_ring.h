@@ -0,0 +1,91 @@
+#pragma once
+
+#include "platform.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+#include <vector>
+#include <cstdint>
+#include <linux/io_uring.h>
+
+// Minimal io_uring wrapper on the raw syscalls (no liburing), used by the
+// server's io_uring backend. Operations are queued in the submission ring
+// and reach the kernel in one io_uring_enter() with the next wait(), so a
+// whole fan-out costs one syscall. Receives take buffers from a provided
+// buffer ring; an eventfd lets other threads interrupt wait().
+class IoRing {
+public:
+    struct Completion {
+        uint64_t user_data;
+        int32_t res;
+        uint32_t flags;
+    };
+
+    IoRing();
+    ~IoRing();
+
+    // entries: submission queue size. buffers / buffer_size: the provided
+    // buffer ring for receives. False if io_uring is unavailable.
+    bool open(unsigned entries, unsigned buffers, unsigned buffer_size);
+    void close();
+
+    // Queue operations. accept and recv are multishot: they complete
+    // repeatedly with IORING_CQE_F_MORE set until they end.
+    void accept(SOCKET listener, uint64_t user_data);
+    void recv(SOCKET socket, uint64_t user_data);
+    // msg has to stay valid until the operation completes
+    void sendmsg(SOCKET socket, const struct msghdr* msg, uint64_t user_data);
+    void pollWritable(SOCKET socket, uint64_t user_data);
+
+    // Submit queued operations, wait up to timeout_ms (-1 = forever) and
+    // collect completions. Wakeups are consumed internally.
+    int wait(std::vector<Completion>& ready, int timeout_ms);
+
+    // Interrupts a wait() running on another thread
+    void wakeup();
+
+    // Data of the provided buffer a receive completion used; recycle it
+    // once copied
+    const char* buffer(const Completion& completion) const;
+    void recycle(const Completion& completion);
+
+private:
+    int ring_fd;
+    int wakeup_fd;
+
+    // Submission and completion rings (one mapping)
+    void* rings;
+    size_t rings_size;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    struct io_uring_sqe* sqes;
+    size_t sqes_size;
+    unsigned pending; // queued but not yet submitted
+
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+
+    // Provided buffers for receives
+    struct io_uring_buf_ring* buf_ring;
+    size_t buf_ring_size;
+    unsigned buf_count;
+    unsigned buf_size;
+    std::vector<char> buf_data;
+
+    uint64_t wakeup_value; // read target of the wakeup eventfd
+
+    struct io_uring_sqe* nextSqe();
+    int enter(unsigned to_submit, unsigned min_complete, int timeout_ms);
+    void addBuffer(unsigned slot, unsigned id);
+    void armWakeup();
+};
+#endif
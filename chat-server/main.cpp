@@ -1,33 +1,199 @@
 #include <iostream>
 #include <string>
+#include <thread>
+#include <algorithm>
+#include <cstdio>
 #include "server.h"
+#ifdef _WIN32
+#include <io.h>
+#endif
+
+void printUsage(const char* program) {
+    std::cout << "Usage: " << program << " [port] [options]" << std::endl;
+    std::cout << "  --shards N          reactor threads (0 = one per CPU core, default 1)" << std::endl;
+    std::cout << "  --queue-limit BYTES outbound bytes buffered per client (default 1048576)" << std::endl;
+    std::cout << "  --overflow POLICY   drop-oldest, disconnect or coalesce (default drop-oldest)" << std::endl;
+    std::cout << "  --history-messages N messages kept per room (0 = unlimited, default 10000)" << std::endl;
+    std::cout << "  --history-bytes N   history bytes kept per room (0 = unlimited, default 0)" << std::endl;
+    std::cout << "  --log-dir DIR       persist messages in an append-only log under DIR" << std::endl;
+    std::cout << "  --log-segment-bytes N  log segment size (default 16777216)" << std::endl;
+    std::cout << "  --log-commit-ms N   group commit window for log fsyncs (default 5)" << std::endl;
+    std::cout << "  --login-timeout-ms N time to finish logging in (0 = no limit, default 30000)" << std::endl;
+    std::cout << "  --verbose           log every login and logout" << std::endl;
+    std::cout << "  --flush-window-ms N batch broadcasts per client for N ms (0 = off, default 0)" << std::endl;
+    std::cout << "  --flush-bytes N     ...or until N bytes are queued (default 65536)" << std::endl;
+    std::cout << "  --metrics-port N    serve metrics over HTTP on 127.0.0.1:N (default off)" << std::endl;
+    std::cout << "  --io BACKEND        poll (epoll/WSAPoll, default) or uring (Linux io_uring)" << std::endl;
+    std::cout << "  --client-rate N     messages per second per connection (0 = unlimited, default 0)" << std::endl;
+    std::cout << "  --client-rate-bytes N  bytes per second per connection (0 = unlimited, default 0)" << std::endl;
+    std::cout << "  --room-rate N       chat messages per second per room (0 = unlimited, default 0)" << std::endl;
+    std::cout << "  --room-rate-bytes N chat bytes per second per room (0 = unlimited, default 0)" << std::endl;
+    std::cout << "  --rate-action ACTION  delay, drop or disconnect over a limit (default delay)" << std::endl;
+    std::cout << "  --compress-level N  zlib level 1-9 for framed clients asking for compression" << std::endl;
+    std::cout << "                      (0 = refuse, default 6)" << std::endl;
+    std::cout << "  --node-id N         this server's id in a cluster (unique, required with the options below)" << std::endl;
+    std::cout << "  --cluster-port N    accept links from other cluster nodes on port N" << std::endl;
+    std::cout << "  --peer HOST:PORT    cluster node to link to (repeatable)" << std::endl;
+    std::cout << "  --handoff-socket PATH  hand over to a new process through a Unix socket at PATH" << std::endl;
+    std::cout << "  --takeover          take over the connections of the server at --handoff-socket" << std::endl;
+}
 
 int main(int argc, char* argv[]) {
     // Initialize Winsock
-    WSADATA wsaData;
-    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+    if (!initSockets()) {
         std::cerr << "WSAStartup failed" << std::endl;
         return 1;
     }
-    
-    int port = 8080; // Default port
-    
-    if (argc > 1) {
-        port = std::stoi(argv[1]);
+
+    ServerConfig config;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--shards" && i + 1 < argc) {
+            config.shards = std::stoi(argv[++i]);
+        } else if (arg == "--queue-limit" && i + 1 < argc) {
+            config.queue_limit = std::stoul(argv[++i]);
+        } else if (arg == "--overflow" && i + 1 < argc) {
+            std::string policy = argv[++i];
+            if (policy == "drop-oldest") {
+                config.overflow_policy = OverflowPolicy::DROP_OLDEST;
+            } else if (policy == "disconnect") {
+                config.overflow_policy = OverflowPolicy::DISCONNECT;
+            } else if (policy == "coalesce") {
+                config.overflow_policy = OverflowPolicy::COALESCE;
+            } else {
+                printUsage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--history-messages" && i + 1 < argc) {
+            config.history_messages = std::stoul(argv[++i]);
+        } else if (arg == "--history-bytes" && i + 1 < argc) {
+            config.history_bytes = std::stoul(argv[++i]);
+        } else if (arg == "--log-dir" && i + 1 < argc) {
+            config.log_dir = argv[++i];
+        } else if (arg == "--log-segment-bytes" && i + 1 < argc) {
+            config.log_segment_bytes = std::stoull(argv[++i]);
+        } else if (arg == "--log-commit-ms" && i + 1 < argc) {
+            config.log_commit_ms = std::stoi(argv[++i]);
+        } else if (arg == "--login-timeout-ms" && i + 1 < argc) {
+            config.login_timeout_ms = std::stoi(argv[++i]);
+        } else if (arg == "--verbose") {
+            config.verbose = true;
+        } else if (arg == "--flush-window-ms" && i + 1 < argc) {
+            config.flush_window_ms = std::stoi(argv[++i]);
+        } else if (arg == "--flush-bytes" && i + 1 < argc) {
+            config.flush_bytes = std::stoul(argv[++i]);
+        } else if (arg == "--metrics-port" && i + 1 < argc) {
+            config.metrics_port = std::stoi(argv[++i]);
+        } else if (arg == "--io" && i + 1 < argc) {
+            std::string backend = argv[++i];
+            if (backend == "poll") {
+                config.io_backend = IoBackend::POLL;
+            } else if (backend == "uring") {
+                config.io_backend = IoBackend::IO_URING;
+            } else {
+                printUsage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--client-rate" && i + 1 < argc) {
+            config.client_rate_messages = std::stod(argv[++i]);
+        } else if (arg == "--client-rate-bytes" && i + 1 < argc) {
+            config.client_rate_bytes = std::stod(argv[++i]);
+        } else if (arg == "--room-rate" && i + 1 < argc) {
+            config.room_rate_messages = std::stod(argv[++i]);
+        } else if (arg == "--room-rate-bytes" && i + 1 < argc) {
+            config.room_rate_bytes = std::stod(argv[++i]);
+        } else if (arg == "--rate-action" && i + 1 < argc) {
+            std::string action = argv[++i];
+            if (action == "delay") {
+                config.rate_action = RateAction::DELAY;
+            } else if (action == "drop") {
+                config.rate_action = RateAction::DROP;
+            } else if (action == "disconnect") {
+                config.rate_action = RateAction::DISCONNECT;
+            } else {
+                printUsage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--compress-level" && i + 1 < argc) {
+            config.compress_level = std::max(0, std::min(9, std::stoi(argv[++i])));
+        } else if (arg == "--node-id" && i + 1 < argc) {
+            config.node_id = (uint32_t)std::stoul(argv[++i]);
+        } else if (arg == "--cluster-port" && i + 1 < argc) {
+            config.cluster_port = std::stoi(argv[++i]);
+        } else if (arg == "--peer" && i + 1 < argc) {
+            config.peers.push_back(argv[++i]);
+        } else if (arg == "--handoff-socket" && i + 1 < argc) {
+            config.handoff_path = argv[++i];
+        } else if (arg == "--takeover") {
+            config.takeover = true;
+        } else if (arg == "--help") {
+            printUsage(argv[0]);
+            return 0;
+        } else if (!arg.empty() && arg[0] != '-') {
+            config.port = std::stoi(arg);
+        } else {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (config.clustered() && config.node_id == 0) {
+        std::cerr << "A cluster node needs a --node-id" << std::endl;
+        return 1;
+    }
+    if (config.takeover && config.handoff_path.empty()) {
+        std::cerr << "--takeover needs the --handoff-socket of the running server" << std::endl;
+        return 1;
+    }
+
+    std::cout << "Starting simple chat server on port " << config.port << "..." << std::endl;
+
+#ifndef _WIN32
+    // SIGINT and SIGTERM stop the server. Blocked before the server's
+    // threads exist, so they inherit the mask and only sigwait() below
+    // takes them.
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, nullptr);
+#endif
+
+    ChatServer server(config);
+    if (!server.start()) {
+        cleanupSockets();
+        return 1;
     }
-    
-    std::cout << "Starting simple chat server on port " << port << "..." << std::endl;
-    
-    ChatServer server(port);
-    server.start();
-    
-    std::cout << "Server running. Press Enter to stop." << std::endl;
-    std::cin.get();
-    
+
+#ifndef _WIN32
+    std::thread([&server, stop_signals]() {
+        int signal_number;
+        sigwait(&stop_signals, &signal_number);
+        server.requestStop();
+    }).detach();
+    bool interactive = isatty(fileno(stdin));
+#else
+    bool interactive = _isatty(_fileno(stdin));
+#endif
+    // Enter stops it too, from a terminal only: under a service manager,
+    // nohup or a script stdin is often closed or /dev/null
+    if (interactive) {
+        std::cout << "Server running. Press Enter to stop." << std::endl;
+        std::thread([&server]() {
+            std::cin.get();
+            server.requestStop();
+        }).detach();
+    } else {
+        std::cout << "Server running. Stop it with SIGTERM or SIGINT." << std::endl;
+    }
+    // A successor taking over stops the server as well
+    server.wait();
+
     server.stop();
-    
+
     // Cleanup Winsock
-    WSACleanup();
-    
+    cleanupSockets();
+
     return 0;
-} 
\ No newline at end of file
+}
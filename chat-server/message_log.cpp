@@ -0,0 +1,418 @@
+#include "message_log.h"
+#include "server.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <cstdio>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#endif
+
+static const size_t MAX_OPEN_SEGMENTS = 64;
+
+// Record encoding
+static uint32_t checksum(const char* data, size_t length) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+void appendRecord(std::string& out, const Message& msg) {
+    static const std::string none;
+    const std::string& room = msg.room ? *msg.room : none;
+    const std::string& sender = msg.sender ? *msg.sender : none;
+
+    size_t start = out.size();
+    out.append(FRAME_HEADER_SIZE + 4, '\0');
+    putVarint(out, msg.seq);
+    putVarint(out, (uint64_t)msg.time_ms);
+    putVarint(out, room.size());
+    out += room;
+    putVarint(out, sender.size());
+    out += sender;
+    out.append(msg.content.data, msg.content.length);
+
+    size_t body = start + FRAME_HEADER_SIZE + 4;
+    uint32_t sum = checksum(out.data() + body, out.size() - body);
+    writeFrameHeader(&out[start], FRAME_RECORD, (uint32_t)(out.size() - start - FRAME_HEADER_SIZE));
+    for (int i = 0; i < 4; i++) {
+        out[start + FRAME_HEADER_SIZE + i] = (char)((sum >> (24 - 8 * i)) & 0xff);
+    }
+}
+
+bool decodeRecord(std::string_view payload, Message& msg) {
+    if (payload.size() < 4) {
+        return false;
+    }
+    const unsigned char* raw = (const unsigned char*)payload.data();
+    uint32_t sum = ((uint32_t)raw[0] << 24) | ((uint32_t)raw[1] << 16) |
+                   ((uint32_t)raw[2] << 8) | (uint32_t)raw[3];
+    if (checksum(payload.data() + 4, payload.size() - 4) != sum) {
+        return false;
+    }
+    RecordView record;
+    if (!parseRecord(payload, record)) {
+        return false;
+    }
+    msg.seq = record.seq;
+    msg.time_ms = record.time_ms;
+    msg.room = intern(record.room);
+    msg.sender = intern(record.sender);
+    msg.content = Payload(nullptr, record.content.data(), record.content.size());
+    msg.encoded.reset();
+    return true;
+}
+
+#ifdef _WIN32
+// The log relies on pwrite/mmap; Windows builds run without persistence.
+
+LogFile::~LogFile() {
+}
+
+MessageLog::MessageLog(const std::string& log_directory, uint64_t max_segment_size, int commit_interval)
+    : directory(log_directory), segment_size(max_segment_size), commit_interval_ms(commit_interval),
+      current_size(0), stopping(false) {
+}
+
+MessageLog::~MessageLog() {
+}
+
+bool MessageLog::open(size_t, const std::function<void(const Message&, LogPosition)>&) {
+    std::cerr << "The message log is not supported on Windows" << std::endl;
+    return false;
+}
+
+void MessageLog::close() {
+}
+
+LogPosition MessageLog::append(std::string_view) {
+    return LogPosition();
+}
+
+void MessageLog::flushWrites() {
+}
+
+bool MessageLog::ranges(LogPosition, LogPosition, std::vector<FileRange>&) {
+    return false;
+}
+
+#else
+
+LogFile::~LogFile() {
+    ::close(fd);
+}
+
+MessageLog::MessageLog(const std::string& log_directory, uint64_t max_segment_size, int commit_interval)
+    : directory(log_directory), segment_size(max_segment_size), commit_interval_ms(commit_interval),
+      current_size(0), stopping(false) {
+}
+
+MessageLog::~MessageLog() {
+    close();
+}
+
+std::shared_ptr<LogFile> MessageLog::openSegment(uint32_t id, bool create) {
+    char name[32];
+    snprintf(name, sizeof(name), "/%08u.log", id);
+    std::string path = directory + name;
+    int fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), 0644);
+    if (fd < 0) {
+        std::cerr << "Error opening log segment " << path << ": " << strerror(errno) << std::endl;
+        return std::shared_ptr<LogFile>();
+    }
+    return std::make_shared<LogFile>(fd, id);
+}
+
+bool MessageLog::open(size_t max_records, const std::function<void(const Message&, LogPosition)>& visit) {
+    size_t slash = directory.find_last_of('/');
+    if (slash != std::string::npos && slash > 0) {
+        mkdir(directory.substr(0, slash).c_str(), 0755);
+    }
+    if (mkdir(directory.c_str(), 0755) < 0 && errno != EEXIST) {
+        std::cerr << "Error creating log directory " << directory << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    // Find existing segments
+    std::vector<uint32_t> ids;
+    DIR* dir = opendir(directory.c_str());
+    if (dir == NULL) {
+        std::cerr << "Error reading log directory " << directory << std::endl;
+        return false;
+    }
+    while (struct dirent* entry = readdir(dir)) {
+        unsigned int id;
+        char suffix[8];
+        if (sscanf(entry->d_name, "%8u.%4s", &id, suffix) == 2 && strcmp(suffix, "log") == 0 && id > 0) {
+            ids.push_back(id);
+        }
+    }
+    closedir(dir);
+    std::sort(ids.begin(), ids.end());
+
+    // Map segments newest first until enough records are found
+    struct MappedSegment {
+        std::shared_ptr<LogFile> file;
+        const char* data;
+        size_t length;
+        std::vector<uint64_t> offsets;
+    };
+    std::vector<MappedSegment> mapped;
+    size_t total = 0;
+
+    for (size_t i = ids.size(); i-- > 0;) {
+        MappedSegment segment;
+        segment.file = openSegment(ids[i], false);
+        if (!segment.file) {
+            break;
+        }
+        struct stat info;
+        fstat(segment.file->fd, &info);
+        segment.length = (size_t)info.st_size;
+        segment.data = NULL;
+        if (segment.length > 0) {
+            void* map = mmap(NULL, segment.length, PROT_READ, MAP_PRIVATE, segment.file->fd, 0);
+            if (map == MAP_FAILED) {
+                std::cerr << "Error mapping log segment " << ids[i] << std::endl;
+                break;
+            }
+            madvise(map, segment.length, MADV_SEQUENTIAL);
+            segment.data = (const char*)map;
+        }
+
+        // Index records up to the first torn or corrupt one
+        uint64_t offset = 0;
+        while (offset + FRAME_HEADER_SIZE <= segment.length) {
+            const unsigned char* header = (const unsigned char*)segment.data + offset;
+            uint64_t length = ((uint32_t)header[0] << 24) | ((uint32_t)header[1] << 16) |
+                              ((uint32_t)header[2] << 8) | (uint32_t)header[3];
+            if (header[4] != FRAME_RECORD || offset + FRAME_HEADER_SIZE + length > segment.length) {
+                break;
+            }
+            segment.offsets.push_back(offset);
+            offset += FRAME_HEADER_SIZE + length;
+        }
+        if (offset < segment.length && i + 1 == ids.size()) {
+            // Drop a partially written tail so appends continue cleanly
+            std::cerr << "Truncating log segment " << ids[i] << " at " << offset << std::endl;
+            if (ftruncate(segment.file->fd, offset) < 0) {
+                std::cerr << "Error truncating log segment: " << strerror(errno) << std::endl;
+            }
+        }
+        segment.file->size = offset;
+
+        total += segment.offsets.size();
+        mapped.insert(mapped.begin(), segment);
+        if (max_records > 0 && total >= max_records) {
+            break;
+        }
+    }
+
+    // Replay oldest first, skipping what does not fit the history window
+    size_t skip = (max_records > 0 && total > max_records) ? total - max_records : 0;
+    Message msg;
+    for (auto& segment : mapped) {
+        for (uint64_t offset : segment.offsets) {
+            if (skip > 0) {
+                skip--;
+                continue;
+            }
+            const unsigned char* header = (const unsigned char*)segment.data + offset;
+            uint32_t length = ((uint32_t)header[0] << 24) | ((uint32_t)header[1] << 16) |
+                              ((uint32_t)header[2] << 8) | (uint32_t)header[3];
+            std::string_view payload(segment.data + offset + FRAME_HEADER_SIZE, length);
+            if (decodeRecord(payload, msg)) {
+                visit(msg, LogPosition(segment.file->id, offset));
+            }
+        }
+        if (segment.data != NULL) {
+            munmap((void*)segment.data, segment.length);
+        }
+        files.push_back(segment.file);
+    }
+
+    // Continue the newest segment, or start a new one
+    if (!files.empty() && files.back()->id == ids.back() && files.back()->size < segment_size) {
+        current = files.back();
+    } else {
+        current = openSegment(ids.empty() ? 1 : ids.back() + 1, true);
+        if (!current) {
+            return false;
+        }
+        files.push_back(current);
+    }
+    current_size = current->size;
+
+    stopping = false;
+    commit_thread = std::thread(&MessageLog::commitLoop, this);
+    return true;
+}
+
+void MessageLog::close() {
+    {
+        std::lock_guard<std::mutex> lock(log_mutex);
+        if (!current) {
+            return;
+        }
+        stopping = true;
+    }
+    commit_cv.notify_all();
+    if (commit_thread.joinable()) {
+        commit_thread.join();
+    }
+
+    std::lock_guard<std::mutex> lock(log_mutex);
+    files.clear();
+    current.reset();
+}
+
+LogPosition MessageLog::append(std::string_view record) {
+    std::lock_guard<std::mutex> lock(log_mutex);
+    if (!current) {
+        return LogPosition();
+    }
+
+    // Roll over to a new segment when this one is full
+    if (current_size > 0 && current_size + record.size() > segment_size) {
+        std::shared_ptr<LogFile> next = openSegment(current->id + 1, true);
+        if (next) {
+            current = next;
+            current_size = 0;
+            files.push_back(current);
+            if (files.size() > MAX_OPEN_SEGMENTS) {
+                files.erase(files.begin());
+            }
+        }
+    }
+
+    LogPosition position(current->id, current_size);
+    bool was_idle = pending.empty();
+    if (pending.empty() || pending.back().file != current) {
+        pending.push_back(PendingWrite{current, current_size, std::string()});
+    }
+    pending.back().data.append(record.data(), record.size());
+    current_size += record.size();
+    current->size = current_size;
+
+    if (was_idle) {
+        commit_cv.notify_one();
+    }
+    return position;
+}
+
+void MessageLog::writePending(std::vector<PendingWrite>& batch) {
+    for (auto& write : batch) {
+        size_t done = 0;
+        while (done < write.data.size()) {
+            ssize_t written = pwrite(write.file->fd, write.data.data() + done,
+                                     write.data.size() - done, write.offset + done);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                std::cerr << "Error writing log segment " << write.file->id << ": "
+                          << strerror(errno) << std::endl;
+                break;
+            }
+            done += written;
+        }
+    }
+}
+
+void MessageLog::flushWrites() {
+    std::lock_guard<std::mutex> io_lock(io_mutex);
+    std::vector<PendingWrite> batch;
+    {
+        std::lock_guard<std::mutex> lock(log_mutex);
+        batch.swap(pending);
+    }
+    if (batch.empty()) {
+        return;
+    }
+    writePending(batch);
+
+    // The commit thread still owes these an fsync
+    std::lock_guard<std::mutex> lock(log_mutex);
+    for (auto& write : batch) {
+        unsynced.push_back(write.file);
+    }
+    commit_cv.notify_one();
+}
+
+void MessageLog::commitLoop() {
+    std::unique_lock<std::mutex> lock(log_mutex);
+
+    while (true) {
+        commit_cv.wait(lock, [this]() { return stopping || !pending.empty() || !unsynced.empty(); });
+        if (!stopping) {
+            // Let more records join this batch
+            commit_cv.wait_for(lock, std::chrono::milliseconds(commit_interval_ms),
+                               [this]() { return stopping; });
+        }
+        bool last_round = stopping;
+        lock.unlock();
+
+        std::vector<std::shared_ptr<LogFile>> to_sync;
+        {
+            std::lock_guard<std::mutex> io_lock(io_mutex);
+            std::vector<PendingWrite> batch;
+            {
+                std::lock_guard<std::mutex> guard(log_mutex);
+                batch.swap(pending);
+                to_sync.swap(unsynced);
+            }
+            writePending(batch);
+            for (auto& write : batch) {
+                to_sync.push_back(write.file);
+            }
+        }
+
+        // One fsync per file for the whole batch
+        std::sort(to_sync.begin(), to_sync.end());
+        to_sync.erase(std::unique(to_sync.begin(), to_sync.end()), to_sync.end());
+        for (auto& file : to_sync) {
+            fdatasync(file->fd);
+        }
+
+        lock.lock();
+        if (last_round && pending.empty()) {
+            break;
+        }
+    }
+}
+
+bool MessageLog::ranges(LogPosition from, LogPosition to, std::vector<FileRange>& out) {
+    std::lock_guard<std::mutex> lock(log_mutex);
+    if (!from.valid() || !current) {
+        return false;
+    }
+    if (!to.valid()) {
+        to = LogPosition(current->id, current_size);
+    }
+
+    bool found = false;
+    for (auto& file : files) {
+        if (file->id < from.segment || file->id > to.segment) {
+            continue;
+        }
+        if (file->id == from.segment) {
+            found = true;
+        }
+        uint64_t begin = file->id == from.segment ? from.offset : 0;
+        uint64_t end = file->id == to.segment ? to.offset : file->size;
+        if (end > begin) {
+            out.push_back(FileRange{file, begin, end - begin});
+        }
+    }
+    // The first segment may already be closed
+    return found;
+}
+
+#endif
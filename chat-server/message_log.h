@@ -0,0 +1,103 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include <cstdint>
+
+struct Message;
+
+// Where a record starts in the log
+struct LogPosition {
+    uint32_t segment;
+    uint64_t offset;
+
+    LogPosition() : segment(0), offset(0) {}
+    LogPosition(uint32_t seg, uint64_t off) : segment(seg), offset(off) {}
+    bool valid() const { return segment != 0; }
+};
+
+// One open segment file, shared with write queues that stream from it
+class LogFile {
+public:
+    int fd;
+    uint32_t id;
+    uint64_t size; // logical size, guarded by the owning log's mutex
+
+    LogFile(int file_fd, uint32_t segment_id) : fd(file_fd), id(segment_id), size(0) {}
+    ~LogFile();
+};
+
+// A byte range of a segment file, sent to a client with sendfile()
+struct FileRange {
+    std::shared_ptr<LogFile> file;
+    uint64_t offset;
+    uint64_t length;
+};
+
+// Encode a message as a RECORD frame (see protocol.h), and back.
+// Payload: [u32 checksum][varint sequence id][varint time, ms since epoch]
+//          [varint room length][room][varint sender length][sender][content]
+// Decoded content points into payload and has no owner.
+void appendRecord(std::string& out, const Message& msg);
+bool decodeRecord(std::string_view payload, Message& msg);
+
+// Segmented append-only message log for one room.
+//
+// Segment files are named NNNNNNNN.log and hold back-to-back RECORD
+// frames, so a range of a segment is a valid framed stream for clients.
+// Appends go to an in-memory batch; a commit thread writes and fsyncs
+// each batch at most every commit_interval_ms (group commit).
+class MessageLog {
+private:
+    struct PendingWrite {
+        std::shared_ptr<LogFile> file;
+        uint64_t offset;
+        std::string data;
+    };
+
+    std::string directory;
+    uint64_t segment_size;
+    int commit_interval_ms;
+
+    std::vector<std::shared_ptr<LogFile>> files; // open segments, oldest first
+    std::shared_ptr<LogFile> current;
+    uint64_t current_size; // including bytes not yet written
+
+    std::vector<PendingWrite> pending;
+    std::vector<std::shared_ptr<LogFile>> unsynced; // written by flushWrites()
+    std::mutex log_mutex;
+    std::mutex io_mutex; // orders writes from the commit thread and flushWrites()
+    std::condition_variable commit_cv;
+    bool stopping;
+    std::thread commit_thread;
+
+    std::shared_ptr<LogFile> openSegment(uint32_t id, bool create);
+    void writePending(std::vector<PendingWrite>& batch);
+    void commitLoop();
+
+public:
+    MessageLog(const std::string& log_directory, uint64_t max_segment_size, int commit_interval);
+    ~MessageLog();
+
+    // Memory-maps the newest segments and calls visit for (at most)
+    // the last max_records records, oldest first, then starts the
+    // commit thread. max_records 0 replays everything.
+    bool open(size_t max_records, const std::function<void(const Message&, LogPosition)>& visit);
+    void close();
+
+    // Append an encoded RECORD frame
+    LogPosition append(std::string_view record);
+
+    // Hand batched records to the kernel now (no fsync), so that file
+    // ranges up to the current end can be streamed.
+    void flushWrites();
+
+    // File ranges covering [from, to)
+    bool ranges(LogPosition from, LogPosition to, std::vector<FileRange>& out);
+};
@@ -0,0 +1,241 @@
+#include "metrics.h"
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// Registry of every thread's metrics
+static std::mutex registry_mutex;
+
+static std::vector<std::unique_ptr<ThreadMetrics>>& registry() {
+    static std::vector<std::unique_ptr<ThreadMetrics>> threads;
+    return threads;
+}
+
+ThreadMetrics& threadMetrics() {
+    thread_local ThreadMetrics* local = nullptr;
+    if (!local) {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        registry().push_back(std::unique_ptr<ThreadMetrics>(new ThreadMetrics()));
+        local = registry().back().get();
+    }
+    return *local;
+}
+
+uint64_t metricTotal(Counter ThreadMetrics::* counter) {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    uint64_t total = 0;
+    for (const auto& metrics : registry()) {
+        total += ((*metrics).*counter).get();
+    }
+    return total;
+}
+
+uint64_t metricMax(Counter ThreadMetrics::* counter) {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    uint64_t highest = 0;
+    for (const auto& metrics : registry()) {
+        highest = std::max(highest, ((*metrics).*counter).get());
+    }
+    return highest;
+}
+
+// Report formatting
+static void appendValue(std::string& out, const char* name, uint64_t value) {
+    out += name;
+    out += ' ';
+    out += std::to_string(value);
+    out += '\n';
+}
+
+static void appendSummary(std::string& out, const char* name, const char* unit, AtomicHistogram ThreadMetrics::* field,
+                          double scale) {
+    Histogram merged;
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        for (const auto& metrics : registry()) {
+            ((*metrics).*field).copyTo(merged);
+        }
+    }
+
+    static const char* const QUANTILES[] = {"0.5", "0.9", "0.99", "0.999"};
+    char line[160];
+    for (const char* quantile : QUANTILES) {
+        snprintf(line, sizeof(line), "chat_%s_%s{quantile=\"%s\"} %.1f\n", name, unit, quantile,
+                 merged.percentile(atof(quantile) * 100) / scale);
+        out += line;
+    }
+    snprintf(line, sizeof(line), "chat_%s_%s_max %.1f\nchat_%s_%s_count %llu\n", name, unit,
+             merged.max() / scale, name, unit, (unsigned long long)merged.count());
+    out += line;
+}
+
+std::string formatMetrics() {
+    uint64_t connects = metricTotal(&ThreadMetrics::connects);
+    uint64_t disconnects = metricTotal(&ThreadMetrics::disconnects);
+    uint64_t enqueued = metricTotal(&ThreadMetrics::messages_enqueued);
+    uint64_t sequenced = metricTotal(&ThreadMetrics::messages_sequenced);
+
+    std::string out;
+    appendValue(out, "chat_connections_accepted", connects);
+    appendValue(out, "chat_connections_closed", disconnects);
+    appendValue(out, "chat_connections_open", connects - std::min(connects, disconnects));
+    appendValue(out, "chat_bytes_in", metricTotal(&ThreadMetrics::bytes_in));
+    appendValue(out, "chat_bytes_out", metricTotal(&ThreadMetrics::bytes_out));
+    appendValue(out, "chat_messages_received", metricTotal(&ThreadMetrics::messages_received));
+    appendValue(out, "chat_messages_sequenced", sequenced);
+    appendValue(out, "chat_sequencer_backlog", enqueued - std::min(enqueued, sequenced));
+    appendValue(out, "chat_messages_delivered", metricTotal(&ThreadMetrics::messages_delivered));
+    appendValue(out, "chat_queue_dropped_messages", metricTotal(&ThreadMetrics::dropped_messages));
+    appendValue(out, "chat_queue_coalesced_messages", metricTotal(&ThreadMetrics::coalesced_messages));
+    appendValue(out, "chat_queue_overflow_disconnects", metricTotal(&ThreadMetrics::overflow_disconnects));
+    appendValue(out, "chat_queue_peak_bytes", metricMax(&ThreadMetrics::peak_queue_bytes));
+    appendValue(out, "chat_cluster_relayed_out", metricTotal(&ThreadMetrics::relayed_out));
+    appendValue(out, "chat_cluster_relayed_in", metricTotal(&ThreadMetrics::relayed_in));
+    appendValue(out, "chat_cluster_duplicates", metricTotal(&ThreadMetrics::relay_duplicates));
+    appendValue(out, "chat_rate_delayed", metricTotal(&ThreadMetrics::rate_delayed));
+    appendValue(out, "chat_rate_dropped_messages", metricTotal(&ThreadMetrics::rate_dropped));
+    appendValue(out, "chat_rate_disconnects", metricTotal(&ThreadMetrics::rate_disconnects));
+    appendValue(out, "chat_compression_bytes_in", metricTotal(&ThreadMetrics::deflate_in));
+    appendValue(out, "chat_compression_bytes_out", metricTotal(&ThreadMetrics::deflate_out));
+
+    appendSummary(out, "recv_to_enqueue", "us", &ThreadMetrics::recv_to_enqueue, 1000.0);
+    appendSummary(out, "enqueue_to_history", "us", &ThreadMetrics::enqueue_to_history, 1000.0);
+    appendSummary(out, "fan_out", "us", &ThreadMetrics::fan_out, 1000.0);
+    appendSummary(out, "client_queue", "bytes", &ThreadMetrics::queue_depth, 1.0);
+    return out;
+}
+
+// MetricsEndpoint implementation
+MetricsEndpoint::MetricsEndpoint() : listen_socket(INVALID_SOCKET), running(false) {
+}
+
+MetricsEndpoint::~MetricsEndpoint() {
+    stop();
+    poller.close();
+    if (listen_socket != INVALID_SOCKET) {
+        closesocket(listen_socket);
+    }
+}
+
+bool MetricsEndpoint::listen(int port) {
+    listen_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_socket == INVALID_SOCKET) {
+        std::cerr << "Error creating metrics socket: " << WSAGetLastError() << std::endl;
+        return false;
+    }
+    int opt = 1;
+    setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, (char*)&opt, sizeof(opt));
+
+    // Local scrapers only
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+
+    if (bind(listen_socket, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        ::listen(listen_socket, SOMAXCONN) < 0 || !setNonBlocking(listen_socket) ||
+        !poller.open() || !poller.add(listen_socket, Poller::READABLE)) {
+        std::cerr << "Error setting up the metrics endpoint on port " << port << ": "
+                  << WSAGetLastError() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void MetricsEndpoint::start() {
+    running = true;
+    serve_thread = std::thread(&MetricsEndpoint::serve, this);
+}
+
+void MetricsEndpoint::stop() {
+    running = false;
+    poller.wakeup();
+    if (serve_thread.joinable()) {
+        serve_thread.join();
+    }
+    while (!requests.empty()) {
+        closeConnection(requests.begin()->first);
+    }
+}
+
+void MetricsEndpoint::close() {
+    stop();
+    if (listen_socket != INVALID_SOCKET) {
+        poller.remove(listen_socket);
+        closesocket(listen_socket);
+        listen_socket = INVALID_SOCKET;
+    }
+    poller.close(); // listen() opens it again
+}
+
+void MetricsEndpoint::serve() {
+    std::vector<Poller::Event> ready;
+    while (running) {
+        poller.wait(ready, -1);
+        for (const auto& event : ready) {
+            if (event.fd == listen_socket) {
+                acceptConnections();
+            } else if (requests.count(event.fd)) {
+                handleReadable(event.fd);
+            }
+        }
+    }
+}
+
+void MetricsEndpoint::acceptConnections() {
+    while (true) {
+        SOCKET socket = accept(listen_socket, NULL, NULL);
+        if (socket == INVALID_SOCKET) {
+            return;
+        }
+        if (!setNonBlocking(socket) || !poller.add(socket, Poller::READABLE)) {
+            closesocket(socket);
+            continue;
+        }
+        requests[socket] = std::string();
+    }
+}
+
+void MetricsEndpoint::handleReadable(SOCKET socket) {
+    char buffer[1024];
+    int bytes_read = recv(socket, buffer, sizeof(buffer), 0);
+    if (bytes_read < 0 && socketWouldBlock()) {
+        return;
+    }
+    if (bytes_read <= 0) {
+        closeConnection(socket);
+        return;
+    }
+
+    // Answer once the request headers are complete, whatever was asked
+    std::string& request = requests[socket];
+    request.append(buffer, bytes_read);
+    if (request.find("\r\n\r\n") == std::string::npos && request.find("\n\n") == std::string::npos) {
+        if (request.size() > 8192) {
+            closeConnection(socket);
+        }
+        return;
+    }
+
+    std::string body = formatMetrics();
+    std::string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                           "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                           "Connection: close\r\n\r\n" + body;
+    // A few KB fit in any socket buffer
+    if (send(socket, response.data(), (int)response.size(), SEND_FLAGS) < (int)response.size()) {
+        std::cerr << "Metrics response truncated" << std::endl;
+    }
+    shutdown(socket, SHUT_RDWR);
+    closeConnection(socket);
+}
+
+void MetricsEndpoint::closeConnection(SOCKET socket) {
+    poller.remove(socket);
+    closesocket(socket);
+    requests.erase(socket);
+}
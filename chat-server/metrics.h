@@ -0,0 +1,100 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <thread>
+#include <atomic>
+#include <cstdint>
+#include "platform.h"
+#include "poller.h"
+#include "histogram.h"
+
+// Counter with a single writing thread; any thread may read it
+class Counter {
+private:
+    std::atomic<uint64_t> value;
+
+public:
+    Counter() : value(0) {}
+
+    void add(uint64_t amount) {
+        value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+    // Keep the highest value seen
+    void raise(uint64_t candidate) {
+        if (candidate > value.load(std::memory_order_relaxed)) {
+            value.store(candidate, std::memory_order_relaxed);
+        }
+    }
+    uint64_t get() const { return value.load(std::memory_order_relaxed); }
+};
+
+// Counters and latency histograms of one thread (a shard or the
+// sequencer). Only that thread records, so recording is a plain store;
+// readers sum all threads. Latencies are in nanoseconds.
+struct alignas(64) ThreadMetrics {
+    Counter connects;
+    Counter disconnects;
+    Counter bytes_in;
+    Counter bytes_out;
+    Counter messages_received;  // chat lines and direct messages from clients
+    Counter messages_enqueued;  // handed to the sequencer
+    Counter messages_sequenced;
+    Counter messages_delivered; // copies queued for recipients
+    Counter dropped_messages;   // outbound queue overflow, see OverflowPolicy
+    Counter coalesced_messages;
+    Counter overflow_disconnects;
+    Counter peak_queue_bytes;   // highest outbound queue of one client
+    Counter relayed_out;        // messages sent to cluster peers, per link
+    Counter relayed_in;         // messages received from cluster peers
+    Counter relay_duplicates;   // received again and dropped
+    Counter rate_delayed;       // times a client was throttled by a rate limit
+    Counter rate_dropped;       // messages over a rate limit discarded
+    Counter rate_disconnects;
+    Counter deflate_in;         // bytes compressed for clients...
+    Counter deflate_out;        // ...and what they became
+
+    AtomicHistogram recv_to_enqueue;    // line read until handed to the sequencer
+    AtomicHistogram enqueue_to_history; // queued until stored by its room
+    AtomicHistogram fan_out;            // one broadcast to one shard's members
+    AtomicHistogram queue_depth;        // bytes queued on a client after a delivery
+};
+
+// The calling thread's metrics, registered on first use and kept for the
+// life of the process
+ThreadMetrics& threadMetrics();
+
+// A counter summed over all threads, or its highest value
+uint64_t metricTotal(Counter ThreadMetrics::* counter);
+uint64_t metricMax(Counter ThreadMetrics::* counter);
+
+// Every metric as "name value" lines (Prometheus text format)
+std::string formatMetrics();
+
+// Serves formatMetrics() over HTTP on a loopback port, for scrapers:
+//   curl http://127.0.0.1:<port>/metrics
+class MetricsEndpoint {
+private:
+    SOCKET listen_socket;
+    Poller poller;
+    std::atomic<bool> running;
+    std::thread serve_thread;
+    // Open connections and the request bytes they sent so far
+    std::map<SOCKET, std::string> requests;
+
+    void serve();
+    void acceptConnections();
+    void handleReadable(SOCKET socket);
+    void closeConnection(SOCKET socket);
+
+public:
+    MetricsEndpoint();
+    ~MetricsEndpoint();
+
+    bool listen(int port);
+    void start();
+    void stop();
+    // Stops and frees the port (for a hot restart successor)
+    void close();
+};
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <atomic>
+#include <utility>
+
+// Unbounded lock-free queue for many producers and one consumer
+// (Vyukov's intrusive MPSC design). push() is wait-free; pop() may report
+// empty while a concurrent push is half done, the element shows up on
+// the next call.
+template <typename T>
+class MpscQueue {
+private:
+    struct Node {
+        std::atomic<Node*> next;
+        T value;
+
+        Node() : next(nullptr) {}
+        explicit Node(T&& item) : next(nullptr), value(std::move(item)) {}
+    };
+
+    alignas(64) std::atomic<Node*> head; // last pushed node, producers swap here
+    alignas(64) Node* tail;              // consumed node before the oldest element
+
+public:
+    MpscQueue() {
+        Node* stub = new Node();
+        head.store(stub, std::memory_order_relaxed);
+        tail = stub;
+    }
+
+    ~MpscQueue() {
+        T item;
+        while (pop(item)) {
+        }
+        delete tail;
+    }
+
+    MpscQueue(const MpscQueue&) = delete;
+    MpscQueue& operator=(const MpscQueue&) = delete;
+
+    // Any thread
+    void push(T item) {
+        Node* node = new Node(std::move(item));
+        Node* prev = head.exchange(node, std::memory_order_acq_rel);
+        prev->next.store(node, std::memory_order_release);
+    }
+
+    // Consumer thread only
+    bool pop(T& out) {
+        Node* next = tail->next.load(std::memory_order_acquire);
+        if (next == nullptr) {
+            return false;
+        }
+        out = std::move(next->value);
+        delete tail;
+        tail = next;
+        return true;
+    }
+
+    // Consumer thread only
+    bool empty() const {
+        return tail->next.load(std::memory_order_acquire) == nullptr;
+    }
+};
@@ -0,0 +1,141 @@
+#pragma once
+
+// Thin socket compatibility layer so the same sources build with
+// Winsock (MinGW) and with POSIX sockets (Linux).
+
+#include <ctime>
+
+#ifdef _WIN32
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0600 // WSAPoll
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+
+typedef int socklen_t;
+#ifndef SHUT_RDWR
+#define SHUT_RDWR SD_BOTH
+#endif
+
+inline bool initSockets() {
+    WSADATA wsaData;
+    return WSAStartup(MAKEWORD(2, 2), &wsaData) == 0;
+}
+
+inline void cleanupSockets() {
+    WSACleanup();
+}
+
+inline bool setNonBlocking(SOCKET socket) {
+    u_long mode = 1;
+    return ioctlsocket(socket, FIONBIO, &mode) == 0;
+}
+
+inline bool socketWouldBlock() {
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+}
+
+// A non-blocking connect() that is still in progress
+inline bool connectPending() {
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+}
+
+inline void localTime(std::time_t time, std::tm* out) {
+    localtime_s(out, &time);
+}
+
+// Scatter-gather send
+typedef WSABUF IoSlice;
+
+inline void setSlice(IoSlice& slice, const char* data, size_t length) {
+    slice.buf = (char*)data;
+    slice.len = (ULONG)length;
+}
+
+inline int sendSlices(SOCKET socket, IoSlice* slices, int count) {
+    DWORD sent = 0;
+    if (WSASend(socket, slices, (DWORD)count, &sent, 0, NULL, NULL) != 0) {
+        return -1;
+    }
+    return (int)sent;
+}
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cerrno>
+#include <cstring>
+#include <csignal>
+
+typedef int SOCKET;
+#define INVALID_SOCKET (-1)
+#define SOCKET_ERROR (-1)
+
+inline int closesocket(SOCKET socket) {
+    return close(socket);
+}
+
+inline int WSAGetLastError() {
+    return errno;
+}
+
+inline bool initSockets() {
+    // Writes to a closed peer must fail with EPIPE, not kill the process
+    signal(SIGPIPE, SIG_IGN);
+    return true;
+}
+
+inline void cleanupSockets() {
+}
+
+inline bool setNonBlocking(SOCKET socket) {
+    int flags = fcntl(socket, F_GETFL, 0);
+    return flags >= 0 && fcntl(socket, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+inline bool socketWouldBlock() {
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+inline bool connectPending() {
+    return errno == EINPROGRESS;
+}
+
+inline void localTime(std::time_t time, std::tm* out) {
+    localtime_r(&time, out);
+}
+#endif
+
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL // a dead peer must not raise SIGPIPE
+#else
+#define SEND_FLAGS 0
+#endif
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#define HAVE_SENDFILE 1
+#endif
+
+#ifndef _WIN32
+// Scatter-gather send (sendmsg rather than writev so SEND_FLAGS apply)
+typedef struct iovec IoSlice;
+
+inline void setSlice(IoSlice& slice, const char* data, size_t length) {
+    slice.iov_base = (void*)data;
+    slice.iov_len = length;
+}
+
+inline int sendSlices(SOCKET socket, IoSlice* slices, int count) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = slices;
+    msg.msg_iovlen = count;
+    return (int)sendmsg(socket, &msg, SEND_FLAGS);
+}
+#endif
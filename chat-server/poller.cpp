@@ -0,0 +1,208 @@
+#include "poller.h"
+#include <cstring>
+#include <cstdint>
+
+#ifndef _WIN32
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+#ifdef _WIN32
+// Windows implementation: WSAPoll over a flat array, with a loopback
+// UDP socket connected to itself acting as the wakeup channel.
+
+Poller::Poller() : wakeup_socket(INVALID_SOCKET) {
+}
+
+Poller::~Poller() {
+    close();
+}
+
+bool Poller::open() {
+    wakeup_socket = socket(AF_INET, SOCK_DGRAM, 0);
+    if (wakeup_socket == INVALID_SOCKET) {
+        return false;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    socklen_t len = sizeof(addr);
+    if (bind(wakeup_socket, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        getsockname(wakeup_socket, (struct sockaddr *)&addr, &len) < 0 ||
+        connect(wakeup_socket, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        closesocket(wakeup_socket);
+        wakeup_socket = INVALID_SOCKET;
+        return false;
+    }
+    setNonBlocking(wakeup_socket);
+    return add(wakeup_socket, READABLE);
+}
+
+void Poller::close() {
+    if (wakeup_socket != INVALID_SOCKET) {
+        closesocket(wakeup_socket);
+        wakeup_socket = INVALID_SOCKET;
+    }
+    poll_fds.clear();
+    poll_index.clear();
+}
+
+bool Poller::add(SOCKET fd, int events) {
+    WSAPOLLFD entry;
+    entry.fd = fd;
+    entry.events = 0;
+    entry.revents = 0;
+    poll_index[fd] = poll_fds.size();
+    poll_fds.push_back(entry);
+    return modify(fd, events);
+}
+
+bool Poller::modify(SOCKET fd, int events) {
+    auto it = poll_index.find(fd);
+    if (it == poll_index.end()) {
+        return false;
+    }
+    short mask = 0;
+    if (events & READABLE) mask |= POLLRDNORM;
+    if (events & WRITABLE) mask |= POLLWRNORM;
+    poll_fds[it->second].events = mask;
+    return true;
+}
+
+void Poller::remove(SOCKET fd) {
+    auto it = poll_index.find(fd);
+    if (it == poll_index.end()) {
+        return;
+    }
+    // Swap-remove to keep the array dense
+    size_t index = it->second;
+    poll_index.erase(it);
+    if (index != poll_fds.size() - 1) {
+        poll_fds[index] = poll_fds.back();
+        poll_index[poll_fds[index].fd] = index;
+    }
+    poll_fds.pop_back();
+}
+
+int Poller::wait(std::vector<Event>& ready, int timeout_ms) {
+    ready.clear();
+    int count = WSAPoll(poll_fds.data(), (ULONG)poll_fds.size(), timeout_ms);
+    if (count <= 0) {
+        return 0;
+    }
+    for (const auto& entry : poll_fds) {
+        if (entry.revents == 0) {
+            continue;
+        }
+        if (entry.fd == wakeup_socket) {
+            char drain[64];
+            while (recv(wakeup_socket, drain, sizeof(drain), 0) > 0) {
+            }
+            continue;
+        }
+        Event event;
+        event.fd = entry.fd;
+        event.events = 0;
+        if (entry.revents & POLLRDNORM) event.events |= READABLE;
+        if (entry.revents & POLLWRNORM) event.events |= WRITABLE;
+        if (entry.revents & (POLLERR | POLLHUP | POLLNVAL)) event.events |= CLOSED;
+        ready.push_back(event);
+    }
+    return (int)ready.size();
+}
+
+void Poller::wakeup() {
+    char byte = 1;
+    send(wakeup_socket, &byte, 1, 0);
+}
+
+#else
+// Linux implementation: level-triggered epoll plus an eventfd for wakeups.
+
+static uint32_t toEpollMask(int events) {
+    uint32_t mask = 0;
+    if (events & Poller::READABLE) mask |= EPOLLIN;
+    if (events & Poller::WRITABLE) mask |= EPOLLOUT;
+    return mask;
+}
+
+Poller::Poller() : epoll_fd(-1), wakeup_fd(-1) {
+}
+
+Poller::~Poller() {
+    close();
+}
+
+bool Poller::open() {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        return false;
+    }
+    wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeup_fd < 0) {
+        close();
+        return false;
+    }
+    return add(wakeup_fd, READABLE);
+}
+
+void Poller::close() {
+    if (wakeup_fd >= 0) {
+        ::close(wakeup_fd);
+        wakeup_fd = -1;
+    }
+    if (epoll_fd >= 0) {
+        ::close(epoll_fd);
+        epoll_fd = -1;
+    }
+}
+
+bool Poller::add(SOCKET fd, int events) {
+    struct epoll_event ev;
+    ev.events = toEpollMask(events);
+    ev.data.fd = fd;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0;
+}
+
+bool Poller::modify(SOCKET fd, int events) {
+    struct epoll_event ev;
+    ev.events = toEpollMask(events);
+    ev.data.fd = fd;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) == 0;
+}
+
+void Poller::remove(SOCKET fd) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+int Poller::wait(std::vector<Event>& ready, int timeout_ms) {
+    struct epoll_event events[256];
+    ready.clear();
+    int count = epoll_wait(epoll_fd, events, 256, timeout_ms);
+    for (int i = 0; i < count; i++) {
+        if (events[i].data.fd == wakeup_fd) {
+            uint64_t value;
+            while (read(wakeup_fd, &value, sizeof(value)) > 0) {
+            }
+            continue;
+        }
+        Event event;
+        event.fd = events[i].data.fd;
+        event.events = 0;
+        if (events[i].events & EPOLLIN) event.events |= READABLE;
+        if (events[i].events & EPOLLOUT) event.events |= WRITABLE;
+        if (events[i].events & (EPOLLERR | EPOLLHUP)) event.events |= CLOSED;
+        ready.push_back(event);
+    }
+    return (int)ready.size();
+}
+
+void Poller::wakeup() {
+    uint64_t value = 1;
+    ssize_t ignored = write(wakeup_fd, &value, sizeof(value));
+    (void)ignored;
+}
+#endif
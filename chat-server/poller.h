@@ -0,0 +1,48 @@
+#pragma once
+
+#include <vector>
+#include <map>
+#include "platform.h"
+
+// Readiness poller used by the server event loop.
+// Linux uses epoll, Windows falls back to WSAPoll.
+class Poller {
+public:
+    enum {
+        READABLE = 1,
+        WRITABLE = 2,
+        CLOSED = 4
+    };
+
+    struct Event {
+        SOCKET fd;
+        int events;
+    };
+
+    Poller();
+    ~Poller();
+
+    bool open();
+    void close();
+
+    bool add(SOCKET fd, int events);
+    bool modify(SOCKET fd, int events);
+    void remove(SOCKET fd);
+
+    // Waits up to timeout_ms (-1 = forever) and fills ready events.
+    // Wakeups requested through wakeup() are consumed internally.
+    int wait(std::vector<Event>& ready, int timeout_ms);
+
+    // Interrupts a wait() running on another thread.
+    void wakeup();
+
+private:
+#ifdef _WIN32
+    std::vector<WSAPOLLFD> poll_fds;
+    std::map<SOCKET, size_t> poll_index;
+    SOCKET wakeup_socket;
+#else
+    int epoll_fd;
+    int wakeup_fd;
+#endif
+};
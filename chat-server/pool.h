@@ -0,0 +1,237 @@
+#pragma once
+
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <memory>
+#include <utility>
+#include <vector>
+
+// Memory for per-connection state. With many mostly idle
+// connections, what each one holds while doing nothing decides the
+// footprint, and recycling fixed sizes keeps it stable over long uptimes.
+
+// Fixed-size blocks for connection read buffers. Released blocks are
+// cached by the releasing thread and handed out again by it.
+class BlockPool {
+public:
+    static const size_t BLOCK_SIZE = 4096;
+
+    static char* acquire() {
+        std::vector<char*>& blocks = cache().blocks;
+        if (blocks.empty()) {
+            return new char[BLOCK_SIZE];
+        }
+        char* block = blocks.back();
+        blocks.pop_back();
+        return block;
+    }
+
+    static void release(char* block) {
+        std::vector<char*>& blocks = cache().blocks;
+        if (blocks.size() >= MAX_CACHED) {
+            delete[] block;
+            return;
+        }
+        blocks.push_back(block);
+    }
+
+private:
+    // Enough for every connection of a shard that is mid-message
+    static const size_t MAX_CACHED = 256;
+
+    struct Cache {
+        std::vector<char*> blocks;
+
+        ~Cache() {
+            for (char* block : blocks) {
+                delete[] block;
+            }
+        }
+    };
+
+    static Cache& cache() {
+        thread_local Cache local;
+        return local;
+    }
+};
+
+// Objects of one size carved out of large slabs and recycled through a
+// free list. Slabs are kept for reuse, so the heap is not fragmented by
+// connections coming and going. Any thread may allocate and free.
+class SlabPool {
+private:
+    static const size_t SLOTS_PER_SLAB = 256;
+
+    struct FreeSlot {
+        FreeSlot* next;
+    };
+
+    size_t slot_size;
+    std::mutex mutex;
+    FreeSlot* free_slots;
+    std::vector<char*> slabs;
+
+public:
+    explicit SlabPool(size_t object_size)
+        : slot_size((object_size + alignof(std::max_align_t) - 1) / alignof(std::max_align_t) *
+                    alignof(std::max_align_t)),
+          free_slots(nullptr) {}
+
+    ~SlabPool() {
+        for (char* slab : slabs) {
+            delete[] slab;
+        }
+    }
+
+    SlabPool(const SlabPool&) = delete;
+    SlabPool& operator=(const SlabPool&) = delete;
+
+    void* allocate() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!free_slots) {
+            char* slab = new char[slot_size * SLOTS_PER_SLAB];
+            slabs.push_back(slab);
+            for (size_t i = SLOTS_PER_SLAB; i-- > 0;) {
+                FreeSlot* slot = (FreeSlot*)(slab + i * slot_size);
+                slot->next = free_slots;
+                free_slots = slot;
+            }
+        }
+        FreeSlot* slot = free_slots;
+        free_slots = slot->next;
+        return slot;
+    }
+
+    void deallocate(void* object) {
+        std::lock_guard<std::mutex> lock(mutex);
+        FreeSlot* slot = (FreeSlot*)object;
+        slot->next = free_slots;
+        free_slots = slot;
+    }
+};
+
+// Standard allocator over a SlabPool per type, for std::allocate_shared
+// (which rebinds it to its combined control block and object)
+template <typename T>
+class SlabAllocator {
+public:
+    typedef T value_type;
+
+    SlabAllocator() {}
+    template <typename U>
+    SlabAllocator(const SlabAllocator<U>&) {}
+
+    T* allocate(size_t count) {
+        if (count != 1) {
+            return static_cast<T*>(::operator new(count * sizeof(T)));
+        }
+        return static_cast<T*>(pool().allocate());
+    }
+
+    void deallocate(T* object, size_t count) {
+        if (count != 1) {
+            ::operator delete(object);
+            return;
+        }
+        pool().deallocate(object);
+    }
+
+    template <typename U>
+    bool operator==(const SlabAllocator<U>&) const { return true; }
+    template <typename U>
+    bool operator!=(const SlabAllocator<U>&) const { return false; }
+
+private:
+    static_assert(alignof(T) <= alignof(std::max_align_t), "over-aligned types need their own pool");
+
+    static SlabPool& pool() {
+        static SlabPool slabs(sizeof(T) > sizeof(void*) ? sizeof(T) : sizeof(void*));
+        return slabs;
+    }
+};
+
+// FIFO for per-connection queues: a ring that is allocated on the first
+// push, doubles when full and shrinks back to a few slots once drained,
+// so an idle connection holds almost nothing
+template <typename T>
+class RingQueue {
+private:
+    static const size_t SMALL_CAPACITY = 4;
+
+    std::unique_ptr<T[]> slots;
+    size_t capacity; // a power of two
+    size_t head;
+    size_t count;
+
+    T& slot(size_t index) { return slots[(head + index) & (capacity - 1)]; }
+    const T& slot(size_t index) const { return slots[(head + index) & (capacity - 1)]; }
+
+    void resize(size_t new_capacity) {
+        std::unique_ptr<T[]> grown(new T[new_capacity]);
+        for (size_t i = 0; i < count; i++) {
+            grown[i] = std::move(slot(i));
+        }
+        slots = std::move(grown);
+        capacity = new_capacity;
+        head = 0;
+    }
+
+    void drained() {
+        head = 0;
+        if (capacity > SMALL_CAPACITY) {
+            slots.reset(new T[SMALL_CAPACITY]);
+            capacity = SMALL_CAPACITY;
+        }
+    }
+
+public:
+    RingQueue() : capacity(0), head(0), count(0) {}
+
+    bool empty() const { return count == 0; }
+    size_t size() const { return count; }
+
+    T& front() { return slot(0); }
+    const T& front() const { return slot(0); }
+    T& back() { return slot(count - 1); }
+    T& operator[](size_t index) { return slot(index); }
+    const T& operator[](size_t index) const { return slot(index); }
+
+    void push_back(T item) {
+        if (count == capacity) {
+            resize(capacity == 0 ? SMALL_CAPACITY : capacity * 2);
+        }
+        slot(count++) = std::move(item);
+    }
+
+    void pop_front() {
+        slot(0) = T();
+        head = (head + 1) & (capacity - 1);
+        if (--count == 0) {
+            drained();
+        }
+    }
+
+    void pop_back() {
+        slot(--count) = T();
+        if (count == 0) {
+            drained();
+        }
+    }
+
+    // Removes one element, moving whichever side of it is shorter, so
+    // dropping near the front stays cheap however long the queue is
+    void erase(size_t index) {
+        if (index < count / 2) {
+            for (size_t i = index; i > 0; i--) {
+                slot(i) = std::move(slot(i - 1));
+            }
+            pop_front();
+            return;
+        }
+        for (size_t i = index; i + 1 < count; i++) {
+            slot(i) = std::move(slot(i + 1));
+        }
+        pop_back();
+    }
+};
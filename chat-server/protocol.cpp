@@ -0,0 +1,209 @@
+#include "protocol.h"
+#include <cstring>
+#include <algorithm>
+
+void writeFrameHeader(char* out, uint8_t type, uint32_t length) {
+    out[0] = (char)((length >> 24) & 0xff);
+    out[1] = (char)((length >> 16) & 0xff);
+    out[2] = (char)((length >> 8) & 0xff);
+    out[3] = (char)(length & 0xff);
+    out[4] = (char)type;
+}
+
+std::string encodeFrame(uint8_t type, std::string_view payload) {
+    std::string frame(FRAME_HEADER_SIZE + payload.size(), '\0');
+    writeFrameHeader(&frame[0], type, (uint32_t)payload.size());
+    memcpy(&frame[FRAME_HEADER_SIZE], payload.data(), payload.size());
+    return frame;
+}
+
+void putVarint(std::string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out += (char)((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    out += (char)value;
+}
+
+void putString(std::string& out, std::string_view text) {
+    putVarint(out, text.size());
+    out.append(text.data(), text.size());
+}
+
+bool getVarint(std::string_view& in, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 64 && !in.empty(); shift += 7) {
+        unsigned char byte = (unsigned char)in[0];
+        in.remove_prefix(1);
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool getString(std::string_view& in, std::string_view& out) {
+    uint64_t length;
+    if (!getVarint(in, length) || length > in.size()) {
+        return false;
+    }
+    out = in.substr(0, length);
+    in.remove_prefix(length);
+    return true;
+}
+
+bool parseRecord(std::string_view payload, RecordView& record) {
+    if (payload.size() < 4) {
+        return false;
+    }
+    payload.remove_prefix(4); // checksum
+    uint64_t time_ms;
+    if (!getVarint(payload, record.seq) || !getVarint(payload, time_ms) ||
+        !getString(payload, record.room) || !getString(payload, record.sender)) {
+        return false;
+    }
+    record.time_ms = (int64_t)time_ms;
+    record.content = payload;
+    return true;
+}
+
+// InputBuffer implementation
+InputBuffer::InputBuffer() : data(nullptr), capacity(0), read_pos(0), write_pos(0) {
+}
+
+InputBuffer::~InputBuffer() {
+    freeData();
+}
+
+InputBuffer::InputBuffer(InputBuffer&& other)
+    : data(other.data), capacity(other.capacity), read_pos(other.read_pos), write_pos(other.write_pos) {
+    other.data = nullptr;
+    other.capacity = 0;
+    other.read_pos = other.write_pos = 0;
+}
+
+InputBuffer& InputBuffer::operator=(InputBuffer&& other) {
+    if (this != &other) {
+        freeData();
+        data = other.data;
+        capacity = other.capacity;
+        read_pos = other.read_pos;
+        write_pos = other.write_pos;
+        other.data = nullptr;
+        other.capacity = 0;
+        other.read_pos = other.write_pos = 0;
+    }
+    return *this;
+}
+
+void InputBuffer::freeData() {
+    if (capacity == BlockPool::BLOCK_SIZE) {
+        BlockPool::release(data);
+    } else {
+        delete[] data;
+    }
+    data = nullptr;
+    capacity = 0;
+}
+
+char* InputBuffer::reserve(size_t min_space) {
+    // Move the unparsed tail to the front before growing
+    if (read_pos > 0) {
+        if (read_pos < write_pos) {
+            memmove(data, data + read_pos, write_pos - read_pos);
+        }
+        write_pos -= read_pos;
+        read_pos = 0;
+    }
+    if (capacity - write_pos < min_space) {
+        size_t needed = write_pos + min_space;
+        char* grown;
+        size_t grown_capacity;
+        if (needed <= BlockPool::BLOCK_SIZE) {
+            grown = BlockPool::acquire();
+            grown_capacity = BlockPool::BLOCK_SIZE;
+        } else {
+            // Only a large frame needs more; grow geometrically
+            grown_capacity = std::max(needed, capacity * 2);
+            grown = new char[grown_capacity];
+        }
+        if (write_pos > 0) {
+            memcpy(grown, data, write_pos);
+        }
+        freeData();
+        data = grown;
+        capacity = grown_capacity;
+    }
+    return data + write_pos;
+}
+
+void InputBuffer::commit(size_t length) {
+    write_pos += length;
+}
+
+bool InputBuffer::empty() const {
+    return read_pos == write_pos;
+}
+
+std::string_view InputBuffer::unparsed() const {
+    return read_pos == write_pos ? std::string_view() : std::string_view(data + read_pos, write_pos - read_pos);
+}
+
+size_t InputBuffer::mark() const {
+    return read_pos;
+}
+
+void InputBuffer::rewind(size_t position) {
+    read_pos = position;
+}
+
+uint8_t InputBuffer::peek() const {
+    return (uint8_t)data[read_pos];
+}
+
+InputBuffer::Result InputBuffer::nextLine(std::string_view& line) {
+    const char* begin = data + read_pos;
+    size_t available = write_pos - read_pos;
+    const char* newline = (const char*)memchr(begin, '\n', available);
+    if (newline == NULL) {
+        return available > MAX_PAYLOAD_SIZE ? INVALID : NEED_MORE;
+    }
+
+    size_t length = newline - begin;
+    read_pos += length + 1;
+    if (length > 0 && begin[length - 1] == '\r') {
+        length--;
+    }
+    line = std::string_view(begin, length);
+    return COMPLETE;
+}
+
+InputBuffer::Result InputBuffer::nextFrame(uint8_t& type, std::string_view& payload) {
+    size_t available = write_pos - read_pos;
+    if (available < FRAME_HEADER_SIZE) {
+        return NEED_MORE;
+    }
+
+    const unsigned char* header = (const unsigned char*)data + read_pos;
+    uint32_t length = ((uint32_t)header[0] << 24) | ((uint32_t)header[1] << 16) |
+                      ((uint32_t)header[2] << 8) | (uint32_t)header[3];
+    if (length > MAX_PAYLOAD_SIZE) {
+        return INVALID;
+    }
+    if (available < FRAME_HEADER_SIZE + length) {
+        return NEED_MORE;
+    }
+
+    type = header[4];
+    payload = std::string_view(data + read_pos + FRAME_HEADER_SIZE, length);
+    read_pos += FRAME_HEADER_SIZE + length;
+    return COMPLETE;
+}
+
+void InputBuffer::release() {
+    if (read_pos == write_pos) {
+        freeData();
+        read_pos = write_pos = 0;
+    }
+}
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include "pool.h"
+
+// Wire protocol
+//
+// Every connection starts with the plain text PROMPT from the server.
+// A client that answers with a byte of 0 speaks the framed protocol,
+// anything else is treated as newline-delimited text (telnet, client.cpp).
+//
+// Frame layout: [u32 payload length, big endian][u8 type][payload]
+// A framed client opens with HELLO carrying its protocol version and the
+// server answers with HELLO carrying the version it will speak. It may
+// then send RESUME with the last sequence id it saw in a room before
+// sending its username, and only newer history of that room is replayed.
+//
+// Version 2 delivered chat messages as RECORD frames (with sequence ids)
+// instead of version 1 MESSAGE frames, version 3 added the room name to
+// RECORD frames and version 4 the time as milliseconds since the epoch.
+// Broadcasts are encoded once for every framed client, so the server only
+// speaks version 4 and newer and refuses older clients with a NOTICE.
+// Version 5 lets HELLO carry a flags byte after the version, see
+// HelloFlags.
+//
+// With HELLO_DEFLATE granted, everything the server sends after its HELLO
+// is one zlib stream (compression.h); frames are parsed from the
+// decompressed bytes. The server ends a block whenever it flushes, so a
+// client can always decode what has arrived. A stream may end (hot
+// restart) and a new one start right after it. What the client sends
+// stays uncompressed.
+
+const uint8_t PROTOCOL_VERSION = 5;
+const uint8_t MIN_PROTOCOL_VERSION = 4;
+const char* const PROMPT = "Enter your username: ";
+
+enum FrameType : uint8_t {
+    FRAME_HELLO = 1,   // payload: u8 protocol version, since version 5
+                       // optionally u8 HelloFlags (the client's asks, the
+                       // server's answer grants)
+    FRAME_TEXT = 2,    // client -> server: username, chat line or command
+    // 3 was MESSAGE (version 1), not sent anymore
+    FRAME_NOTICE = 4,  // server -> client: prompts, help and errors
+    FRAME_RECORD = 5,  // server -> client: chat message, see message_log.h;
+                       // room "@user" and sequence id 0 mark a direct message
+    FRAME_RESUME = 6   // client -> server: u64 last seen sequence id, big endian,
+                       // then the room name (none = the default room)
+};
+
+enum HelloFlags : uint8_t {
+    HELLO_DEFLATE = 1 // compress server -> client traffic
+};
+
+const size_t FRAME_HEADER_SIZE = 5;
+const size_t MAX_PAYLOAD_SIZE = 64 * 1024;
+
+void writeFrameHeader(char* out, uint8_t type, uint32_t length);
+std::string encodeFrame(uint8_t type, std::string_view payload);
+
+// LEB128 integers and length-prefixed strings used inside payloads; the
+// getters consume what they parsed
+void putVarint(std::string& out, uint64_t value);
+void putString(std::string& out, std::string_view text);
+bool getVarint(std::string_view& in, uint64_t& value);
+bool getString(std::string_view& in, std::string_view& out);
+
+// Fields of a RECORD payload (layout in message_log.h), pointing into it.
+// The checksum is not verified here, see decodeRecord().
+struct RecordView {
+    uint64_t seq;
+    int64_t time_ms;
+    std::string_view room;
+    std::string_view sender;
+    std::string_view content;
+};
+
+bool parseRecord(std::string_view payload, RecordView& record);
+
+// Per-connection receive buffer with an incremental parser.
+// Data is received straight into the buffer and parsed in place; returned
+// views stay valid until the next call to reserve() or release().
+// Memory is a BlockPool block taken on demand (or a larger heap block for
+// a big frame), so an idle connection holds none.
+class InputBuffer {
+public:
+    enum Result {
+        NEED_MORE,
+        COMPLETE,
+        INVALID
+    };
+
+    InputBuffer();
+    ~InputBuffer();
+    InputBuffer(InputBuffer&& other);
+    InputBuffer& operator=(InputBuffer&& other);
+    InputBuffer(const InputBuffer&) = delete;
+    InputBuffer& operator=(const InputBuffer&) = delete;
+
+    // Space for at least min_space more bytes, then commit what was read
+    char* reserve(size_t min_space);
+    void commit(size_t length);
+
+    bool empty() const;
+    uint8_t peek() const;
+    // Received bytes not parsed yet
+    std::string_view unparsed() const;
+    // Parse position; rewind() hands back what was parsed after it
+    size_t mark() const;
+    void rewind(size_t position);
+
+    // Next newline-terminated line without the "\r\n"
+    Result nextLine(std::string_view& line);
+    // Next complete frame
+    Result nextFrame(uint8_t& type, std::string_view& payload);
+
+    // Hands the memory back once everything received was parsed
+    void release();
+
+private:
+    char* data;
+    size_t capacity;
+    size_t read_pos;
+    size_t write_pos;
+
+    void freeData();
+};
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <chrono>
+#include <algorithm>
+#include <cstddef>
+
+// Token bucket refilled at rate tokens per second and holding at most one
+// second's worth. A cost above that passes once the bucket is full and
+// leaves it in debt, so oversized messages are slowed, not refused
+// forever. Not thread-safe.
+class TokenBucket {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+private:
+    double rate; // 0 = unlimited
+    double tokens;
+    Clock::time_point updated;
+
+    void refill(Clock::time_point now) {
+        double elapsed = std::chrono::duration<double>(now - updated).count();
+        if (elapsed > 0) {
+            tokens = std::min(rate, tokens + elapsed * rate);
+            updated = now;
+        }
+    }
+
+public:
+    TokenBucket() : rate(0), tokens(0) {}
+
+    void configure(double per_second) {
+        rate = per_second;
+        tokens = per_second;
+        updated = Clock::now();
+    }
+
+    // How long until cost can be taken, zero if it can be now
+    Clock::duration wait(double cost, Clock::time_point now) {
+        if (rate <= 0) {
+            return Clock::duration::zero();
+        }
+        refill(now);
+        double missing = std::min(cost, rate) - tokens;
+        if (missing <= 0) {
+            return Clock::duration::zero();
+        }
+        return std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(missing / rate)) +
+               Clock::duration(1);
+    }
+
+    void take(double cost) {
+        if (rate > 0) {
+            tokens -= cost;
+        }
+    }
+};
+
+// Budget for messages and for their bytes, checked together
+struct RateLimit {
+    TokenBucket messages;
+    TokenBucket bytes;
+
+    void configure(double messages_per_second, double bytes_per_second) {
+        messages.configure(messages_per_second);
+        bytes.configure(bytes_per_second);
+    }
+
+    TokenBucket::Clock::duration wait(size_t length, TokenBucket::Clock::time_point now) {
+        return std::max(messages.wait(1, now), bytes.wait((double)length, now));
+    }
+
+    void take(size_t length) {
+        messages.take(1);
+        bytes.take((double)length);
+    }
+};
@@ -0,0 +1,86 @@
+#include "rcu.h"
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <deque>
+#include <cstdint>
+
+// Epoch a thread's current read section started in, 0 outside of one
+struct alignas(64) RcuReader {
+    std::atomic<uint64_t> epoch;
+    unsigned depth;
+
+    RcuReader() : epoch(0), depth(0) {}
+};
+
+struct RetiredData {
+    uint64_t epoch; // the global epoch when it was retired
+    std::function<void()> free;
+};
+
+// Starts at 1 so that 0 can mean "not reading"
+static std::atomic<uint64_t> global_epoch(1);
+
+// Guards the reader registry and the retired list; readers only take it
+// once per thread, to register
+static std::mutex rcu_mutex;
+
+static std::vector<std::unique_ptr<RcuReader>>& readers() {
+    static std::vector<std::unique_ptr<RcuReader>> threads;
+    return threads;
+}
+
+static std::deque<RetiredData>& retired() {
+    static std::deque<RetiredData> pending;
+    return pending;
+}
+
+static RcuReader& threadReader() {
+    thread_local RcuReader* local = nullptr;
+    if (!local) {
+        std::lock_guard<std::mutex> lock(rcu_mutex);
+        readers().push_back(std::unique_ptr<RcuReader>(new RcuReader()));
+        local = readers().back().get();
+    }
+    return *local;
+}
+
+RcuReadGuard::RcuReadGuard() : reader(threadReader()) {
+    if (reader.depth++ == 0) {
+        // Announced before any RcuPointer is loaded (both seq_cst), so a
+        // writer that swapped a pointer this section reads sees the epoch
+        reader.epoch.store(global_epoch.load(std::memory_order_seq_cst), std::memory_order_seq_cst);
+    }
+}
+
+RcuReadGuard::~RcuReadGuard() {
+    if (--reader.depth == 0) {
+        reader.epoch.store(0, std::memory_order_release);
+    }
+}
+
+void rcuRetire(std::function<void()> free) {
+    std::vector<std::function<void()>> ready;
+    {
+        std::lock_guard<std::mutex> lock(rcu_mutex);
+        // Sections starting from here on see the new version
+        retired().push_back(RetiredData{global_epoch.fetch_add(1, std::memory_order_seq_cst), std::move(free)});
+
+        uint64_t oldest = UINT64_MAX;
+        for (const auto& reader : readers()) {
+            uint64_t epoch = reader->epoch.load(std::memory_order_seq_cst);
+            if (epoch != 0 && epoch < oldest) {
+                oldest = epoch;
+            }
+        }
+        // A reader that entered at or before the retiring epoch may still
+        // hold the data; anything older than every running section is free
+        while (!retired().empty() && retired().front().epoch < oldest) {
+            ready.push_back(std::move(retired().front().free));
+            retired().pop_front();
+        }
+    }
+    for (auto& release : ready) {
+        release();
+    }
+}
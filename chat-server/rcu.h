@@ -0,0 +1,57 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+
+// Read-copy-update for data that is read on every message but rarely
+// changes. Readers load an RcuPointer inside an RcuReadGuard, without
+// locks or reference counts; writers publish a new immutable version and
+// the old one is freed once every reader section that could still see it
+// has ended (epoch-based reclamation).
+
+struct RcuReader;
+
+// Read-side section of the calling thread; may nest
+class RcuReadGuard {
+private:
+    RcuReader& reader;
+
+public:
+    RcuReadGuard();
+    ~RcuReadGuard();
+
+    RcuReadGuard(const RcuReadGuard&) = delete;
+    RcuReadGuard& operator=(const RcuReadGuard&) = delete;
+};
+
+// Runs free() once no reader section that began before this call is
+// still running. Unpublished data only; the call may free older retired
+// data on the calling thread.
+void rcuRetire(std::function<void()> free);
+
+template <typename T>
+class RcuPointer {
+private:
+    std::atomic<const T*> current;
+
+public:
+    explicit RcuPointer(const T* initial) : current(initial) {}
+
+    ~RcuPointer() {
+        delete current.load(std::memory_order_relaxed); // No readers are left
+    }
+
+    RcuPointer(const RcuPointer&) = delete;
+    RcuPointer& operator=(const RcuPointer&) = delete;
+
+    // Only inside an RcuReadGuard; the version stays valid until it ends
+    const T& get() const {
+        return *current.load(std::memory_order_seq_cst);
+    }
+
+    // Writers have to be serialized by the caller
+    void publish(const T* next) {
+        const T* old = current.exchange(next, std::memory_order_seq_cst);
+        rcuRetire([old]() { delete old; });
+    }
+};
@@ -0,0 +1,210 @@
+#include "search_index.h"
+#include "protocol.h"
+#include <algorithm>
+#include <cctype>
+
+// Calls visit(term) for every word of text, duplicates included
+template <typename Visitor>
+static void forEachWord(std::string_view text, Visitor visit) {
+    std::string word;
+    for (size_t i = 0; i <= text.size(); i++) {
+        unsigned char c = i < text.size() ? (unsigned char)text[i] : ' ';
+        if (isalnum(c) || c >= 0x80) {
+            if (word.size() < SearchIndex::MAX_TERM_LENGTH) {
+                word += (char)tolower(c);
+            }
+        } else if (!word.empty()) {
+            visit(word);
+            word.clear();
+        }
+    }
+}
+
+// Senders are terms no word can be equal to
+static std::string senderTerm(std::string_view sender) {
+    return "from:" + std::string(sender);
+}
+
+static void decodeBlock(const SearchIndex::Block& block, std::vector<uint64_t>& out) {
+    out.clear();
+    out.push_back(block.first_seq);
+    std::string_view gaps(block.gaps);
+    uint64_t gap;
+    while (getVarint(gaps, gap)) {
+        out.push_back(out.back() + gap);
+    }
+}
+
+// SearchIndex implementation
+SearchIndex::SearchIndex() : first_seq(0) {
+}
+
+void SearchIndex::add(uint64_t seq, std::string_view sender, std::string_view text) {
+    forEachWord(text, [&](const std::string& word) { addPosting(word, seq); });
+    addPosting(senderTerm(sender), seq);
+}
+
+void SearchIndex::remove(uint64_t seq, std::string_view sender, std::string_view text) {
+    first_seq = seq + 1;
+    forEachWord(text, [&](const std::string& word) { dropPostings(word, seq); });
+    dropPostings(senderTerm(sender), seq);
+}
+
+void SearchIndex::addPosting(const std::string& term, uint64_t seq) {
+    PostingList& list = terms[term];
+    Block& open = list.open;
+    if (open.count > 0) {
+        if (seq <= open.last_seq) {
+            return; // The word repeats in this message
+        }
+        if (open.count < BLOCK_POSTINGS) {
+            putVarint(open.gaps, seq - open.last_seq);
+            open.last_seq = seq;
+            open.count++;
+            list.total++;
+            return;
+        }
+        list.sealed.push_back(std::make_shared<const Block>(std::move(open)));
+        open.gaps = std::string();
+    } else if (!list.sealed.empty() && seq <= list.sealed.back()->last_seq) {
+        return;
+    }
+    open.first_seq = seq;
+    open.last_seq = seq;
+    open.count = 1;
+    list.total++;
+}
+
+void SearchIndex::dropPostings(const std::string& term, uint64_t seq) {
+    auto it = terms.find(term);
+    if (it == terms.end()) {
+        return;
+    }
+    // Only whole blocks are dropped; searches skip the older ids left in
+    // the first one
+    PostingList& list = it->second;
+    while (!list.sealed.empty() && list.sealed.front()->last_seq <= seq) {
+        list.total -= list.sealed.front()->count;
+        list.sealed.pop_front();
+    }
+    if (list.sealed.empty() && list.open.count > 0 && list.open.last_seq <= seq) {
+        terms.erase(it);
+    }
+}
+
+SearchIndex::Snapshot SearchIndex::snapshot(const std::vector<std::string>& words,
+                                            const std::string& sender) const {
+    std::vector<std::string> query = words;
+    if (!sender.empty()) {
+        query.push_back(senderTerm(sender));
+    }
+
+    Snapshot result;
+    result.first_seq = first_seq;
+    for (const auto& term : query) {
+        auto it = terms.find(term);
+        if (it == terms.end()) {
+            result.empty_result = true;
+            result.lists.clear();
+            return result;
+        }
+        const PostingList& list = it->second;
+        std::vector<BlockRef> blocks(list.sealed.begin(), list.sealed.end());
+        if (list.open.count > 0) {
+            blocks.push_back(std::make_shared<const Block>(list.open)); // Still growing
+        }
+        result.lists.push_back(std::move(blocks));
+    }
+    result.empty_result = result.lists.empty();
+    return result;
+}
+
+size_t SearchIndex::termCount() const {
+    return terms.size();
+}
+
+bool SearchIndex::parseQuery(std::string_view query, std::vector<std::string>& words, std::string& sender) {
+    words.clear();
+    sender.clear();
+    while (!query.empty()) {
+        size_t space = query.find(' ');
+        std::string_view token = query.substr(0, space);
+        query = space == std::string_view::npos ? std::string_view() : query.substr(space + 1);
+        if (token.compare(0, 5, "from:") == 0 && token.size() > 5) {
+            sender = std::string(token.substr(5));
+            continue;
+        }
+        forEachWord(token, [&](const std::string& word) {
+            if (words.size() < MAX_QUERY_TERMS &&
+                std::find(words.begin(), words.end(), word) == words.end()) {
+                words.push_back(word);
+            }
+        });
+    }
+    return !words.empty() || !sender.empty();
+}
+
+// SearchIndex::Snapshot implementation
+SearchIndex::Snapshot::Snapshot() : first_seq(0), empty_result(true) {
+}
+
+std::vector<uint64_t> SearchIndex::Snapshot::match(size_t limit) const {
+    std::vector<uint64_t> found;
+    if (empty_result || limit == 0) {
+        return found;
+    }
+
+    // Walk the shortest list from the newest id and look every candidate
+    // up in the others: binary search over their blocks, then inside the
+    // decoded block. Candidates descend, so a decoded block is reused
+    // until the walk passes it.
+    size_t driver = 0;
+    std::vector<size_t> sizes(lists.size(), 0);
+    for (size_t i = 0; i < lists.size(); i++) {
+        for (const auto& block : lists[i]) {
+            sizes[i] += block->count;
+        }
+        if (sizes[i] < sizes[driver]) {
+            driver = i;
+        }
+    }
+    std::vector<size_t> cached(lists.size(), SIZE_MAX);
+    std::vector<std::vector<uint64_t>> decoded(lists.size());
+
+    auto contains = [&](size_t list, uint64_t seq) {
+        const std::vector<BlockRef>& blocks = lists[list];
+        auto it = std::lower_bound(blocks.begin(), blocks.end(), seq,
+                                   [](const BlockRef& block, uint64_t id) { return block->last_seq < id; });
+        if (it == blocks.end() || (*it)->first_seq > seq) {
+            return false;
+        }
+        size_t index = it - blocks.begin();
+        if (cached[list] != index) {
+            decodeBlock(**it, decoded[list]);
+            cached[list] = index;
+        }
+        return std::binary_search(decoded[list].begin(), decoded[list].end(), seq);
+    };
+
+    std::vector<uint64_t> ids;
+    const std::vector<BlockRef>& blocks = lists[driver];
+    for (size_t b = blocks.size(); b-- > 0 && found.size() < limit;) {
+        decodeBlock(*blocks[b], ids);
+        for (size_t i = ids.size(); i-- > 0;) {
+            if (ids[i] < first_seq) {
+                return found; // Left the history window
+            }
+            bool everywhere = true;
+            for (size_t list = 0; list < lists.size() && everywhere; list++) {
+                everywhere = list == driver || contains(list, ids[i]);
+            }
+            if (everywhere) {
+                found.push_back(ids[i]);
+                if (found.size() == limit) {
+                    break;
+                }
+            }
+        }
+    }
+    return found;
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <unordered_map>
+#include <cstdint>
+
+// Inverted index over one room's history window. Words are runs of
+// letters and digits (bytes from 0x80 up count as letters, so UTF-8 words
+// stay whole), lowercased and cut at MAX_TERM_LENGTH; every sender is a
+// term of its own. Each term maps to the sequence ids of the messages
+// holding it, ascending and delta-encoded as varints in blocks of up to
+// BLOCK_POSTINGS ids. Full blocks are immutable and shared with searches,
+// so a search copies a few pointers under the room's lock and runs
+// without it.
+class SearchIndex {
+public:
+    static constexpr size_t MAX_TERM_LENGTH = 32;
+    static constexpr size_t MAX_QUERY_TERMS = 8;
+
+    struct Block {
+        uint64_t first_seq;
+        uint64_t last_seq;
+        uint32_t count;
+        std::string gaps; // varint differences after first_seq
+    };
+    typedef std::shared_ptr<const Block> BlockRef;
+
+    // The postings of the query terms at one point in time
+    class Snapshot {
+    private:
+        std::vector<std::vector<BlockRef>> lists; // one per term
+        uint64_t first_seq;                       // oldest indexed message
+        bool empty_result;                        // a term has no postings
+
+        friend class SearchIndex;
+
+    public:
+        Snapshot();
+
+        // Sequence ids of messages holding every term, newest first
+        std::vector<uint64_t> match(size_t limit) const;
+    };
+
+private:
+    static constexpr uint32_t BLOCK_POSTINGS = 128;
+
+    struct PostingList {
+        std::deque<BlockRef> sealed;
+        Block open; // count 0 when empty
+        size_t total;
+    };
+
+    std::unordered_map<std::string, PostingList> terms;
+    uint64_t first_seq;
+
+    void addPosting(const std::string& term, uint64_t seq);
+    void dropPostings(const std::string& term, uint64_t seq);
+
+public:
+    SearchIndex();
+
+    // Messages come in ascending sequence order and leave oldest first,
+    // with the same sender and text
+    void add(uint64_t seq, std::string_view sender, std::string_view text);
+    void remove(uint64_t seq, std::string_view sender, std::string_view text);
+
+    // Terms must come from parseQuery; sender may be empty
+    Snapshot snapshot(const std::vector<std::string>& words, const std::string& sender) const;
+    size_t termCount() const;
+
+    // Splits "<words> [from:user]"; false if there is nothing to search for
+    static bool parseQuery(std::string_view query, std::vector<std::string>& words, std::string& sender);
+};
@@ -1,97 +1,177 @@
 #include "server.h"
+#include "cluster.h"
 #include <ctime>
-#include <iomanip>
+#include <chrono>
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <cstdio>
+
+// Name interning
+Name intern(std::string_view text) {
+    static std::mutex names_mutex;
+    static std::map<std::string, std::weak_ptr<const std::string>, std::less<>> names;
+    static size_t inserts = 0;
+
+    std::lock_guard<std::mutex> lock(names_mutex);
+    auto it = names.find(text);
+    if (it != names.end()) {
+        if (Name name = it->second.lock()) {
+            return name;
+        }
+    }
+
+    // Drop names nobody uses any more now and then
+    if (++inserts % 1024 == 0) {
+        for (auto entry = names.begin(); entry != names.end();) {
+            entry = entry->second.expired() ? names.erase(entry) : std::next(entry);
+        }
+    }
+    Name name = std::make_shared<const std::string>(text);
+    names[std::string(text)] = name;
+    return name;
+}
+
+// PayloadArena implementation
+PayloadArena::PayloadArena() : used(0) {
+}
+
+PayloadArena& PayloadArena::local() {
+    thread_local PayloadArena arena;
+    return arena;
+}
+
+bool PayloadArena::nextChunk() {
+    // Reuse a chunk no message refers to any more (like ChatRoom's spare segment)
+    for (size_t i = 0; i + 1 < chunks.size(); i++) {
+        if (chunks[i].use_count() == 1) {
+            std::atomic_thread_fence(std::memory_order_acquire);
+            std::rotate(chunks.begin() + i, chunks.begin() + i + 1, chunks.end());
+            used = 0;
+            return true;
+        }
+    }
+    if (chunks.size() == MAX_CHUNKS) {
+        // Still in use; its last message frees it
+        chunks.erase(chunks.begin());
+    }
+    chunks.push_back(std::make_shared<std::vector<char>>(CHUNK_SIZE));
+    used = 0;
+    return true;
+}
+
+Payload PayloadArena::copy(std::string_view text) {
+    if (text.size() > CHUNK_SIZE / 8) {
+        auto owned = std::make_shared<const std::string>(text);
+        return Payload(owned, owned->data(), owned->size());
+    }
+    if (chunks.empty() || CHUNK_SIZE - used < text.size()) {
+        nextChunk();
+    }
+    const std::shared_ptr<std::vector<char>>& chunk = chunks.back();
+    char* data = chunk->data() + used;
+    memcpy(data, text.data(), text.size());
+    used += text.size();
+    return Payload(chunk, data, text.size());
+}
+
+// "HH:MM:SS" for a time, formatted at most once per second and thread
+static const char* clockText(int64_t time_ms) {
+    thread_local int64_t cached_second = -1;
+    thread_local char text[16] = "00:00:00";
+
+    int64_t second = time_ms / 1000;
+    if (second != cached_second) {
+        std::tm timeinfo;
+        localTime((time_t)second, &timeinfo);
+        snprintf(text, sizeof(text), "%02d:%02d:%02d", timeinfo.tm_hour, timeinfo.tm_min, timeinfo.tm_sec);
+        cached_second = second;
+    }
+    return text;
+}
 
 // Message implementation
-Message::Message(const std::string& from, const std::string& text) 
-    : sender(from), content(text) {
-    // Set timestamp
-    auto now = std::chrono::system_clock::now();
-    auto time = std::chrono::system_clock::to_time_t(now);
-    std::tm timeinfo;
-    localtime_s(&timeinfo, &time);
-    std::stringstream ss;
-    ss << std::put_time(&timeinfo, "%H:%M:%S");
-    timestamp = ss.str();
+Message::Message() : seq(0), time_ms(0) {
+}
+
+Message::Message(const Name& from, std::string_view text)
+    : seq(0), sender(from), content(PayloadArena::local().copy(text)) {
+    time_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
 }
 
 std::string Message::formatMessage() const {
-    return "[" + timestamp + "] " + sender + ": " + content;
+    std::string line;
+    appendFormatted(line);
+    return line;
+}
+
+void Message::appendFormatted(std::string& out) const {
+    out += '[';
+    out.append(clockText(time_ms), 8);
+    out += "] ";
+    if (room && !room->empty() && (*room)[0] == '@') {
+        // Direct message
+        out += sender ? *sender : std::string();
+        out += " -> ";
+        out.append(*room, 1, std::string::npos);
+    } else {
+        // Lines from other rooms are tagged so text clients can tell them apart
+        if (room && !room->empty() && *room != DEFAULT_ROOM) {
+            out += '#';
+            out += *room;
+            out += ' ';
+        }
+        out += sender ? *sender : std::string();
+    }
+    out += ": ";
+    out.append(content.data, content.length);
+}
+
+SharedBuffer Message::encode() const {
+    // One allocation: record and text line share the buffer
+    size_t names = (room ? room->size() : 0) + (sender ? sender->size() : 0);
+    auto encoded = std::make_shared<std::string>();
+    encoded->reserve(FRAME_HEADER_SIZE + 32 + 2 * (names + content.length));
+    appendRecord(*encoded, *this);
+    appendFormatted(*encoded);
+    *encoded += '\n';
+    return encoded;
+}
+
+// Length of the RECORD frame at the start of an encoded message
+static size_t recordLength(const std::string& encoded) {
+    const unsigned char* header = (const unsigned char*)encoded.data();
+    uint32_t length = ((uint32_t)header[0] << 24) | ((uint32_t)header[1] << 16) |
+                      ((uint32_t)header[2] << 8) | (uint32_t)header[3];
+    return FRAME_HEADER_SIZE + length;
+}
+
+SharedBuffer makeBuffer(const std::string& text) {
+    return std::make_shared<const std::string>(text);
 }
 
 // Client implementation
-Client::Client(SOCKET socket, const std::string& name) 
-    : socket_fd(socket), username(name), is_running(true) {
+static size_t memoryBytes(const OutboundSlice& slice) {
+    return slice.file ? 0 : slice.length;
+}
+
+Client::Client(SOCKET socket, int shard, const ServerConfig& config, ThreadMetrics& shard_metrics)
+    : socket_fd(socket), shard_index(shard), login_state(LoginState::AWAITING_PROTOCOL), wire_mode(WireMode::UNKNOWN),
+      local(false), write_offset(0), queued_bytes(0),
+      queue_limit(config.queue_limit), overflow_policy(config.overflow_policy),
+      metrics(shard_metrics), dropped(0), skipped(0),
+      is_running(true), write_interest(false), deferred_writes(false), pinned(0), holding(false),
+      flush_bytes(config.flush_bytes), throttled(false), read_interest(true), rate_notified(false),
+      deflated_offset(0), raw_slices(0), deflated_in_flight(false) {
+    rate_limit.configure(config.client_rate_messages, config.client_rate_bytes);
 }
 
 Client::~Client() {
     stop();
-    if (client_thread.joinable()) {
-        client_thread.join();
-    }
     closesocket(socket_fd);
 }
 
-void Client::start(std::function<void(const std::string&, const std::string&)> message_handler) {
-    client_thread = std::thread([this, message_handler]() {
-        char buffer[1024];
-        
-        // Send welcome message
-        std::string welcome = "Welcome to the chat server, " + username + "!\n";
-        send(socket_fd, welcome.c_str(), (int)welcome.length(), 0);
-        
-        while (is_running) {
-            // Clear buffer
-            memset(buffer, 0, sizeof(buffer));
-            
-            // Check for incoming messages
-            fd_set readfds;
-            struct timeval tv;
-            FD_ZERO(&readfds);
-            FD_SET(socket_fd, &readfds);
-            tv.tv_sec = 0;
-            tv.tv_usec = 100000; // 100ms
-            
-            if (select(0, &readfds, NULL, NULL, &tv) > 0) {
-                int bytes_read = recv(socket_fd, buffer, sizeof(buffer) - 1, 0);
-                
-                if (bytes_read <= 0) {
-                    // Client disconnected
-                    is_running = false;
-                    break;
-                }
-                
-                buffer[bytes_read] = '\0';
-                
-                // Process command or message
-                std::string message(buffer);
-                
-                // Remove trailing newline
-                size_t pos = message.find_last_not_of("\r\n");
-                if (pos != std::string::npos) {
-                    message.erase(pos + 1);
-                }
-                
-                if (message.substr(0, 5) == "/help") {
-                    std::string help = "Available commands:\n"
-                                     "/help - Show this help\n"
-                                     "/exit - Exit the chat\n";
-                    send(socket_fd, help.c_str(), (int)help.length(), 0);
-                } 
-                else {
-                    // Broadcast to all users
-                    if (!message.empty()) {
-                        message_handler(username, message);
-                    }
-                }
-            }
-            
-            // Add a small sleep to avoid 100% CPU usage
-            std::this_thread::sleep_for(std::chrono::milliseconds(10));
-        }
-    });
-}
-
 void Client::stop() {
     is_running = false;
 }
@@ -100,231 +180,2638 @@ bool Client::isRunning() const {
     return is_running;
 }
 
-void Client::sendMessage(const Message& msg) {
-    std::lock_guard<std::mutex> lock(write_mutex);
-    std::string formatted = msg.formatMessage() + "\n";
-    send(socket_fd, formatted.c_str(), (int)formatted.length(), 0);
+SOCKET Client::getSocket() const {
+    return socket_fd;
+}
+
+int Client::getShard() const {
+    return shard_index;
+}
+
+bool Client::isLocal() const {
+    return local;
+}
+
+void Client::setLocal(bool loopback) {
+    local = loopback;
+}
+
+void Client::login(const std::string& name) {
+    username = intern(name);
+    login_state = LoginState::LOGGED_IN;
+}
+
+bool Client::isLoggedIn() const {
+    return login_state == LoginState::LOGGED_IN;
+}
+
+const std::string& Client::getUsername() const {
+    static const std::string none;
+    return username ? *username : none;
 }
 
-std::string Client::getUsername() const {
+const Name& Client::getName() const {
     return username;
 }
 
-// ChatRoom implementation
-ChatRoom::ChatRoom(const std::string& room_name) : name(room_name) {
+LoginState Client::getLoginState() const {
+    return login_state;
 }
 
-void ChatRoom::addMessage(const Message& msg) {
-    std::lock_guard<std::mutex> lock(history_mutex);
-    message_history.push_back(msg);
+void Client::setLoginState(LoginState state) {
+    login_state = state;
 }
 
-std::vector<Message> ChatRoom::getHistory() const {
-    std::lock_guard<std::mutex> lock(history_mutex);
-    return message_history;
+WireMode Client::getWireMode() const {
+    return wire_mode;
 }
 
-std::string ChatRoom::getName() const {
-    return name;
+void Client::setWireMode(WireMode mode) {
+    wire_mode = mode;
 }
 
-// ChatServer implementation
-ChatServer::ChatServer(int server_port) : port(server_port), running(false) {
+uint64_t Client::getResumeSeq(const std::string& room) const {
+    auto it = resume_seqs.find(room);
+    return it != resume_seqs.end() ? it->second : 0;
 }
 
-ChatServer::~ChatServer() {
-    stop();
+void Client::setResumeSeq(const std::string& room, uint64_t seq) {
+    resume_seqs[room] = seq;
 }
 
-void ChatServer::start() {
-    // Initialize Winsock
-    WSADATA wsaData;
-    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
-        std::cerr << "WSAStartup failed" << std::endl;
-        return;
+const std::vector<std::shared_ptr<ChatRoom>>& Client::getRooms() const {
+    return rooms;
+}
+
+void Client::addRoom(const std::shared_ptr<ChatRoom>& room) {
+    rooms.push_back(room);
+}
+
+void Client::removeRoom(const std::shared_ptr<ChatRoom>& room) {
+    rooms.erase(std::remove(rooms.begin(), rooms.end(), room), rooms.end());
+    if (current_room == room) {
+        current_room = rooms.empty() ? nullptr : rooms.front();
     }
-    
-    // Create socket
-    server_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_socket == INVALID_SOCKET) {
-        std::cerr << "Error creating socket: " << WSAGetLastError() << std::endl;
-        WSACleanup();
+}
+
+std::shared_ptr<ChatRoom> Client::getCurrentRoom() const {
+    return current_room;
+}
+
+void Client::setCurrentRoom(const std::shared_ptr<ChatRoom>& room) {
+    current_room = room;
+}
+
+InputBuffer& Client::getInput() {
+    return input;
+}
+
+void Client::appendUnsent(std::string& out) const {
+#ifdef HAVE_ZLIB
+    // The stream is ended on a copy: this connection stays usable in case
+    // the successor does not take over
+    std::unique_ptr<Deflater> ending(deflater ? new Deflater(*deflater) : nullptr);
+    if (deflater) {
+        out.append(deflated, deflated_offset, std::string::npos);
+    }
+#endif
+    for (size_t i = 0; i < write_queue.size(); i++) {
+        const OutboundSlice& slice = write_queue[i];
+        size_t skip = i == 0 ? write_offset : 0;
+#ifdef HAVE_ZLIB
+        if (ending && i >= raw_slices) {
+            ending->write(out, slice.data->data() + slice.offset + skip, slice.length - skip);
+            continue;
+        }
+#endif
+        if (!slice.file) {
+            out.append(slice.data->data() + slice.offset + skip, slice.length - skip);
+            continue;
+        }
+#ifndef _WIN32
+        // History still to be streamed from the log
+        size_t start = out.size();
+        out.resize(start + slice.length - skip);
+        size_t done = 0;
+        while (done < slice.length - skip) {
+            ssize_t bytes = pread(slice.file->fd, &out[start + done], slice.length - skip - done,
+                                  (off_t)(slice.offset + skip + done));
+            if (bytes <= 0) {
+                out.resize(start + done);
+                break;
+            }
+            done += bytes;
+        }
+#endif
+    }
+#ifdef HAVE_ZLIB
+    if (ending) {
+        ending->finish(out);
+    }
+#endif
+}
+
+void Client::sendMessage(const Message& msg) {
+    sendEncoded(msg.encoded ? msg.encoded : msg.encode());
+}
+
+void Client::sendEncoded(const SharedBuffer& encoded) {
+    size_t record_length = recordLength(*encoded);
+    if (wire_mode == WireMode::FRAMED) {
+        sendBuffer(encoded, 0, record_length);
+    } else {
+        sendBuffer(encoded, record_length, encoded->size() - record_length);
+    }
+}
+
+void Client::sendText(const std::string& text) {
+    if (wire_mode == WireMode::FRAMED) {
+        sendFrame(FRAME_NOTICE, text);
+    } else {
+        SharedBuffer buffer = makeBuffer(text);
+        sendBuffer(buffer, 0, buffer->size());
+    }
+}
+
+void Client::sendFrame(uint8_t type, std::string_view payload) {
+    SharedBuffer buffer = makeBuffer(encodeFrame(type, payload));
+    sendBuffer(buffer, 0, buffer->size());
+}
+
+void Client::sendBuffer(const SharedBuffer& buffer, size_t offset, size_t length) {
+    if (!is_running || length == 0) {
         return;
     }
-    
-    // Set socket options
-    int opt = 1;
-    if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, (char*)&opt, sizeof(opt)) < 0) {
-        std::cerr << "Error setting socket options" << std::endl;
-        closesocket(server_socket);
-        WSACleanup();
+    if (!write_queue.empty() && queued_bytes + length > queue_limit) {
+        handleOverflow(length);
+        if (!is_running) {
+            return;
+        }
+    }
+
+    bool was_empty = write_queue.empty();
+    write_queue.push_back(OutboundSlice{buffer, offset, length});
+    queued_bytes += length;
+
+    metrics.peak_queue_bytes.raise(queued_bytes);
+
+    // A full batch goes out without waiting for the window
+    bool budget_hit = holding && queued_bytes >= flush_bytes;
+    if (budget_hit) {
+        holding = false;
+    }
+
+    // Only try the socket directly if nothing is waiting for writability.
+    // Compressed data waits for the event loop to flush the batch as one
+    // block, unless a full one is queued.
+    bool write_now = was_empty || budget_hit;
+    if (isCompressing()) {
+        write_now = queued_bytes >= flush_bytes && !hasDeflatedData();
+    }
+    if (write_now && !holding && !deferred_writes && !flush()) {
+        is_running = false;
+    }
+}
+
+void Client::sendFile(const FileRange& range) {
+    if (!is_running || range.length == 0) {
         return;
     }
-    
-    // Bind socket
-    struct sockaddr_in server_addr;
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(port);
-    
-    if (bind(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        std::cerr << "Error binding socket: " << WSAGetLastError() << std::endl;
-        closesocket(server_socket);
-        WSACleanup();
+    bool was_empty = write_queue.empty();
+    write_queue.push_back(OutboundSlice{SharedBuffer(), (size_t)range.offset, (size_t)range.length, range.file});
+
+    if (was_empty && !deferred_writes && !flush()) {
+        is_running = false;
+    }
+}
+
+void Client::handleOverflow(size_t incoming) {
+    if (overflow_policy == OverflowPolicy::DISCONNECT) {
+        metrics.overflow_disconnects.add(1);
+        is_running = false;
         return;
     }
-    
-    // Listen for connections
-    if (listen(server_socket, 10) < 0) {
-        std::cerr << "Error listening: " << WSAGetLastError() << std::endl;
-        closesocket(server_socket);
-        WSACleanup();
+
+    // A partially written buffer has to finish or the stream breaks, and
+    // buffers handed to an asynchronous send stay until it completes
+    size_t first = std::max(pinned, (size_t)(write_offset > 0 ? 1 : 0));
+    first = std::max(first, raw_slices);
+    uint64_t removed = 0;
+
+    if (overflow_policy == OverflowPolicy::DROP_OLDEST) {
+        while (write_queue.size() > first && queued_bytes + incoming > queue_limit) {
+            queued_bytes -= memoryBytes(write_queue[first]);
+            write_queue.erase(first);
+            removed++;
+        }
+        dropped += removed;
+        metrics.dropped_messages.add(removed);
         return;
     }
-    
-    // Create the chat room
-    chat_room = std::make_shared<ChatRoom>("Chat Room");
-    
-    std::cout << "Server is running on port " << port << std::endl;
-    
-    running = true;
-    accept_thread = std::thread(&ChatServer::acceptClients, this);
+
+    // COALESCE: the whole unsent backlog (including an older notice) becomes one notice
+    bool had_notice = false;
+    while (write_queue.size() > first) {
+        if (skip_notice && write_queue.back().data == skip_notice) {
+            had_notice = true;
+        } else {
+            removed++;
+        }
+        queued_bytes -= memoryBytes(write_queue.back());
+        write_queue.pop_back();
+    }
+    skipped = (had_notice ? skipped : 0) + removed;
+    dropped += removed;
+    metrics.coalesced_messages.add(removed);
+
+    std::string notice = "*** " + std::to_string(skipped) +
+                         " messages skipped, connection too slow ***\n";
+    skip_notice = makeBuffer(wire_mode == WireMode::FRAMED ? encodeFrame(FRAME_NOTICE, notice) : notice);
+    write_queue.push_back(OutboundSlice{skip_notice, 0, skip_notice->size()});
+    queued_bytes += skip_notice->size();
 }
 
-void ChatServer::stop() {
-    running = false;
-    
-    if (accept_thread.joinable()) {
-        accept_thread.join();
+bool Client::flush() {
+    const int MAX_SLICES = 64;
+    IoSlice slices[MAX_SLICES];
+
+    if (pinned > 0) {
+        return true; // An asynchronous send owns the front of the queue
     }
-    
-    // Close all client connections
-    std::lock_guard<std::mutex> lock(clients_mutex);
-    for (auto& client_pair : clients) {
-        client_pair.second->stop();
+    if (isCompressing()) {
+        return flushDeflated();
     }
-    clients.clear();
-    
-    closesocket(server_socket);
-    WSACleanup();
-    std::cout << "Server stopped" << std::endl;
+    while (!write_queue.empty()) {
+        if (write_queue.front().file) {
+#ifdef HAVE_SENDFILE
+            // Stream history straight from the log file
+            OutboundSlice& front = write_queue.front();
+            off_t file_offset = (off_t)(front.offset + write_offset);
+            ssize_t sent = sendfile(socket_fd, front.file->fd, &file_offset, front.length - write_offset);
+            if (sent < 0) {
+                return socketWouldBlock();
+            }
+            if (sent == 0) {
+                return false; // Log file is shorter than expected
+            }
+            write_offset += sent;
+            metrics.bytes_out.add(sent);
+            if (write_offset < front.length) {
+                break; // Socket buffer is full
+            }
+            write_queue.pop_front();
+            write_offset = 0;
+            continue;
+#else
+            return false;
+#endif
+        }
+
+        // Gather queued buffers into one send call
+        size_t total = 0;
+        int count = gatherSlices(slices, MAX_SLICES, total);
+        int sent = sendSlices(socket_fd, slices, count);
+        if (sent < 0) {
+            return socketWouldBlock();
+        }
+        consumeSent(sent);
+
+        if ((size_t)sent < total) {
+            break; // Socket buffer is full
+        }
+    }
+    return true;
 }
 
-void ChatServer::acceptClients() {
-    while (running) {
-        // Set up select for accepting connections with timeout
-        fd_set readfds;
-        struct timeval tv;
-        FD_ZERO(&readfds);
-        FD_SET(server_socket, &readfds);
-        tv.tv_sec = 1; // 1 second timeout to check running flag
-        tv.tv_usec = 0;
-        
-        if (select(0, &readfds, NULL, NULL, &tv) <= 0) {
-            continue; // Timeout or error, check running flag
-        }
-        
-        // Accept connection
-        struct sockaddr_in client_addr;
-        int client_size = sizeof(client_addr);
-        SOCKET client_socket = accept(server_socket, (struct sockaddr *)&client_addr, &client_size);
-        
-        if (client_socket == INVALID_SOCKET) {
-            std::cerr << "Error accepting connection: " << WSAGetLastError() << std::endl;
-            continue;
+int Client::gatherSlices(IoSlice* slices, int max_slices, size_t& total) {
+    int count = 0;
+    size_t offset = write_offset;
+    total = 0;
+    for (size_t i = 0; i < write_queue.size() && !write_queue[i].file && count < max_slices; i++) {
+        const OutboundSlice& slice = write_queue[i];
+        setSlice(slices[count++], slice.data->data() + slice.offset + offset, slice.length - offset);
+        total += slice.length - offset;
+        offset = 0;
+    }
+    return count;
+}
+
+void Client::consumeSent(size_t sent) {
+    metrics.bytes_out.add(sent);
+
+    // Drop fully written buffers
+    size_t remaining = sent;
+    while (remaining > 0) {
+        size_t left = write_queue.front().length - write_offset;
+        if (remaining < left) {
+            write_offset += remaining;
+            break;
         }
-        
-        // Get client username
-        char buffer[1024];
-        std::string prompt = "Enter your username: ";
-        std::cout << "Sending username prompt to client..." << std::endl;
-        send(client_socket, prompt.c_str(), (int)prompt.length(), 0);
-        
-        std::cout << "Waiting for client username..." << std::endl;
-        int bytes_read = recv(client_socket, buffer, sizeof(buffer) - 1, 0);
-        if (bytes_read <= 0) {
-            std::cerr << "Failed to receive username from client" << std::endl;
-            closesocket(client_socket);
-            continue;
+        remaining -= left;
+        queued_bytes -= write_queue.front().length;
+        if (write_queue.front().data == skip_notice) {
+            skip_notice.reset();
         }
-        
-        buffer[bytes_read] = '\0';
-        std::string username(buffer);
-        
-        // Remove trailing newline
-        size_t pos = username.find_last_not_of("\r\n");
-        if (pos != std::string::npos) {
-            username.erase(pos + 1);
+        write_queue.pop_front();
+        write_offset = 0;
+        if (raw_slices > 0) {
+            raw_slices--;
         }
-        
-        std::cout << "Received username: '" << username << "'" << std::endl;
-        
-        // Check if username already exists
-        std::unique_lock<std::mutex> lock(clients_mutex);
-        if (clients.find(username) != clients.end()) {
-            lock.unlock();
-            std::string error = "Username already taken. Connection closed.\n";
-            send(client_socket, error.c_str(), (int)error.length(), 0);
-            closesocket(client_socket);
-            continue;
+    }
+}
+
+bool Client::deflateQueued() {
+#ifdef HAVE_ZLIB
+    deflated.clear();
+    deflated_offset = 0;
+    size_t raw_bytes = 0;
+    size_t input_bytes = 0;
+    bool ok = true;
+    while (!write_queue.empty() && ok) {
+        const OutboundSlice& slice = write_queue.front();
+        const char* data = slice.data->data() + slice.offset + write_offset;
+        size_t length = slice.length - write_offset;
+        if (raw_slices > 0) {
+            deflated.append(data, length);
+            raw_bytes += length;
+            raw_slices--;
+        } else {
+            ok = deflater->write(deflated, data, length);
+            input_bytes += length;
         }
-        
-        // Create new client
-        std::shared_ptr<Client> client = std::make_shared<Client>(client_socket, username);
-        clients[username] = client;
-        lock.unlock();
-        
-        // Start client thread
-        client->start([this](const std::string& sender, const std::string& message) {
-            this->handleClientMessage(sender, message);
-        });
-        
-        // Send welcome message to all clients
-        Message welcome_msg("Server", username + " has joined the chat");
-        
-        // Add to chat history
-        chat_room->addMessage(welcome_msg);
-        
-        // Broadcast to all clients
-        broadcastMessage(welcome_msg);
-        
-        // Send chat history to new client
-        auto history = chat_room->getHistory();
-        for (const auto& msg : history) {
-            if (msg.sender != "Server" || msg.content != username + " has joined the chat") {
-                client->sendMessage(msg);
-            }
-        }
-        
-        std::cout << "New client connected: " << username << std::endl;
+        queued_bytes -= slice.length;
+        if (slice.data == skip_notice) {
+            skip_notice.reset();
+        }
+        write_queue.pop_front();
+        write_offset = 0;
+    }
+    if (ok && input_bytes > 0) {
+        ok = deflater->flush(deflated);
+    }
+    metrics.deflate_in.add(input_bytes);
+    metrics.deflate_out.add(deflated.size() - raw_bytes);
+    return ok;
+#else
+    return false;
+#endif
+}
+
+bool Client::flushDeflated() {
+    IoSlice slice;
+    while (true) {
+        if (!hasDeflatedData()) {
+            if (write_queue.empty()) {
+                return true;
+            }
+            if (!deflateQueued()) {
+                return false;
+            }
+        }
+        setSlice(slice, deflated.data() + deflated_offset, deflated.size() - deflated_offset);
+        int sent = sendSlices(socket_fd, &slice, 1);
+        if (sent < 0) {
+            return socketWouldBlock();
+        }
+        consumeDeflated(sent);
+        if (hasDeflatedData()) {
+            return true; // Socket buffer is full
+        }
+    }
+}
+
+void Client::consumeDeflated(size_t sent) {
+    const size_t KEEP_CAPACITY = 16 * 1024;
+    metrics.bytes_out.add(sent);
+    deflated_offset += sent;
+    // A history replay makes a big block; do not keep its buffer around
+    if (!hasDeflatedData() && deflated.capacity() > KEEP_CAPACITY) {
+        std::string().swap(deflated);
+        deflated_offset = 0;
+    }
+}
+
+bool Client::hasDeflatedData() const {
+    return deflated_offset < deflated.size();
+}
+
+bool Client::startCompression(int level) {
+#ifdef HAVE_ZLIB
+    std::unique_ptr<Deflater> stream(new Deflater(level));
+    if (!stream->valid()) {
+        return false;
+    }
+    deflater = std::move(stream);
+    raw_slices = write_queue.size();
+    return true;
+#else
+    (void)level;
+    return false;
+#endif
+}
+
+bool Client::isCompressing() const {
+#ifdef HAVE_ZLIB
+    return deflater != nullptr;
+#else
+    return false;
+#endif
+}
+
+void Client::setDeferredWrites(bool deferred) {
+    deferred_writes = deferred;
+}
+
+int Client::beginSend(IoSlice* slices, int max_slices) {
+    if (isCompressing() && pinned == 0 && !deflated_in_flight) {
+        if (!hasDeflatedData() && (holding || write_queue.empty() || !deflateQueued())) {
+            return 0;
+        }
+        setSlice(slices[0], deflated.data() + deflated_offset, deflated.size() - deflated_offset);
+        deflated_in_flight = true;
+        return 1;
+    }
+    if (pinned > 0 || holding || deflated_in_flight) {
+        return 0;
+    }
+    size_t total = 0;
+    int count = gatherSlices(slices, max_slices, total);
+    pinned = count;
+    return count;
+}
+
+void Client::completeSend(size_t sent) {
+    if (deflated_in_flight) {
+        deflated_in_flight = false;
+        consumeDeflated(sent);
+        return;
     }
+    pinned = 0;
+    consumeSent(sent);
+}
+
+bool Client::hasPendingWrites() const {
+    return !write_queue.empty() || hasDeflatedData();
+}
+
+size_t Client::getQueuedBytes() const {
+    bool partial_buffer = !write_queue.empty() && !write_queue.front().file;
+    return queued_bytes - (partial_buffer ? write_offset : 0) + (deflated.size() - deflated_offset);
+}
+
+size_t Client::getQueuedMessages() const {
+    return write_queue.size();
+}
+
+uint64_t Client::getDroppedMessages() const {
+    return dropped;
+}
+
+bool Client::wantsWrite() const {
+    return (!write_queue.empty() && !holding) || hasDeflatedData();
+}
+
+void Client::holdWrites(std::chrono::steady_clock::time_point until) {
+    if (!holding) {
+        holding = true;
+        hold_until = until;
+    }
+}
+
+void Client::releaseWrites() {
+    holding = false;
+}
+
+bool Client::isHolding() const {
+    return holding;
+}
+
+std::chrono::steady_clock::time_point Client::getHoldDeadline() const {
+    return hold_until;
+}
+
+bool Client::hasWriteInterest() const {
+    return write_interest;
+}
+
+void Client::setWriteInterest(bool enabled) {
+    write_interest = enabled;
+}
+
+bool Client::hasReadInterest() const {
+    return read_interest;
+}
+
+void Client::setReadInterest(bool enabled) {
+    read_interest = enabled;
+}
+
+RateLimit& Client::getRateLimit() {
+    return rate_limit;
+}
+
+void Client::throttle(std::chrono::steady_clock::time_point until) {
+    throttled = true;
+    throttled_until = until;
+}
+
+void Client::unthrottle() {
+    throttled = false;
+}
+
+bool Client::isThrottled() const {
+    return throttled;
+}
+
+std::chrono::steady_clock::time_point Client::getThrottleDeadline() const {
+    return throttled_until;
+}
+
+bool Client::wasToldRate() const {
+    return rate_notified;
+}
+
+void Client::setToldRate(bool told) {
+    rate_notified = told;
+}
+
+// History implementation
+static const size_t HISTORY_SEGMENT_SIZE = 256;
+
+static size_t messageBytes(const Message& msg) {
+    // Names are shared, the encoding holds the rest
+    return msg.encoded ? msg.encoded->size() : msg.content.length;
+}
+
+HistorySegment::HistorySegment(size_t capacity) : slots(capacity), positions(capacity), count(0) {
+}
+
+HistorySnapshot::HistorySnapshot() : first_offset(0), last_count(0) {
 }
 
-void ChatServer::handleClientMessage(const std::string& sender, const std::string& message) {
-    // Create message
-    Message msg(sender, message);
-    
-    // Add to chat history
-    chat_room->addMessage(msg);
-    
-    // Broadcast to all clients
-    broadcastMessage(msg);
+HistorySnapshot::HistorySnapshot(std::vector<std::shared_ptr<const HistorySegment>> segment_list,
+                                 size_t first, size_t last)
+    : segments(std::move(segment_list)), first_offset(first), last_count(last) {
 }
 
-void ChatServer::broadcastMessage(const Message& msg) {
-    std::lock_guard<std::mutex> lock(clients_mutex);
-    
-    for (auto& client_pair : clients) {
-        client_pair.second->sendMessage(msg);
+size_t HistorySnapshot::size() const {
+    size_t total = 0;
+    for (size_t i = 0; i < segments.size(); i++) {
+        size_t begin = i == 0 ? first_offset : 0;
+        size_t end = i + 1 == segments.size() ? last_count : segments[i]->count;
+        total += end - begin;
     }
+    return total;
 }
 
-std::string ChatServer::getCurrentTimestamp() const {
-    auto now = std::chrono::system_clock::now();
-    auto time = std::chrono::system_clock::to_time_t(now);
-    std::tm timeinfo;
-    localtime_s(&timeinfo, &time);
-    std::stringstream ss;
-    ss << std::put_time(&timeinfo, "%H:%M:%S");
-    return ss.str();
-} 
\ No newline at end of file
+uint64_t HistorySnapshot::firstSeq() const {
+    if (size() == 0) {
+        return 0;
+    }
+    return segments.front()->slots[first_offset].seq;
+}
+
+uint64_t HistorySnapshot::lastSeq() const {
+    if (size() == 0) {
+        return 0;
+    }
+    return segments.back()->slots[last_count - 1].seq;
+}
+
+bool HistorySnapshot::locate(uint64_t seq, size_t& segment, size_t& slot) const {
+    for (size_t i = 0; i < segments.size(); i++) {
+        size_t begin = i == 0 ? first_offset : 0;
+        size_t end = i + 1 == segments.size() ? last_count : segments[i]->count;
+        if (end == begin || segments[i]->slots[end - 1].seq < seq) {
+            continue;
+        }
+        segment = i;
+        // Sequence ids are consecutive, so index directly when possible
+        size_t index = begin + (size_t)(seq - std::min(seq, segments[i]->slots[begin].seq));
+        if (index < end && segments[i]->slots[index].seq == seq) {
+            slot = index;
+            return true;
+        }
+        for (size_t j = begin; j < end; j++) {
+            if (segments[i]->slots[j].seq >= seq) {
+                slot = j;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+LogPosition HistorySnapshot::positionOf(uint64_t seq) const {
+    size_t segment, slot;
+    if (!locate(seq, segment, slot)) {
+        return LogPosition();
+    }
+    return segments[segment]->positions[slot];
+}
+
+const Message* HistorySnapshot::find(uint64_t seq) const {
+    size_t segment, slot;
+    if (!locate(seq, segment, slot) || segments[segment]->slots[slot].seq != seq) {
+        return nullptr;
+    }
+    return &segments[segment]->slots[slot];
+}
+
+LogPosition HistorySnapshot::endPosition() const {
+    if (size() == 0) {
+        return LogPosition();
+    }
+    const HistorySegment& last = *segments.back();
+    LogPosition position = last.positions[last_count - 1];
+    if (!position.valid()) {
+        return position;
+    }
+    return LogPosition(position.segment, position.offset + recordLength(*last.slots[last_count - 1].encoded));
+}
+
+// ChatRoom implementation
+ChatRoom::ChatRoom(const std::string& room_name, size_t history_messages, size_t history_bytes_limit)
+    : name(intern(room_name)), first_offset(0), message_count(0), history_bytes(0),
+      max_messages(history_messages), max_bytes(history_bytes_limit), next_seq(1),
+      member_shards(new std::vector<int>()) {
+}
+
+ChatRoom::~ChatRoom() {
+    if (message_log) {
+        message_log->close();
+    }
+}
+
+bool ChatRoom::attachLog(std::unique_ptr<MessageLog> log) {
+    std::lock_guard<std::mutex> lock(history_mutex);
+    bool opened = log->open(max_messages, [this](const Message& record, LogPosition position) {
+        Message msg = record;
+        msg.room = name;
+        seal(msg);
+        storeMessage(msg, position);
+    });
+    if (!opened) {
+        return false;
+    }
+    std::cout << "Replayed " << message_count << " messages from the log for " << *name << std::endl;
+    message_log = std::move(log);
+    return true;
+}
+
+SharedBuffer ChatRoom::addMessage(Message& msg) {
+    std::lock_guard<std::mutex> lock(history_mutex);
+    msg.seq = next_seq;
+    msg.room = name;
+    seal(msg);
+
+    // Appending under the history lock keeps log and ring in the same order
+    LogPosition position;
+    if (message_log) {
+        position = message_log->append(std::string_view(msg.encoded->data(), recordLength(*msg.encoded)));
+    }
+    storeMessage(msg, position);
+    return msg.encoded;
+}
+
+void ChatRoom::seal(Message& msg) {
+    msg.encoded = msg.encode();
+    // Content is the tail of the record; drop the arena reference
+    size_t content_end = recordLength(*msg.encoded);
+    msg.content = Payload(msg.encoded, msg.encoded->data() + content_end - msg.content.length,
+                          msg.content.length);
+}
+
+void ChatRoom::storeMessage(const Message& msg, LogPosition position) {
+    next_seq = std::max(next_seq, msg.seq + 1);
+
+    if (segments.empty() || segments.back()->count == HISTORY_SEGMENT_SIZE) {
+        // Reuse the last trimmed segment if no snapshot still holds it
+        std::shared_ptr<HistorySegment> segment;
+        if (spare_segment && spare_segment.use_count() == 1) {
+            segment.swap(spare_segment);
+            segment->count = 0;
+        } else {
+            segment = std::make_shared<HistorySegment>(HISTORY_SEGMENT_SIZE);
+        }
+        segments.push_back(segment);
+    }
+
+    // Snapshots only read slots below count, so this slot is private
+    HistorySegment& tail = *segments.back();
+    tail.slots[tail.count] = msg;
+    tail.positions[tail.count] = position;
+    tail.count++;
+    message_count++;
+    history_bytes += messageBytes(msg);
+    search_index.add(msg.seq, msg.sender ? *msg.sender : std::string_view(), msg.content.view());
+
+    trimHistory();
+}
+
+void ChatRoom::trimHistory() {
+    while (message_count > 0 &&
+           ((max_messages > 0 && message_count > max_messages) ||
+            (max_bytes > 0 && history_bytes > max_bytes))) {
+        HistorySegment& head = *segments.front();
+        const Message& oldest = head.slots[first_offset];
+        history_bytes -= messageBytes(oldest);
+        search_index.remove(oldest.seq, oldest.sender ? *oldest.sender : std::string_view(), oldest.content.view());
+        message_count--;
+        first_offset++;
+
+        if (first_offset == head.count && (segments.size() > 1 || head.count == HISTORY_SEGMENT_SIZE)) {
+            spare_segment = segments.front();
+            segments.pop_front();
+            first_offset = 0;
+        }
+    }
+}
+
+HistorySnapshot ChatRoom::getHistory() const {
+    std::lock_guard<std::mutex> lock(history_mutex);
+    return getHistoryLocked();
+}
+
+HistorySnapshot ChatRoom::getHistoryLocked() const {
+    std::vector<std::shared_ptr<const HistorySegment>> segment_list(segments.begin(), segments.end());
+    size_t last_count = segments.empty() ? 0 : segments.back()->count;
+    return HistorySnapshot(std::move(segment_list), first_offset, last_count);
+}
+
+const std::string& ChatRoom::getName() const {
+    return *name;
+}
+
+uint64_t ChatRoom::lastSeq() const {
+    std::lock_guard<std::mutex> lock(history_mutex);
+    return next_seq - 1;
+}
+
+std::vector<Message> ChatRoom::search(const std::vector<std::string>& words, const std::string& sender,
+                                      size_t limit) const {
+    SearchIndex::Snapshot postings;
+    HistorySnapshot history;
+    {
+        std::lock_guard<std::mutex> lock(history_mutex);
+        postings = search_index.snapshot(words, sender);
+        history = getHistoryLocked();
+    }
+
+    std::vector<Message> found;
+    std::vector<uint64_t> seqs = postings.match(limit);
+    for (auto it = seqs.rbegin(); it != seqs.rend(); ++it) {
+        const Message* msg = history.find(*it);
+        if (msg) {
+            found.push_back(*msg);
+        }
+    }
+    return found;
+}
+
+void ChatRoom::restoreMessage(Message& msg) {
+    std::lock_guard<std::mutex> lock(history_mutex);
+    if (message_count > 0 && msg.seq <= segments.back()->slots[segments.back()->count - 1].seq) {
+        return; // Replayed from the log
+    }
+    msg.room = name;
+    seal(msg);
+    storeMessage(msg, LogPosition());
+}
+
+void ChatRoom::resumeAfter(uint64_t last_seq) {
+    std::lock_guard<std::mutex> lock(history_mutex);
+    next_seq = std::max(next_seq, last_seq + 1);
+}
+
+void ChatRoom::flushLog() {
+    std::lock_guard<std::mutex> lock(history_mutex);
+    if (message_log) {
+        message_log->flushWrites();
+    }
+}
+
+bool ChatRoom::streamHistory(const HistorySnapshot& snapshot, uint64_t from_seq, uint64_t end_seq,
+                             std::vector<FileRange>& out) {
+#ifdef HAVE_SENDFILE
+    if (!message_log) {
+        return false;
+    }
+    LogPosition first = snapshot.positionOf(from_seq);
+    LogPosition end = end_seq > snapshot.lastSeq() ? snapshot.endPosition() : snapshot.positionOf(end_seq);
+    if (!first.valid() || !end.valid()) {
+        return false;
+    }
+    // Batched records have to reach the file before it can be sent
+    message_log->flushWrites();
+    return message_log->ranges(first, end, out);
+#else
+    return false;
+#endif
+}
+
+void ChatRoom::setRateLimit(double messages_per_second, double bytes_per_second) {
+    std::lock_guard<std::mutex> lock(rate_mutex);
+    rate_limit.configure(messages_per_second, bytes_per_second);
+}
+
+TokenBucket::Clock::duration ChatRoom::admit(size_t length, TokenBucket::Clock::time_point now) {
+    std::lock_guard<std::mutex> lock(rate_mutex);
+    TokenBucket::Clock::duration wait = rate_limit.wait(length, now);
+    if (wait == TokenBucket::Clock::duration::zero()) {
+        rate_limit.take(length);
+    }
+    return wait;
+}
+
+void ChatRoom::subscribe(int shard) {
+    std::lock_guard<std::mutex> lock(members_mutex);
+    if ((size_t)shard >= shard_members.size()) {
+        shard_members.resize(shard + 1, 0);
+    }
+    if (shard_members[shard]++ == 0) {
+        publishMemberShards();
+    }
+}
+
+void ChatRoom::unsubscribe(int shard) {
+    std::lock_guard<std::mutex> lock(members_mutex);
+    if ((size_t)shard < shard_members.size() && shard_members[shard] > 0) {
+        if (--shard_members[shard] == 0) {
+            publishMemberShards();
+        }
+    }
+}
+
+void ChatRoom::publishMemberShards() {
+    std::vector<int>* shards = new std::vector<int>();
+    for (size_t i = 0; i < shard_members.size(); i++) {
+        if (shard_members[i] > 0) {
+            shards->push_back((int)i);
+        }
+    }
+    member_shards.publish(shards);
+}
+
+const std::vector<int>& ChatRoom::memberShards() const {
+    return member_shards.get();
+}
+
+// Sender of join and leave notices
+static const Name& serverName() {
+    static const Name name = intern("Server");
+    return name;
+}
+
+// Shard implementation
+#ifdef HAVE_IO_URING
+static const unsigned RING_ENTRIES = 4096;
+static const unsigned RING_BUFFERS = 512; // provided receive buffers per shard
+static const unsigned RING_BUFFER_SIZE = 4096;
+
+// io_uring backend of the shard loop. user_data carries the operation and
+// the socket; a RingConnection keeps the socket open while operations on
+// it are in flight.
+enum RingOperation : uint32_t {
+    RING_ACCEPT = 1,
+    RING_RECV,
+    RING_SEND,
+    RING_POLL
+};
+
+static uint64_t ringData(RingOperation operation, SOCKET socket) {
+    return ((uint64_t)operation << 32) | (uint32_t)socket;
+}
+#endif
+
+Shard::Shard(ChatServer& owner, int shard_index)
+    : server(owner), index(shard_index), listen_socket(INVALID_SOCKET), running(false), metrics(nullptr) {
+}
+
+Shard::~Shard() {
+    stop();
+    poller.close();
+    if (listen_socket != INVALID_SOCKET) {
+        closesocket(listen_socket);
+    }
+}
+
+bool Shard::listen(int port, bool reuse_port) {
+    // Create socket
+    listen_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_socket == INVALID_SOCKET) {
+        std::cerr << "Error creating socket: " << WSAGetLastError() << std::endl;
+        return false;
+    }
+
+    // Set socket options
+    int opt = 1;
+    if (setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, (char*)&opt, sizeof(opt)) < 0) {
+        std::cerr << "Error setting socket options" << std::endl;
+        return false;
+    }
+#ifdef SO_REUSEPORT
+    // Every shard binds the same port and the kernel spreads connections
+    if (reuse_port &&
+        setsockopt(listen_socket, SOL_SOCKET, SO_REUSEPORT, (char*)&opt, sizeof(opt)) < 0) {
+        std::cerr << "Error setting SO_REUSEPORT: " << WSAGetLastError() << std::endl;
+        return false;
+    }
+#endif
+
+    // Bind socket
+    struct sockaddr_in server_addr;
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(port);
+
+    if (bind(listen_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        std::cerr << "Error binding socket: " << WSAGetLastError() << std::endl;
+        return false;
+    }
+
+    // Listen for connections
+    if (::listen(listen_socket, SOMAXCONN) < 0) {
+        std::cerr << "Error listening: " << WSAGetLastError() << std::endl;
+        return false;
+    }
+    return setupListener();
+}
+
+bool Shard::adoptListener(SOCKET socket) {
+    listen_socket = socket;
+    return setupListener();
+}
+
+SOCKET Shard::getListenSocket() const {
+    return listen_socket;
+}
+
+bool Shard::setupListener() {
+#ifdef HAVE_IO_URING
+    if (server.config.io_backend == IoBackend::IO_URING) {
+        ring.reset(new IoRing());
+        if (ring->open(RING_ENTRIES, RING_BUFFERS, RING_BUFFER_SIZE) && setNonBlocking(listen_socket)) {
+            return true;
+        }
+        std::cerr << "io_uring is not available, using the poller" << std::endl;
+        ring.reset();
+    }
+#endif
+
+    // Register the listener with the event loop
+    if (!setNonBlocking(listen_socket) || !poller.open() ||
+        !poller.add(listen_socket, Poller::READABLE)) {
+        std::cerr << "Error setting up event loop: " << WSAGetLastError() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool Shard::usingRing() const {
+#ifdef HAVE_IO_URING
+    return ring != nullptr;
+#else
+    return false;
+#endif
+}
+
+const char* Shard::backendName() const {
+    return usingRing() ? "io_uring" : "poll";
+}
+
+void Shard::wakeup() {
+#ifdef HAVE_IO_URING
+    if (ring) {
+        ring->wakeup();
+        return;
+    }
+#endif
+    poller.wakeup();
+}
+
+void Shard::start() {
+    running = true;
+    loop_thread = std::thread(&Shard::eventLoop, this);
+}
+
+void Shard::stop() {
+    pause();
+
+    // Close all client connections
+    for (auto& connection : connections) {
+        connection.second->stop();
+    }
+    connections.clear();
+    room_members.clear();
+    login_deadlines.clear();
+    held_writes.clear();
+    throttled_clients.clear();
+}
+
+void Shard::pause() {
+    running = false;
+    wakeup();
+
+    if (loop_thread.joinable()) {
+        loop_thread.join();
+    }
+}
+
+void Shard::exportConnections(std::vector<ConnectionState>& out) {
+    // The last messages the sequencer routed here go to the queues first,
+    // so every member has its rooms up to their last sequence id
+    drainInbox();
+
+    for (const auto& connection : connections) {
+        const std::shared_ptr<Client>& client = connection.second;
+        if (!client->isRunning()) {
+            continue;
+        }
+        ConnectionState state;
+        state.socket = connection.first;
+        state.shard = index;
+        state.login_state = (uint8_t)client->getLoginState();
+        state.wire_mode = (uint8_t)client->getWireMode();
+        state.local = client->isLocal();
+        state.compressed = client->isCompressing();
+        if (client->isLoggedIn()) {
+            state.username = client->getUsername();
+        }
+        if (client->getCurrentRoom()) {
+            state.current_room = client->getCurrentRoom()->getName();
+        }
+        for (const auto& room : client->getRooms()) {
+            state.rooms.emplace_back(room->getName(), room->lastSeq());
+        }
+        state.input = std::string(client->getInput().unparsed());
+        client->appendUnsent(state.output);
+        out.push_back(std::move(state));
+    }
+}
+
+void Shard::adopt(ConnectionState state) {
+    adopting.push_back(std::move(state));
+}
+
+void Shard::adoptConnections() {
+    for (auto& state : adopting) {
+        if (!usingRing() && (!setNonBlocking(state.socket) || !poller.add(state.socket, Poller::READABLE))) {
+            std::cerr << "Error registering an adopted connection: " << WSAGetLastError() << std::endl;
+            closesocket(state.socket);
+            continue;
+        }
+        std::shared_ptr<Client> client = createClient(state.socket, state.local);
+        client->setWireMode((WireMode)state.wire_mode);
+        // What the old process had queued goes out first; it ends a
+        // compressed stream, and a new one starts after it
+        if (!state.output.empty()) {
+            client->sendBuffer(makeBuffer(state.output), 0, state.output.size());
+        }
+        int level = server.config.compress_level > 0 ? server.config.compress_level : 1;
+        if (state.compressed && !client->startCompression(level)) {
+            disconnectClient(client);
+            continue;
+        }
+
+        LoginState login_state = (LoginState)state.login_state;
+        if (login_state == LoginState::LOGGED_IN) {
+            if (!server.registerClient(client, state.username)) {
+                disconnectClient(client);
+                continue;
+            }
+            // Rejoining replays whatever was sequenced after the handoff
+            for (const auto& room : state.rooms) {
+                client->setResumeSeq(room.first, room.second);
+                joinRoom(client, server.openRoom(room.first), false);
+            }
+            client->setCurrentRoom(state.current_room.empty() ? server.lobby : server.openRoom(state.current_room));
+        } else {
+            client->setLoginState(login_state);
+            if (server.config.login_timeout_ms > 0) {
+                login_deadlines.emplace_back(
+                    Clock::now() + std::chrono::milliseconds(server.config.login_timeout_ms), client);
+            }
+        }
+
+        if (!state.input.empty()) {
+            InputBuffer& input = client->getInput();
+            memcpy(input.reserve(state.input.size()), state.input.data(), state.input.size());
+            input.commit(state.input.size());
+            handleInput(client, state.input.size());
+        }
+        if (client->isRunning()) {
+            updateInterest(client);
+        }
+    }
+    adopting.clear();
+}
+
+void Shard::post(const Broadcast& broadcast) {
+    bool was_empty;
+    {
+        std::lock_guard<std::mutex> lock(inbox_mutex);
+        was_empty = inbox.empty();
+        inbox.push_back(broadcast);
+    }
+    // One wakeup covers everything queued until the inbox is drained
+    if (was_empty) {
+        wakeup();
+    }
+}
+
+void Shard::post(std::vector<Broadcast>& batch) {
+    bool was_empty;
+    {
+        std::lock_guard<std::mutex> lock(inbox_mutex);
+        was_empty = inbox.empty();
+        if (was_empty) {
+            inbox.swap(batch);
+        } else {
+            inbox.insert(inbox.end(), batch.begin(), batch.end());
+        }
+    }
+    batch.clear();
+    if (was_empty) {
+        wakeup();
+    }
+}
+
+void Shard::eventLoop() {
+    std::vector<Poller::Event> ready;
+    metrics = &threadMetrics();
+    adoptConnections();
+#ifdef HAVE_IO_URING
+    if (ring) {
+        ringLoop();
+        return;
+    }
+#endif
+
+    while (running) {
+        poller.wait(ready, nextTimeout());
+
+        for (const auto& event : ready) {
+            if (event.fd == listen_socket) {
+                acceptClients();
+                continue;
+            }
+
+            auto it = connections.find(event.fd);
+            if (it == connections.end()) {
+                continue; // Closed earlier in this batch
+            }
+            std::shared_ptr<Client> client = it->second;
+
+            if (event.events & (Poller::READABLE | Poller::CLOSED)) {
+                handleReadable(client);
+            }
+            if (client->isRunning() && (event.events & Poller::WRITABLE)) {
+                handleWritable(client);
+            }
+        }
+
+        drainInbox();
+        flushHeldWrites();
+        resumeThrottled();
+        expireLogins();
+    }
+}
+
+int Shard::nextTimeout() const {
+    if (login_deadlines.empty() && held_writes.empty() && throttled_clients.empty()) {
+        return -1;
+    }
+    Clock::time_point deadline = Clock::time_point::max();
+    if (!login_deadlines.empty()) {
+        deadline = login_deadlines.front().first;
+    }
+    if (!held_writes.empty()) {
+        deadline = std::min(deadline, held_writes.front().first);
+    }
+    if (!throttled_clients.empty()) {
+        deadline = std::min(deadline, throttled_clients.begin()->first);
+    }
+    auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now()).count();
+    // Round up so the deadline has passed when the wait returns
+    return wait < 0 ? 0 : (int)wait + 1;
+}
+
+void Shard::flushHeldWrites() {
+    Clock::time_point now = Clock::now();
+    while (!held_writes.empty() && held_writes.front().first <= now) {
+        std::shared_ptr<Client> client = held_writes.front().second.lock();
+        Clock::time_point deadline = held_writes.front().first;
+        held_writes.pop_front();
+        // Skip entries from a hold that the byte budget already ended
+        if (!client || !client->isHolding() || client->getHoldDeadline() != deadline) {
+            continue;
+        }
+        client->releaseWrites();
+        // With io_uring, updateInterest() starts the send
+        if (!usingRing() && !client->flush()) {
+            client->stop();
+        }
+        updateInterest(client);
+    }
+}
+
+void Shard::resumeThrottled() {
+    Clock::time_point now = Clock::now();
+    while (!throttled_clients.empty() && throttled_clients.begin()->first <= now) {
+        std::shared_ptr<Client> client = throttled_clients.begin()->second.lock();
+        Clock::time_point deadline = throttled_clients.begin()->first;
+        throttled_clients.erase(throttled_clients.begin());
+        if (!client || !client->isThrottled() || client->getThrottleDeadline() != deadline ||
+            connections.find(client->getSocket()) == connections.end()) {
+            continue;
+        }
+        // Handle what waited, then read again unless that throttled it anew
+        client->unthrottle();
+        handleInput(client, 0);
+        if (connections.find(client->getSocket()) != connections.end()) {
+            updateInterest(client);
+        }
+    }
+}
+
+void Shard::expireLogins() {
+    Clock::time_point now = Clock::now();
+    while (!login_deadlines.empty() && login_deadlines.front().first <= now) {
+        std::shared_ptr<Client> client = login_deadlines.front().second.lock();
+        login_deadlines.pop_front();
+        if (client && client->isRunning() && !client->isLoggedIn()) {
+            client->sendText("Login timed out. Connection closed.\n");
+            disconnectClient(client);
+        }
+    }
+}
+
+void Shard::drainInbox() {
+    std::vector<Broadcast> pending;
+    {
+        std::lock_guard<std::mutex> lock(inbox_mutex);
+        pending.swap(inbox);
+    }
+    for (const auto& broadcast : pending) {
+        deliver(broadcast);
+    }
+}
+
+void Shard::deliver(const Broadcast& broadcast) {
+    if (broadcast.target) {
+        // Direct message; the recipient may have left meanwhile
+        const std::shared_ptr<Client>& client = broadcast.target;
+        auto it = connections.find(client->getSocket());
+        if (it != connections.end() && it->second == client && broadcast.disconnect) {
+            client->sendText("Username is taken on another server. Connection closed.\n");
+            disconnectClient(client);
+        } else if (it != connections.end() && it->second == client) {
+            client->sendEncoded(broadcast.encoded);
+            metrics->messages_delivered.add(1);
+            updateInterest(client);
+        }
+        return;
+    }
+
+    auto members = room_members.find(broadcast.room.get());
+    if (members == room_members.end()) {
+        return; // Everyone here left the room meanwhile
+    }
+    std::vector<std::shared_ptr<Client>> changed;
+    Clock::time_point start = Clock::now();
+    uint64_t delivered = 0;
+
+    // With a flush window, members collect broadcasts and write them in
+    // one batch when the window closes
+    bool coalesce = server.config.flush_window_ms > 0;
+    Clock::time_point deadline;
+    if (coalesce) {
+        deadline = Clock::now() + std::chrono::milliseconds(server.config.flush_window_ms);
+    }
+
+    for (auto& member : members->second) {
+        const std::shared_ptr<Client>& client = member.first;
+        // Skip messages the client already got with its history replay
+        if (broadcast.seq <= member.second) {
+            continue;
+        }
+        if (coalesce && !client->isHolding()) {
+            client->holdWrites(deadline);
+            held_writes.emplace_back(deadline, client);
+        }
+        client->sendEncoded(broadcast.encoded);
+        metrics->queue_depth.record(client->getQueuedBytes());
+        delivered++;
+        if (!client->isRunning() || client->wantsWrite() != client->hasWriteInterest()) {
+            changed.push_back(client);
+        }
+    }
+    metrics->messages_delivered.add(delivered);
+
+    // Poller updates may drop clients, so apply them after iterating
+    for (auto& client : changed) {
+        updateInterest(client);
+    }
+    metrics->fan_out.record((uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        Clock::now() - start).count());
+}
+
+void Shard::acceptClients() {
+    // Take a bounded batch per wakeup so one busy listener cannot starve
+    // the connections that are already open
+    const int ACCEPT_BATCH = 64;
+
+    for (int i = 0; i < ACCEPT_BATCH; i++) {
+        struct sockaddr_in client_addr;
+        socklen_t client_size = sizeof(client_addr);
+        SOCKET client_socket = accept(listen_socket, (struct sockaddr *)&client_addr, &client_size);
+
+        if (client_socket == INVALID_SOCKET) {
+            if (!socketWouldBlock()) {
+                std::cerr << "Error accepting connection: " << WSAGetLastError() << std::endl;
+            }
+            return;
+        }
+
+        if (!setNonBlocking(client_socket) || !poller.add(client_socket, Poller::READABLE)) {
+            std::cerr << "Error registering connection: " << WSAGetLastError() << std::endl;
+            closesocket(client_socket);
+            continue;
+        }
+        addClient(client_socket, client_addr.sin_addr.s_addr == htonl(INADDR_LOOPBACK));
+    }
+}
+
+std::shared_ptr<Client> Shard::createClient(SOCKET socket, bool local) {
+    // Writes are already batched per client; Nagle would only delay the
+    // next one until the peer's delayed ACK
+    int no_delay = 1;
+    setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, (const char*)&no_delay, sizeof(no_delay));
+
+    std::shared_ptr<Client> client = std::allocate_shared<Client>(SlabAllocator<Client>(), socket, index,
+                                                                  server.config, *metrics);
+    client->setLocal(local);
+    connections[socket] = client;
+    metrics->connects.add(1);
+#ifdef HAVE_IO_URING
+    if (ring) {
+        client->setDeferredWrites(true);
+        RingConnection& connection = ring_connections[socket];
+        connection.client = client;
+        connection.operations = 1;
+        ring->recv(socket, ringData(RING_RECV, socket));
+    }
+#endif
+    return client;
+}
+
+void Shard::addClient(SOCKET socket, bool local) {
+    std::shared_ptr<Client> client = createClient(socket, local);
+    if (server.config.login_timeout_ms > 0) {
+        login_deadlines.emplace_back(
+            Clock::now() + std::chrono::milliseconds(server.config.login_timeout_ms), client);
+    }
+
+    // Ask for the username; the reply arrives through the event loop
+    client->sendText(PROMPT);
+    updateInterest(client);
+}
+
+// Unparsed input a throttled client may pile up (io_uring keeps receiving)
+static const size_t MAX_THROTTLED_INPUT = 1024 * 1024;
+
+void Shard::handleReadable(const std::shared_ptr<Client>& client) {
+    const size_t READ_CHUNK = 4096;
+    InputBuffer& input = client->getInput();
+    char* space = input.reserve(READ_CHUNK);
+    int bytes_read = recv(client->getSocket(), space, (int)READ_CHUNK, 0);
+
+    if (bytes_read < 0 && socketWouldBlock()) {
+        return;
+    }
+    if (bytes_read <= 0) {
+        // Client disconnected
+        disconnectClient(client);
+        return;
+    }
+    input.commit(bytes_read);
+    handleInput(client, bytes_read);
+}
+
+void Shard::handleInput(const std::shared_ptr<Client>& client, size_t bytes_read) {
+    InputBuffer& input = client->getInput();
+    read_time = Clock::now();
+    metrics->bytes_in.add(bytes_read);
+
+    // A leading zero byte (the top of a frame length) selects the framed protocol
+    if (client->getLoginState() == LoginState::AWAITING_PROTOCOL) {
+        bool framed = input.peek() == 0;
+        client->setWireMode(framed ? WireMode::FRAMED : WireMode::TEXT);
+        client->setLoginState(framed ? LoginState::AWAITING_HELLO : LoginState::AWAITING_USERNAME);
+    }
+
+    // Handle every complete message; a partial one stays buffered
+    if (client->isThrottled()) {
+        // Parsed once the budget allows. Only io_uring keeps receiving
+        // meanwhile; a sender that far ahead is cut off.
+        if (input.unparsed().size() > MAX_THROTTLED_INPUT) {
+            client->sendText("Sending too fast. Connection closed.\n");
+            metrics->rate_disconnects.add(1);
+            disconnectClient(client);
+        }
+        return;
+    }
+
+    // A message over a rate limit with the delay action goes back into
+    // the buffer, along with everything after it
+    InputBuffer::Result result = InputBuffer::NEED_MORE;
+    size_t mark = input.mark();
+    if (client->getWireMode() == WireMode::FRAMED) {
+        uint8_t type;
+        std::string_view payload;
+        while (client->isRunning() &&
+               (result = input.nextFrame(type, payload)) == InputBuffer::COMPLETE) {
+            if (type == FRAME_TEXT && client->isLoggedIn() && !admitInput(client, payload)) {
+                if (client->isThrottled()) {
+                    input.rewind(mark);
+                    break;
+                }
+            } else {
+                handleFrame(client, type, payload);
+            }
+            mark = input.mark();
+        }
+    } else {
+        std::string_view line;
+        while (client->isRunning() &&
+               (result = input.nextLine(line)) == InputBuffer::COMPLETE) {
+            if (client->isLoggedIn() && !admitInput(client, line)) {
+                if (client->isThrottled()) {
+                    input.rewind(mark);
+                    break;
+                }
+            } else {
+                handleLine(client, line);
+            }
+            mark = input.mark();
+        }
+    }
+
+    if (client->isRunning() && result == InputBuffer::INVALID) {
+        std::cerr << "Protocol error, closing connection" << std::endl;
+        disconnectClient(client);
+        return;
+    }
+    // Idle connections keep no read buffer
+    input.release();
+}
+
+bool Shard::admitInput(const std::shared_ptr<Client>& client, std::string_view message) {
+    const ServerConfig& config = server.config;
+    if (!config.rateLimited() || message.empty()) {
+        return true;
+    }
+    Clock::time_point now = Clock::now();
+    RateLimit& limit = client->getRateLimit();
+    Clock::duration wait = limit.wait(message.size(), now);
+    bool own_limit = wait > Clock::duration::zero();
+
+    // Chat lines also spend the room's budget; commands and direct
+    // messages only the sender's
+    std::shared_ptr<ChatRoom> room = client->getCurrentRoom();
+    if (!own_limit && room && message[0] != '/') {
+        wait = room->admit(message.size(), now);
+    }
+    if (wait == Clock::duration::zero()) {
+        limit.take(message.size());
+        client->setToldRate(false);
+        return true;
+    }
+
+    if (config.rate_action == RateAction::DELAY) {
+        client->throttle(now + wait);
+        throttled_clients.emplace(now + wait, client);
+        metrics->rate_delayed.add(1);
+        updateInterest(client);
+        return false;
+    }
+    if (config.rate_action == RateAction::DISCONNECT && own_limit) {
+        client->sendText("Sending too fast. Connection closed.\n");
+        metrics->rate_disconnects.add(1);
+        disconnectClient(client);
+        return false;
+    }
+    metrics->rate_dropped.add(1);
+    if (!client->wasToldRate()) {
+        client->sendText(own_limit ? "Sending too fast, messages are being dropped\n"
+                                   : "#" + room->getName() + " is too busy, messages are being dropped\n");
+        client->setToldRate(true);
+        updateInterest(client);
+    }
+    return false;
+}
+
+void Shard::handleWritable(const std::shared_ptr<Client>& client) {
+    if (!client->flush()) {
+        client->stop();
+    }
+    updateInterest(client);
+}
+
+void Shard::handleFrame(const std::shared_ptr<Client>& client, uint8_t type, std::string_view payload) {
+    // Until HELLO is through, nothing else is accepted
+    if ((client->getLoginState() == LoginState::AWAITING_HELLO) != (type == FRAME_HELLO)) {
+        disconnectClient(client);
+        return;
+    }
+
+    switch (type) {
+    case FRAME_HELLO: {
+        // Version 5 may add a flags byte
+        if (payload.empty() || (uint8_t)payload[0] < MIN_PROTOCOL_VERSION ||
+            payload.size() > ((uint8_t)payload[0] >= 5 ? 2u : 1u)) {
+            client->sendFrame(FRAME_NOTICE, "Protocol version " + std::to_string(MIN_PROTOCOL_VERSION) + " or newer required");
+            disconnectClient(client);
+            return;
+        }
+        // Speak the older of the two versions
+        uint8_t version = std::min((uint8_t)payload[0], PROTOCOL_VERSION);
+        std::string answer(1, (char)version);
+        bool deflate = false;
+        if (payload.size() == 2) {
+            // Grant what was asked for and this server supports
+#ifdef HAVE_ZLIB
+            deflate = ((uint8_t)payload[1] & HELLO_DEFLATE) && server.config.compress_level > 0;
+#endif
+            answer += (char)(deflate ? HELLO_DEFLATE : 0);
+        }
+        client->sendFrame(FRAME_HELLO, answer);
+        if (deflate && !client->startCompression(server.config.compress_level)) {
+            disconnectClient(client);
+            return;
+        }
+        client->setLoginState(LoginState::AWAITING_USERNAME);
+        updateInterest(client);
+        break;
+    }
+    case FRAME_TEXT:
+        handleLine(client, payload);
+        break;
+    case FRAME_RESUME: {
+        if (payload.size() < 8 || client->isLoggedIn()) {
+            disconnectClient(client);
+            return;
+        }
+        uint64_t seq = 0;
+        for (size_t i = 0; i < 8; i++) {
+            seq = (seq << 8) | (uint8_t)payload[i];
+        }
+        std::string_view room = payload.substr(8);
+        client->setResumeSeq(room.empty() ? DEFAULT_ROOM : std::string(room), seq);
+        break;
+    }
+    default:
+        disconnectClient(client);
+        break;
+    }
+}
+
+void Shard::handleLine(const std::shared_ptr<Client>& client, std::string_view line) {
+    if (!client->isLoggedIn()) {
+        handleLogin(client, line);
+    } else {
+        handleClientInput(client, line);
+    }
+}
+
+void Shard::handleLogin(const std::shared_ptr<Client>& client, std::string_view name) {
+    std::string username(name);
+    if (server.config.verbose) {
+        std::cout << "Received username: '" << username << "'" << std::endl;
+    }
+
+    // /msg takes the name up to the first space and "@name" is its room
+    if (!validUsername(username)) {
+        client->sendText("Usernames are 1-32 letters, digits, '-' or '_'. Connection closed.\n");
+        disconnectClient(client);
+        return;
+    }
+
+    // Check if username already exists
+    if (!server.registerClient(client, username)) {
+        client->sendText("Username already taken. Connection closed.\n");
+        disconnectClient(client);
+        return;
+    }
+
+    client->sendText("Welcome to the chat server, " + username + "!\n");
+
+    // Everyone starts out in the default room
+    joinRoom(client, server.lobby, true);
+    client->setCurrentRoom(server.lobby);
+    updateInterest(client);
+
+    if (server.config.verbose) {
+        std::cout << "New client connected: " << username << std::endl;
+    }
+}
+
+void Shard::joinRoom(const std::shared_ptr<Client>& client, const std::shared_ptr<ChatRoom>& room,
+                     bool announce) {
+    auto& members = room_members[room.get()];
+    if (members.find(client) != members.end()) {
+        return;
+    }
+
+    // Subscribe before taking the snapshot: messages sequenced after it
+    // are then routed here and arrive live, older ones are replayed
+    room->subscribe(index);
+    client->addRoom(room);
+    HistorySnapshot history = room->getHistory();
+    uint64_t end_seq = history.lastSeq() + 1;
+    members[client] = end_seq - 1;
+
+    // Send the chat history the client does not have yet
+    uint64_t from_seq = client->getResumeSeq(room->getName()) + 1;
+    std::vector<FileRange> ranges;
+    // (compressed connections need the bytes, so they skip the log)
+    if (client->getWireMode() == WireMode::FRAMED && !client->isCompressing() &&
+        room->streamHistory(history, from_seq, end_seq, ranges)) {
+        // The log already holds RECORD frames, send them as they are
+        for (const auto& range : ranges) {
+            client->sendFile(range);
+        }
+    } else {
+        history.forEachFrom(from_seq, [&](const Message& msg) {
+            client->sendMessage(msg);
+        });
+    }
+
+    if (announce) {
+        server.handleClientMessage(room, serverName(), client->getUsername() + " has joined the chat");
+    }
+}
+
+void Shard::leaveRoom(const std::shared_ptr<Client>& client, const std::shared_ptr<ChatRoom>& room,
+                      bool announce) {
+    auto members = room_members.find(room.get());
+    if (members == room_members.end() || members->second.erase(client) == 0) {
+        return;
+    }
+    if (members->second.empty()) {
+        room_members.erase(members);
+    }
+    room->unsubscribe(index);
+    client->removeRoom(room);
+
+    if (announce) {
+        server.handleClientMessage(room, serverName(), client->getUsername() + " has left the chat");
+    }
+}
+
+void Shard::handleClientInput(const std::shared_ptr<Client>& client, std::string_view message) {
+    // Process command or message
+    if (message.compare(0, 5, "/help") == 0) {
+        client->sendText("Available commands:\n"
+                         "/help - Show this help\n"
+                         "/join <room> - Join a room and talk there\n"
+                         "/subscribe <room> - Receive a room's messages\n"
+                         "/leave [room] - Leave a room (default: the current one)\n"
+                         "/rooms - List your rooms\n"
+                         "/search <words> [from:user] - Find messages in the current room\n"
+                         "/msg <user> <text> - Send a private message\n"
+                         "/stats - Server metrics (local connections only)\n"
+                         "/exit - Exit the chat\n");
+        updateInterest(client);
+    }
+    else if (message == "/stats" && client->isLocal()) {
+        client->sendText(formatMetrics());
+        updateInterest(client);
+    }
+    else if (message.compare(0, 5, "/msg ") == 0) {
+        handleDirectMessage(client, message.substr(5));
+    }
+    else if (!message.empty() && message[0] == '/') {
+        size_t space = message.find(' ');
+        std::string_view command = message.substr(0, space);
+        std::string_view argument = space == std::string_view::npos ? std::string_view() : message.substr(space + 1);
+        handleRoomCommand(client, command, argument);
+    }
+    else if (!message.empty()) {
+        std::shared_ptr<ChatRoom> room = client->getCurrentRoom();
+        if (!room) {
+            client->sendText("You are not in a room, use /join <room>\n");
+            updateInterest(client);
+            return;
+        }
+        // Broadcast to the room's members
+        server.handleClientMessage(room, client->getName(), message);
+        metrics->messages_received.add(1);
+        metrics->recv_to_enqueue.record((uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+            Clock::now() - read_time).count());
+    }
+}
+
+void Shard::handleDirectMessage(const std::shared_ptr<Client>& client, std::string_view argument) {
+    size_t space = argument.find(' ');
+    std::shared_ptr<Client> target;
+    std::string name;
+    if (space != std::string_view::npos && space + 1 < argument.size()) {
+        name = std::string(argument.substr(0, space));
+        target = server.clients.find(name);
+    }
+    // A user on another node gets it through the cluster
+    bool remote = !target && !name.empty() && server.cluster && server.cluster->isRemoteUser(name);
+    if (!target && !remote) {
+        client->sendText(space == std::string_view::npos ? "Usage: /msg <user> <text>\n" : "No such user\n");
+        updateInterest(client);
+        return;
+    }
+
+    // Not part of any room: no sequence id and no history. Both sides get
+    // the same encoded bytes.
+    metrics->messages_received.add(1);
+    Message msg(client->getName(), argument.substr(space + 1));
+    msg.room = intern("@" + name);
+    Broadcast direct = {nullptr, 0, msg.encode(), target};
+
+    if (remote) {
+        server.cluster->relay(direct.encoded);
+        client->sendEncoded(direct.encoded);
+        updateInterest(client);
+        return;
+    }
+
+    if (target->getShard() == index) {
+        deliver(direct);
+    } else {
+        server.shards[target->getShard()]->post(direct);
+    }
+    if (target != client) {
+        client->sendEncoded(direct.encoded);
+        updateInterest(client);
+    }
+}
+
+// Newest matches a /search shows
+static const size_t SEARCH_RESULTS = 20;
+
+bool validRoomName(std::string_view name) {
+    if (name.empty() || name.size() > 32) {
+        return false;
+    }
+    for (char c : name) {
+        if (!isalnum((unsigned char)c) && c != '-' && c != '_') {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool validUsername(std::string_view name) {
+    return validRoomName(name);
+}
+
+void Shard::handleRoomCommand(const std::shared_ptr<Client>& client, std::string_view command,
+                              std::string_view argument) {
+    if (command == "/rooms") {
+        std::string list = "Your rooms:";
+        for (const auto& room : client->getRooms()) {
+            list += room == client->getCurrentRoom() ? " *" : " ";
+            list += room->getName();
+        }
+        client->sendText(list + "\n");
+    }
+    else if (command == "/join" || command == "/subscribe") {
+        if (!validRoomName(argument)) {
+            client->sendText("Room names are 1-32 letters, digits, '-' or '_'\n");
+        } else {
+            std::shared_ptr<ChatRoom> room = server.openRoom(std::string(argument));
+            joinRoom(client, room, command == "/join");
+            if (command == "/join") {
+                client->setCurrentRoom(room);
+                client->sendText("Now talking in #" + room->getName() + "\n");
+            } else {
+                client->sendText("Subscribed to #" + room->getName() + "\n");
+            }
+        }
+    }
+    else if (command == "/search") {
+        std::vector<std::string> words;
+        std::string sender;
+        std::shared_ptr<ChatRoom> room = client->getCurrentRoom();
+        if (!SearchIndex::parseQuery(argument, words, sender)) {
+            client->sendText("Usage: /search <words> [from:user]\n");
+        } else if (!room) {
+            client->sendText("You are not in a room, use /join <room>\n");
+        } else {
+            std::vector<Message> found = room->search(words, sender, SEARCH_RESULTS);
+            std::string reply = found.empty() ? "No matches in #" + room->getName() + "\n"
+                                              : "Matches in #" + room->getName() + ":\n";
+            for (const auto& msg : found) {
+                msg.appendFormatted(reply);
+                reply += '\n';
+            }
+            if (found.size() == SEARCH_RESULTS) {
+                reply += "Showing the newest " + std::to_string(SEARCH_RESULTS) + ", add words to narrow it down\n";
+            }
+            client->sendText(reply);
+        }
+    }
+    else if (command == "/leave") {
+        std::shared_ptr<ChatRoom> room = argument.empty() ? client->getCurrentRoom()
+                                                          : server.rooms.find(std::string(argument));
+        const auto& joined = client->getRooms();
+        if (!room || std::find(joined.begin(), joined.end(), room) == joined.end()) {
+            client->sendText("You are not in that room\n");
+        } else {
+            leaveRoom(client, room, true);
+            client->sendText("Left #" + room->getName() + "\n");
+        }
+    }
+    else {
+        client->sendText("Unknown command, see /help\n");
+    }
+    updateInterest(client);
+}
+
+void Shard::updateInterest(const std::shared_ptr<Client>& client) {
+    if (!client->isRunning()) {
+        disconnectClient(client);
+        return;
+    }
+#ifdef HAVE_IO_URING
+    if (ring) {
+        // Queued sends go to the kernel with the next wait, all at once
+        if (client->wantsWrite() && !client->hasWriteInterest()) {
+            submitWrite(client);
+        }
+        return;
+    }
+#endif
+
+    // Watch for writability only while data is queued, and for input
+    // unless the client is over its rate limit
+    bool want_write = client->wantsWrite();
+    bool want_read = !client->isThrottled();
+    if (want_write != client->hasWriteInterest() || want_read != client->hasReadInterest()) {
+        int events = (want_read ? Poller::READABLE : 0) | (want_write ? Poller::WRITABLE : 0);
+        poller.modify(client->getSocket(), events);
+        client->setWriteInterest(want_write);
+        client->setReadInterest(want_read);
+    }
+}
+
+void Shard::disconnectClient(const std::shared_ptr<Client>& client) {
+    SOCKET socket = client->getSocket();
+    if (connections.find(socket) == connections.end()) {
+        return;
+    }
+
+    client->stop();
+#ifdef HAVE_IO_URING
+    if (ring) {
+        // Last notice if possible, then end the operations in flight; the
+        // socket closes once the kernel has finished with them
+        client->flush();
+        shutdown(socket, SHUT_RDWR);
+    } else
+#endif
+    poller.remove(socket);
+    metrics->disconnects.add(1);
+
+    // Copy: leaving removes the room from the client's list
+    std::vector<std::shared_ptr<ChatRoom>> joined = client->getRooms();
+    for (const auto& room : joined) {
+        leaveRoom(client, room, false);
+    }
+
+    if (client->isLoggedIn()) {
+        server.unregisterClient(client);
+        if (server.config.verbose) {
+            std::cout << "Client disconnected: " << client->getUsername() << std::endl;
+        }
+    }
+
+    // Last reference closes the socket
+    connections.erase(socket);
+#ifdef HAVE_IO_URING
+    auto pending = ring_connections.find(socket);
+    if (pending != ring_connections.end() && pending->second.operations == 0) {
+        ring_connections.erase(pending);
+    }
+#endif
+}
+
+#ifdef HAVE_IO_URING
+void Shard::ringLoop() {
+    std::vector<IoRing::Completion> completions;
+    ring->accept(listen_socket, ringData(RING_ACCEPT, listen_socket));
+
+    while (running) {
+        ring->wait(completions, nextTimeout());
+        for (const auto& completion : completions) {
+            handleCompletion(completion);
+        }
+
+        drainInbox();
+        flushHeldWrites();
+        resumeThrottled();
+        expireLogins();
+    }
+    drainRing();
+}
+
+void Shard::handleCompletion(const IoRing::Completion& completion) {
+    RingOperation operation = (RingOperation)(completion.user_data >> 32);
+    SOCKET socket = (SOCKET)(uint32_t)completion.user_data;
+    bool more = (completion.flags & IORING_CQE_F_MORE) != 0;
+
+    if (operation == RING_ACCEPT) {
+        if (completion.res >= 0) {
+            struct sockaddr_in addr;
+            socklen_t addr_size = sizeof(addr);
+            bool local = getpeername(completion.res, (struct sockaddr *)&addr, &addr_size) == 0 &&
+                         addr.sin_addr.s_addr == htonl(INADDR_LOOPBACK);
+            addClient(completion.res, local);
+        } else if (completion.res != -EAGAIN && completion.res != -EINTR) {
+            std::cerr << "Error accepting connection: " << -completion.res << std::endl;
+        }
+        if (!more) {
+            ring->accept(listen_socket, ringData(RING_ACCEPT, listen_socket));
+        }
+        return;
+    }
+
+    auto it = ring_connections.find(socket);
+    if (it == ring_connections.end()) {
+        ring->recycle(completion);
+        return;
+    }
+    std::shared_ptr<Client> client = it->second.client;
+    auto connected = [&]() {
+        auto open = connections.find(socket);
+        return open != connections.end() && open->second == client;
+    };
+
+    switch (operation) {
+    case RING_RECV:
+        if (completion.res > 0 && connected()) {
+            InputBuffer& input = client->getInput();
+            memcpy(input.reserve(completion.res), ring->buffer(completion), completion.res);
+            input.commit(completion.res);
+            ring->recycle(completion);
+            handleInput(client, completion.res);
+        } else {
+            ring->recycle(completion);
+            // Out of buffers just ends the multishot receive; anything else is
+            // the end of the connection
+            if (completion.res != -ENOBUFS && connected()) {
+                disconnectClient(client);
+            }
+        }
+        if (!more && connected()) {
+            ring->recv(socket, ringData(RING_RECV, socket));
+            return; // Still one receive in flight
+        }
+        break;
+    case RING_SEND:
+        client->setWriteInterest(false);
+        client->completeSend(completion.res > 0 ? completion.res : 0);
+        if (completion.res < 0) {
+            client->stop();
+        }
+        if (connected()) {
+            updateInterest(client);
+        }
+        break;
+    case RING_POLL:
+        client->setWriteInterest(false);
+        if (connected()) {
+            updateInterest(client);
+        }
+        break;
+    default:
+        break;
+    }
+    if (!more) {
+        finishOperation(socket);
+    }
+}
+
+void Shard::submitWrite(const std::shared_ptr<Client>& client) {
+    SOCKET socket = client->getSocket();
+    RingConnection& connection = ring_connections[socket];
+
+    int count = client->beginSend(connection.slices, RING_SEND_SLICES);
+    if (count > 0) {
+        memset(&connection.msg, 0, sizeof(connection.msg));
+        connection.msg.msg_iov = connection.slices;
+        connection.msg.msg_iovlen = count;
+        ring->sendmsg(socket, &connection.msg, ringData(RING_SEND, socket));
+    } else {
+        // A log file range is first: sendfile() it now and wait for room
+        // if the socket fills up
+        if (!client->flush()) {
+            disconnectClient(client);
+            return;
+        }
+        if (!client->wantsWrite()) {
+            return;
+        }
+        ring->pollWritable(socket, ringData(RING_POLL, socket));
+    }
+    connection.operations++;
+    client->setWriteInterest(true);
+}
+
+void Shard::finishOperation(SOCKET socket) {
+    auto it = ring_connections.find(socket);
+    if (it == ring_connections.end()) {
+        return;
+    }
+    it->second.operations--;
+    if (it->second.operations <= 0 && connections.find(socket) == connections.end()) {
+        // Drops the last reference, which closes the socket
+        ring_connections.erase(it);
+    }
+}
+
+void Shard::drainRing() {
+    // The kernel may still use send buffers: end every connection and
+    // collect the outstanding completions (bounded, in case one hangs)
+    for (auto& entry : ring_connections) {
+        entry.second.client->stop();
+        shutdown(entry.first, SHUT_RDWR);
+    }
+    std::vector<IoRing::Completion> completions;
+    Clock::time_point give_up = Clock::now() + std::chrono::seconds(1);
+    while (Clock::now() < give_up) {
+        bool busy = false;
+        for (const auto& entry : ring_connections) {
+            busy = busy || entry.second.operations > 0;
+        }
+        if (!busy) {
+            break;
+        }
+        ring->wait(completions, 100);
+        for (const auto& completion : completions) {
+            ring->recycle(completion);
+            auto it = ring_connections.find((SOCKET)(uint32_t)completion.user_data);
+            if ((completion.user_data >> 32) != RING_ACCEPT && !(completion.flags & IORING_CQE_F_MORE) &&
+                it != ring_connections.end()) {
+                it->second.operations--;
+            }
+        }
+    }
+    ring_connections.clear();
+}
+#endif
+
+// Sequencer implementation
+Sequencer::Sequencer(ChatServer& owner) : server(owner), metrics(nullptr), running(false), sleeping(false) {
+}
+
+Sequencer::~Sequencer() {
+    stop();
+}
+
+void Sequencer::start() {
+    running = true;
+    sequencer_thread = std::thread(&Sequencer::run, this);
+}
+
+void Sequencer::stop() {
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        running = false;
+        sleep_cv.notify_one();
+    }
+    if (sequencer_thread.joinable()) {
+        sequencer_thread.join();
+    }
+}
+
+void Sequencer::submit(const std::shared_ptr<ChatRoom>& room, Message msg, bool relay) {
+    queue.push(Entry{room, std::move(msg), std::chrono::steady_clock::now(), relay});
+    threadMetrics().messages_enqueued.add(1);
+
+    // Pairs with the fence in run(): either the sequencer sees the new
+    // entry before parking, or we see it parked and wake it
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleeping.load(std::memory_order_relaxed)) {
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        sleep_cv.notify_one();
+    }
+}
+
+size_t Sequencer::drain(size_t max_batch, std::vector<std::vector<Broadcast>>& batches) {
+    size_t count = 0;
+    Entry entry;
+    while (count < max_batch && queue.pop(entry)) {
+        SharedBuffer encoded = entry.room->addMessage(entry.msg);
+        metrics->messages_sequenced.add(1);
+        metrics->enqueue_to_history.record((uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - entry.queued).count());
+        if (entry.relay && server.cluster) {
+            server.cluster->relay(encoded);
+        }
+
+        RcuReadGuard guard;
+        for (int shard : entry.room->memberShards()) {
+            if ((size_t)shard < batches.size()) {
+                batches[shard].push_back(Broadcast{entry.room, entry.msg.seq, encoded, nullptr});
+            }
+        }
+        count++;
+    }
+    return count;
+}
+
+void Sequencer::run() {
+    // Bounds how long a burst can delay the first delivery
+    const size_t MAX_BATCH = 256;
+    std::vector<std::vector<Broadcast>> batches(server.shards.size());
+    metrics = &threadMetrics();
+
+    while (true) {
+        size_t count = drain(MAX_BATCH, batches);
+
+        // One inbox lock and at most one wakeup per shard and batch
+        for (size_t i = 0; i < batches.size(); i++) {
+            if (!batches[i].empty()) {
+                server.shards[i]->post(batches[i]);
+            }
+        }
+        if (count > 0) {
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(sleep_mutex);
+        if (!running) {
+            break;
+        }
+        sleeping.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (queue.empty()) {
+            sleep_cv.wait(lock);
+        }
+        sleeping.store(false, std::memory_order_relaxed);
+    }
+}
+
+// ChatServer implementation
+ChatServer::ChatServer(const ServerConfig& server_config)
+    : config(server_config), running(false), sequencer(*this), stop_requested(false) {
+}
+
+ChatServer::~ChatServer() {
+    stop();
+}
+
+bool ChatServer::start() {
+    // Initialize sockets
+    if (!initSockets()) {
+        std::cerr << "WSAStartup failed" << std::endl;
+        return false;
+    }
+
+    // A successor inherits the listeners, and so the shard count
+    std::unique_ptr<HandoffChannel> predecessor;
+    std::vector<SOCKET> listeners;
+    int shard_count = config.shards;
+    if (config.takeover) {
+        predecessor.reset(new HandoffChannel(HandoffChannel::connectTo(config.handoff_path)));
+        predecessor->setTimeout(HANDOFF_TIMEOUT_MS);
+        if (!predecessor->valid() || !beginTakeover(*predecessor, listeners)) {
+            std::cerr << "Taking over from " << config.handoff_path << " failed" << std::endl;
+            cleanupSockets();
+            return false;
+        }
+        shard_count = (int)listeners.size();
+    }
+    if (shard_count <= 0) {
+        shard_count = std::max(1u, std::thread::hardware_concurrency());
+    }
+#ifndef SO_REUSEPORT
+    if (shard_count > 1) {
+        std::cerr << "SO_REUSEPORT is not supported here, using a single shard" << std::endl;
+        shard_count = 1;
+    }
+#endif
+
+    // Create the default room
+    lobby = openRoom(DEFAULT_ROOM);
+
+    for (int i = 0; i < shard_count; i++) {
+        shards.push_back(std::unique_ptr<Shard>(new Shard(*this, i)));
+        bool listening = listeners.empty() ? shards.back()->listen(config.port, shard_count > 1)
+                                           : shards.back()->adoptListener(listeners[i]);
+        if (!listening) {
+            shards.clear();
+            cleanupSockets();
+            return false;
+        }
+    }
+
+    size_t adopted = 0;
+    if (predecessor && !receiveState(*predecessor, adopted)) {
+        std::cerr << "Incomplete state from " << config.handoff_path << std::endl;
+        cluster.reset();
+        shards.clear();
+        cleanupSockets();
+        return false;
+    }
+
+    // Created before the threads that use it start
+    bool handed_cluster = cluster != nullptr;
+    if (config.clustered() && !startCluster()) {
+        shards.clear();
+        cleanupSockets();
+        return false;
+    }
+    if (cluster && predecessor && !handed_cluster) {
+        // The previous process was not a cluster node: announce its users
+        clients.forEach([this](const std::string& username, const std::shared_ptr<Client>&) {
+            cluster->announceLogin(username);
+        });
+    }
+
+    if (predecessor) {
+        // Ready: once the old process confirms and exits the connections
+        // are ours. Without the confirmation it keeps serving them.
+        uint8_t type;
+        std::string payload;
+        if (!predecessor->send(HANDOFF_DONE, std::string_view()) || !predecessor->flush() ||
+            !predecessor->next(type, payload) || type != HANDOFF_DONE) {
+            std::cerr << "The previous process did not confirm the takeover" << std::endl;
+            cluster.reset();
+            shards.clear();
+            cleanupSockets();
+            return false;
+        }
+        predecessor.reset();
+    }
+
+    std::cout << "Server is running on port " << config.port
+              << " with " << shard_count << " shard(s) using " << shards[0]->backendName() << std::endl;
+    running = true;
+    startThreads();
+    if (cluster) {
+        std::cout << "Cluster node " << config.node_id;
+        if (config.cluster_port > 0) {
+            std::cout << " accepting peers on port " << config.cluster_port;
+        }
+        std::cout << ", " << config.peers.size() << " peer(s) to dial" << std::endl;
+    }
+    if (config.takeover) {
+        std::cout << "Took over " << adopted << " connection(s) from the previous process" << std::endl;
+    }
+    if (startMetrics()) {
+        std::cout << "Metrics on http://127.0.0.1:" << config.metrics_port << "/metrics" << std::endl;
+    }
+
+    if (!config.handoff_path.empty() &&
+        handoff_endpoint.listen(config.handoff_path, [this](SOCKET channel) { return handOff(channel); })) {
+        handoff_endpoint.start();
+        std::cout << "Hot restart through " << config.handoff_path << std::endl;
+    }
+    return true;
+}
+
+bool ChatServer::startCluster() {
+    // A successor already has the one it was handed (receiveState())
+    if (!cluster) {
+        cluster.reset(new Cluster(*this, config.node_id, config.cluster_port, config.peers));
+    }
+    if (!cluster->listen()) {
+        cluster.reset();
+        return false;
+    }
+    return true;
+}
+
+void ChatServer::startThreads() {
+    sequencer.start();
+    for (auto& shard : shards) {
+        shard->start();
+    }
+    if (cluster) {
+        cluster->start();
+    }
+}
+
+bool ChatServer::startMetrics() {
+    if (config.metrics_port > 0 && metrics_endpoint.listen(config.metrics_port)) {
+        metrics_endpoint.start();
+        return true;
+    }
+    return false;
+}
+
+void ChatServer::wait() {
+    std::unique_lock<std::mutex> lock(stop_mutex);
+    stop_cv.wait(lock, [this]() { return stop_requested; });
+}
+
+void ChatServer::requestStop() {
+    std::lock_guard<std::mutex> lock(stop_mutex);
+    stop_requested = true;
+    stop_cv.notify_all();
+}
+
+bool ChatServer::beginTakeover(HandoffChannel& predecessor, std::vector<SOCKET>& listeners) {
+    uint8_t type;
+    std::string payload;
+    std::string hello(1, (char)HANDOFF_VERSION);
+    if (!predecessor.send(HANDOFF_HELLO, hello) || !predecessor.flush() ||
+        !predecessor.next(type, payload) || type != HANDOFF_HELLO) {
+        return false; // It refused (see its output)
+    }
+    std::string_view reply(payload);
+    uint64_t shard_count;
+    if (reply.empty() || (uint8_t)reply[0] != HANDOFF_VERSION) {
+        return false;
+    }
+    reply.remove_prefix(1);
+    if (!getVarint(reply, shard_count) || shard_count == 0 ||
+        !predecessor.next(type, payload) || type != HANDOFF_LISTENERS) {
+        return false;
+    }
+    if (config.shards != (int)shard_count) {
+        std::cout << "Using the previous process's " << shard_count << " shard(s)" << std::endl;
+    }
+    return predecessor.takeSockets(shard_count, listeners);
+}
+
+bool ChatServer::receiveState(HandoffChannel& predecessor, size_t& adopted) {
+    uint8_t type;
+    std::string payload;
+    std::shared_ptr<ChatRoom> room;
+    while (predecessor.next(type, payload)) {
+        std::string_view in(payload);
+        switch (type) {
+        case HANDOFF_ROOM: {
+            uint64_t last_seq;
+            room.reset();
+            if (getVarint(in, last_seq) && validRoomName(in)) {
+                room = openRoom(std::string(in));
+                room->resumeAfter(last_seq);
+            }
+            break;
+        }
+        case HANDOFF_RECORD: {
+            Message msg;
+            if (room && decodeRecord(in, msg)) {
+                room->restoreMessage(msg); // Copies the text out of payload
+            }
+            break;
+        }
+        case HANDOFF_CONNECTIONS: {
+            uint64_t count;
+            std::vector<ConnectionState> states;
+            std::vector<SOCKET> sockets;
+            if (!getVarint(in, count) || !predecessor.takeSockets(count, sockets)) {
+                return false;
+            }
+            for (uint64_t i = 0; i < count; i++) {
+                ConnectionState state;
+                if (!parseConnectionState(in, state)) {
+                    for (uint64_t j = i; j < count; j++) {
+                        closesocket(sockets[j]);
+                    }
+                    return false;
+                }
+                state.socket = sockets[i];
+                shards[state.shard % shards.size()]->adopt(std::move(state));
+                adopted++;
+            }
+            break;
+        }
+        case HANDOFF_CLUSTER: {
+            uint64_t count;
+            std::vector<SOCKET> sockets;
+            if (!getVarint(in, count) || count > 1 || !predecessor.takeSockets(count, sockets)) {
+                return false;
+            }
+            SOCKET listener = sockets.empty() ? INVALID_SOCKET : sockets[0];
+            if (!config.clustered()) {
+                if (listener != INVALID_SOCKET) {
+                    closesocket(listener);
+                }
+                break;
+            }
+            // startCluster() goes on with this one
+            cluster.reset(new Cluster(*this, config.node_id, config.cluster_port, config.peers));
+            if (!cluster->restoreState(in, listener)) {
+                return false;
+            }
+            break;
+        }
+        case HANDOFF_RELAYED:
+            if (cluster && !cluster->restoreRelayed(in)) {
+                return false;
+            }
+            break;
+        case HANDOFF_DONE:
+            return true;
+        default:
+            break;
+        }
+    }
+    return false;
+}
+
+bool ChatServer::handOff(SOCKET channel) {
+    HandoffChannel successor(channel);
+    uint8_t type;
+    std::string payload;
+    if (!successor.next(type, payload) || type != HANDOFF_HELLO || payload.empty() ||
+        (uint8_t)payload[0] != HANDOFF_VERSION) {
+        std::cerr << "Ignoring a takeover request with an unknown version" << std::endl;
+        return false;
+    }
+    if (shards.empty() || shards[0]->usingRing()) {
+        // Receives in flight would consume client input
+        std::cerr << "Hot restart is only supported with --io poll" << std::endl;
+        return false;
+    }
+    std::cout << "Handing over to a new process" << std::endl;
+    successor.setTimeout(HANDOFF_TIMEOUT_MS);
+
+    // Quiesce: no more input, every queued message sequenced and routed,
+    // and the ports the successor binds again released. Nothing else
+    // changes until the successor confirms, so a failed takeover resumes.
+    metrics_endpoint.close();
+    if (cluster) {
+        cluster->stop();
+    }
+    for (auto& shard : shards) {
+        shard->pause();
+    }
+    sequencer.stop();
+
+    std::string hello(1, (char)HANDOFF_VERSION);
+    putVarint(hello, shards.size());
+    std::string count;
+    putVarint(count, shards.size());
+    std::vector<SOCKET> listeners;
+    for (const auto& shard : shards) {
+        listeners.push_back(shard->getListenSocket());
+    }
+    bool sent = successor.send(HANDOFF_HELLO, hello) && successor.send(HANDOFF_LISTENERS, std::string_view(), listeners);
+
+    // The history goes along; with --log-dir the successor also reopens the
+    // log, complete once written out here, and skips what it already has
+    rooms.forEach([&](const std::string& name, const std::shared_ptr<ChatRoom>& room) {
+        room->flushLog();
+        std::string header;
+        putVarint(header, room->lastSeq());
+        header += name;
+        sent = sent && successor.send(HANDOFF_ROOM, header);
+        room->getHistory().forEach([&](const Message& msg) {
+            size_t length = recordLength(*msg.encoded);
+            sent = sent && successor.send(HANDOFF_RECORD, std::string_view(msg.encoded->data() + FRAME_HEADER_SIZE,
+                                                                           length - FRAME_HEADER_SIZE));
+        });
+    });
+
+    size_t handed = 0;
+    for (const auto& shard : shards) {
+        std::vector<ConnectionState> states;
+        shard->exportConnections(states);
+        for (size_t first = 0; first < states.size() && sent; first += HandoffChannel::MAX_SOCKETS_PER_FRAME) {
+            size_t last = std::min(states.size(), first + HandoffChannel::MAX_SOCKETS_PER_FRAME);
+            std::string batch;
+            std::vector<SOCKET> sockets;
+            putVarint(batch, last - first);
+            for (size_t i = first; i < last; i++) {
+                appendConnectionState(batch, states[i]);
+                sockets.push_back(states[i].socket);
+            }
+            sent = successor.send(HANDOFF_CONNECTIONS, batch, sockets);
+            handed += last - first;
+        }
+    }
+
+    // After the connections, so the successor's logins announce nothing:
+    // it continues our relay sequences, origins and users as is
+    if (cluster) {
+        std::string state;
+        std::vector<std::string> relayed;
+        std::vector<SOCKET> listener;
+        if (cluster->getListenSocket() != INVALID_SOCKET) {
+            listener.push_back(cluster->getListenSocket());
+        }
+        putVarint(state, listener.size());
+        cluster->exportState(state, relayed);
+        sent = sent && successor.send(HANDOFF_CLUSTER, state, listener);
+        for (const auto& entry : relayed) {
+            sent = sent && successor.send(HANDOFF_RELAYED, entry);
+        }
+    }
+    sent = sent && successor.send(HANDOFF_DONE, std::string_view()) && successor.flush();
+
+    // The successor answers once it is ready and starts serving on our
+    // confirmation. Our copies of the sockets close when we exit; the
+    // connections stay open in the successor.
+    if (sent && successor.next(type, payload) && type == HANDOFF_DONE &&
+        successor.send(HANDOFF_DONE, std::string_view()) && successor.flush()) {
+        std::cout << "Handed " << handed << " connection(s) over, exiting" << std::endl;
+        requestStop();
+        return true;
+    }
+
+    // Links and the cluster port stayed open, peers only see a pause
+    std::cerr << "The new process did not take over, serving on" << std::endl;
+    startThreads();
+    startMetrics();
+    return false;
+}
+
+void ChatServer::stop() {
+    if (!running) {
+        return;
+    }
+    running = false;
+    handoff_endpoint.stop();
+    metrics_endpoint.stop();
+    if (cluster) {
+        cluster->stop();
+    }
+
+    // Stop every loop before tearing down, shards post to each other
+    for (auto& shard : shards) {
+        shard->stop();
+    }
+    // Messages still queued go to history and the log
+    sequencer.stop();
+    cluster.reset();
+    shards.clear();
+
+    clients.clear();
+    rooms.clear();
+    lobby.reset();
+
+    cleanupSockets();
+    std::cout << "Outbound queues: " << metricTotal(&ThreadMetrics::dropped_messages) << " dropped, "
+              << metricTotal(&ThreadMetrics::coalesced_messages) << " coalesced, "
+              << metricTotal(&ThreadMetrics::overflow_disconnects) << " slow clients disconnected, peak "
+              << metricMax(&ThreadMetrics::peak_queue_bytes) << " bytes" << std::endl;
+    if (config.rateLimited()) {
+        std::cout << "Rate limits: " << metricTotal(&ThreadMetrics::rate_delayed) << " delays, "
+                  << metricTotal(&ThreadMetrics::rate_dropped) << " messages dropped, "
+                  << metricTotal(&ThreadMetrics::rate_disconnects) << " clients disconnected" << std::endl;
+    }
+    if (uint64_t compressed = metricTotal(&ThreadMetrics::deflate_in)) {
+        std::cout << "Compression: " << compressed << " bytes sent as "
+                  << metricTotal(&ThreadMetrics::deflate_out) << std::endl;
+    }
+    std::cout << "Server stopped" << std::endl;
+}
+
+bool ChatServer::registerClient(const std::shared_ptr<Client>& client, const std::string& username) {
+    // A name used on another node is taken too (gossiped, so two nodes
+    // may still accept one name at once; Cluster settles that)
+    if (username.empty() || (cluster && cluster->isRemoteUser(username)) || !clients.insert(username, client)) {
+        return false;
+    }
+    client->login(username);
+    if (cluster) {
+        cluster->announceLogin(username);
+    }
+    return true;
+}
+
+void ChatServer::unregisterClient(const std::shared_ptr<Client>& client) {
+    clients.erase(client->getUsername(), client);
+    if (cluster) {
+        cluster->announceLogout(client->getUsername());
+    }
+}
+
+std::shared_ptr<ChatRoom> ChatServer::openRoom(const std::string& name) {
+    std::shared_ptr<ChatRoom> room = rooms.findOrCreate(name, [&]() {
+        auto created = std::make_shared<ChatRoom>(name, config.history_messages, config.history_bytes);
+        created->setRateLimit(config.room_rate_messages, config.room_rate_bytes);
+        return created;
+    });
+    // The log replay runs outside the registry's stripe lock
+    room->prepare([&]() {
+        if (!config.log_dir.empty()) {
+            std::unique_ptr<MessageLog> log(new MessageLog(config.log_dir + "/" + name,
+                                                           config.log_segment_bytes, config.log_commit_ms));
+            if (!room->attachLog(std::move(log))) {
+                std::cerr << "Continuing without the message log for " << name << std::endl;
+            }
+        }
+    });
+    return room;
+}
+
+void ChatServer::handleClientMessage(const std::shared_ptr<ChatRoom>& room, const Name& sender,
+                                     std::string_view message) {
+    // The sequencer orders, stores and broadcasts it
+    sequencer.submit(room, Message(sender, message));
+}
@@ -4,85 +4,831 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <unordered_map>
+#include <deque>
 #include <thread>
 #include <mutex>
 #include <atomic>
+#include <condition_variable>
 #include <memory>
 #include <functional>
 #include <sstream>
-#include <winsock2.h>
-#include <ws2tcpip.h>
+#include <chrono>
+#include <string_view>
+#include "platform.h"
+#include "poller.h"
+#include "protocol.h"
+#include "message_log.h"
+#include "mpsc_queue.h"
+#include "pool.h"
+#include "rcu.h"
+#include "metrics.h"
+#include "io_ring.h"
+#include "handoff.h"
+#include "search_index.h"
+#include "rate_limit.h"
+#include "compression.h"
 
 // Forward declarations
 class Client;
 class ChatRoom;
+class Cluster;
+
+// Room every client joins at login
+const char* const DEFAULT_ROOM = "lobby";
+
+// Immutable wire bytes shared by every recipient of a broadcast
+typedef std::shared_ptr<const std::string> SharedBuffer;
+
+SharedBuffer makeBuffer(const std::string& text);
+
+// Interned user or room name; equal names share one string
+typedef std::shared_ptr<const std::string> Name;
+
+Name intern(std::string_view text);
+
+// Message text, owned by whatever holds the bytes (an arena chunk or the
+// message's encoded buffer)
+struct Payload {
+    std::shared_ptr<const void> owner;
+    const char* data;
+    size_t length;
+
+    Payload() : data(nullptr), length(0) {}
+    Payload(std::shared_ptr<const void> bytes_owner, const char* bytes, size_t size)
+        : owner(std::move(bytes_owner)), data(bytes), length(size) {}
+    std::string_view view() const { return std::string_view(data, length); }
+};
+
+// Per-thread bump allocator for message text. Chunks are reused once no
+// message points into them any more, so steady traffic allocates nothing.
+class PayloadArena {
+private:
+    static constexpr size_t CHUNK_SIZE = 64 * 1024;
+    static constexpr size_t MAX_CHUNKS = 32;
+
+    std::vector<std::shared_ptr<std::vector<char>>> chunks; // current one last
+    size_t used; // bytes taken from the current chunk
+
+    bool nextChunk();
+
+public:
+    PayloadArena();
+
+    Payload copy(std::string_view text);
+
+    // The calling thread's arena
+    static PayloadArena& local();
+};
+
+// A byte range waiting in a client's write queue: either part of a
+// shared buffer, or part of a log file sent with sendfile()
+struct OutboundSlice {
+    SharedBuffer data;
+    size_t offset;
+    size_t length;
+    std::shared_ptr<LogFile> file;
+};
+
+// Which protocol a connection speaks, decided by its first byte
+enum class WireMode {
+    UNKNOWN,
+    TEXT,
+    FRAMED
+};
+
+// Where a connection is in the login handshake
+enum class LoginState {
+    AWAITING_PROTOCOL, // prompt sent, the first byte picks text or framed
+    AWAITING_HELLO,    // framed clients open with HELLO
+    AWAITING_USERNAME,
+    LOGGED_IN
+};
 
 // Simple message structure
 struct Message {
-    std::string sender;
-    std::string content;
-    std::string timestamp;
-    
-    Message(const std::string& from, const std::string& text);
+    uint64_t seq;    // per-room order, assigned by ChatRoom::addMessage
+    int64_t time_ms; // wall clock, milliseconds since the epoch
+    Name room;
+    Name sender;
+    Payload content;
+    SharedBuffer encoded; // set once the room has stored the message
+
+    Message();
+    // Copies text into the calling thread's payload arena
+    Message(const Name& from, std::string_view text);
     std::string formatMessage() const;
+    void appendFormatted(std::string& out) const;
+    // Wire bytes ready to be queued on any number of clients.
+    // Layout: [RECORD frame][formatted line "\n"]; framed clients send the
+    // frame and text clients send the line.
+    SharedBuffer encode() const;
+};
+
+// What to do when a client's outbound queue is full
+enum class OverflowPolicy {
+    DROP_OLDEST, // discard the oldest unsent messages
+    DISCONNECT,  // close the slow connection
+    COALESCE     // replace the unsent backlog with one "skipped" notice
+};
+
+// What happens to a message over a rate limit
+enum class RateAction {
+    DELAY,     // stop reading from the sender until its budget allows it
+    DROP,      // discard it, telling the sender once
+    DISCONNECT // close the sender (room limits drop instead)
+};
+
+// How shards do their socket I/O
+enum class IoBackend {
+    POLL,    // readiness events (epoll, WSAPoll) and non-blocking calls
+    IO_URING // completions: multishot accept/recv, batched sends (Linux)
 };
 
-// Client handler class
+// Server settings, filled in from the command line
+struct ServerConfig {
+    int port;
+    int shards; // reactor threads, 0 = one per CPU core
+    size_t queue_limit; // outbound bytes buffered per client
+    OverflowPolicy overflow_policy;
+    size_t history_messages; // history kept per room, 0 = unlimited
+    size_t history_bytes;    // 0 = unlimited
+    std::string log_dir;     // persistent message log, empty = disabled
+    uint64_t log_segment_bytes;
+    int log_commit_ms;       // group commit window
+    int login_timeout_ms;    // time to finish the login handshake, 0 = no limit
+    bool verbose;            // log every login and logout (a stdout write each)
+    int flush_window_ms;     // hold broadcasts this long to batch writes, 0 = send at once
+    size_t flush_bytes;      // ...or until this much is queued
+    int metrics_port;        // loopback port serving metrics, 0 = off
+    IoBackend io_backend;
+    // Federation, see Cluster: this node's id (unique, not 0), the port
+    // peers connect to (0 = only dial out) and the peers to dial
+    uint32_t node_id;
+    int cluster_port;
+    std::vector<std::string> peers;
+    // Hot restart: Unix socket a successor takes over through, and
+    // whether to take over from the server listening there
+    std::string handoff_path;
+    bool takeover;
+    // Ingest limits per connection (every line after login) and per room
+    // (chat lines), in messages and bytes per second, 0 = unlimited
+    double client_rate_messages;
+    double client_rate_bytes;
+    double room_rate_messages;
+    double room_rate_bytes;
+    RateAction rate_action;
+    // zlib level for framed clients asking for compression, 0 = refuse
+    int compress_level;
+
+    ServerConfig()
+        : port(8080), shards(1), queue_limit(1024 * 1024),
+          overflow_policy(OverflowPolicy::DROP_OLDEST),
+          history_messages(10000), history_bytes(0),
+          log_segment_bytes(16 * 1024 * 1024), log_commit_ms(5),
+          login_timeout_ms(30000), verbose(false), flush_window_ms(0), flush_bytes(64 * 1024),
+          metrics_port(0), io_backend(IoBackend::POLL), node_id(0), cluster_port(0), takeover(false),
+          client_rate_messages(0), client_rate_bytes(0), room_rate_messages(0), room_rate_bytes(0),
+          rate_action(RateAction::DELAY), compress_level(6) {}
+    bool clustered() const { return cluster_port > 0 || !peers.empty(); }
+    bool rateLimited() const {
+        return client_rate_messages > 0 || client_rate_bytes > 0 || room_rate_messages > 0 || room_rate_bytes > 0;
+    }
+};
+
+// Client connection state, driven by the server event loop
 class Client {
 private:
     SOCKET socket_fd;
-    std::string username;
-    std::thread client_thread;
-    std::mutex write_mutex;
+    int shard_index; // the shard whose thread owns this connection
+    Name username;
+    LoginState login_state;
+    WireMode wire_mode;
+    bool local; // connected from this host, may use admin commands
+    // Last sequence id the client already has, by room (from RESUME)
+    std::map<std::string, uint64_t> resume_seqs;
+    // Subscribed rooms and the one plain chat lines go to
+    std::vector<std::shared_ptr<ChatRoom>> rooms;
+    std::shared_ptr<ChatRoom> current_room;
+    InputBuffer input;
+    // Outgoing buffers and how much of the front one was already sent
+    RingQueue<OutboundSlice> write_queue;
+    size_t write_offset;
+    size_t queued_bytes;
+    // Bounded queue settings
+    size_t queue_limit;
+    OverflowPolicy overflow_policy;
+    ThreadMetrics& metrics; // of the owning shard's thread
+    uint64_t dropped;
+    // Pending "messages skipped" notice and how many it reports
+    SharedBuffer skip_notice;
+    uint64_t skipped;
     bool is_running;
-    
+    bool write_interest;
+    // Writes are started by the event loop (io_uring) instead of inline;
+    // pinned slices at the front of the queue belong to a send in flight
+    bool deferred_writes;
+    size_t pinned;
+    // Write coalescing: queued data waits until hold_until or flush_bytes
+    bool holding;
+    std::chrono::steady_clock::time_point hold_until;
+    size_t flush_bytes;
+    // Ingest budget; input waits unparsed while throttled
+    RateLimit rate_limit;
+    bool throttled;
+    std::chrono::steady_clock::time_point throttled_until;
+    bool read_interest;
+    bool rate_notified; // told that its messages are dropped
+    // Stream compression (HELLO_DEFLATE): the queue holds plain bytes and
+    // is compressed in one block when written out; deflated holds a block
+    // the socket has not taken yet. Slices queued before compression
+    // started (raw_slices at the front) go out as they are.
+#ifdef HAVE_ZLIB
+    std::unique_ptr<Deflater> deflater;
+#endif
+    std::string deflated;
+    size_t deflated_offset;
+    size_t raw_slices;
+    bool deflated_in_flight; // handed to an asynchronous send
+
+    // Apply the overflow policy to make room for incoming bytes
+    void handleOverflow(size_t incoming);
+    // Slices for one gathered send from the front of the queue (none if a
+    // file range is first), and dropping what was sent
+    int gatherSlices(IoSlice* slices, int max_slices, size_t& total);
+    void consumeSent(size_t sent);
+    // Compress the whole queue into the next block; false if zlib failed
+    bool deflateQueued();
+    bool flushDeflated();
+    void consumeDeflated(size_t sent);
+    bool hasDeflatedData() const;
+
 public:
-    Client(SOCKET socket, const std::string& name);
+    Client(SOCKET socket, int shard, const ServerConfig& config, ThreadMetrics& shard_metrics);
     ~Client();
-    
-    void start(std::function<void(const std::string&, const std::string&)> message_handler);
+
     void stop();
     bool isRunning() const;
+    SOCKET getSocket() const;
+    int getShard() const;
+    bool isLocal() const;
+    void setLocal(bool loopback);
+
+    void login(const std::string& name);
+    bool isLoggedIn() const;
+    const std::string& getUsername() const;
+    const Name& getName() const;
+    LoginState getLoginState() const;
+    void setLoginState(LoginState state);
+
+    WireMode getWireMode() const;
+    void setWireMode(WireMode mode);
+
+    uint64_t getResumeSeq(const std::string& room) const;
+    void setResumeSeq(const std::string& room, uint64_t seq);
+
+    const std::vector<std::shared_ptr<ChatRoom>>& getRooms() const;
+    void addRoom(const std::shared_ptr<ChatRoom>& room);
+    void removeRoom(const std::shared_ptr<ChatRoom>& room);
+    std::shared_ptr<ChatRoom> getCurrentRoom() const;
+    void setCurrentRoom(const std::shared_ptr<ChatRoom>& room);
+
+    InputBuffer& getInput();
+    // Everything queued and not sent yet, as bytes (hot restart). A
+    // compressed stream ends there, the successor starts a new one; this
+    // client's own stream is left as it was.
+    void appendUnsent(std::string& out) const;
+
+    // Compress what is queued from now on; data queued before (such as
+    // the HELLO answer) goes out as it is. False without zlib.
+    bool startCompression(int level);
+    bool isCompressing() const;
+
+    // Queue outgoing data and try to write it without blocking
     void sendMessage(const Message& msg);
-    std::string getUsername() const;
+    // Encoded by Message::encode(), sent in this client's wire mode
+    void sendEncoded(const SharedBuffer& encoded);
+    // Server notice (prompt, help, error), framed as NOTICE if needed
+    void sendText(const std::string& text);
+    void sendFrame(uint8_t type, std::string_view payload);
+    void sendBuffer(const SharedBuffer& buffer, size_t offset, size_t length);
+    // Stream part of a log file; does not count against the queue limit
+    void sendFile(const FileRange& range);
+
+    // Write as much queued data as the socket accepts.
+    // Returns false if the connection failed.
+    bool flush();
+    // Asynchronous sends: pin up to max_slices queued buffers (0 if a file
+    // range is first) and later account for what the socket took
+    void setDeferredWrites(bool deferred);
+    int beginSend(IoSlice* slices, int max_slices);
+    void completeSend(size_t sent);
+    bool hasPendingWrites() const;
+    // Queued data that should be written now (not held back)
+    bool wantsWrite() const;
+
+    // Keep queued data back until the deadline or the byte budget is hit
+    void holdWrites(std::chrono::steady_clock::time_point until);
+    void releaseWrites();
+    bool isHolding() const;
+    std::chrono::steady_clock::time_point getHoldDeadline() const;
+
+    // Queue depth and messages lost to the overflow policy
+    size_t getQueuedBytes() const;
+    size_t getQueuedMessages() const;
+    uint64_t getDroppedMessages() const;
+
+    // Whether the event loop is currently watching for writability (or,
+    // with io_uring, has a send or poll in flight)
+    bool hasWriteInterest() const;
+    void setWriteInterest(bool enabled);
+    // Whether the poller is watching for input
+    bool hasReadInterest() const;
+    void setReadInterest(bool enabled);
+
+    RateLimit& getRateLimit();
+    void throttle(std::chrono::steady_clock::time_point until);
+    void unthrottle();
+    bool isThrottled() const;
+    std::chrono::steady_clock::time_point getThrottleDeadline() const;
+    bool wasToldRate() const;
+    void setToldRate(bool told);
+};
+
+// Fixed-size block of room history. Slots below `count` are never
+// written again while the segment is shared with a snapshot.
+struct HistorySegment {
+    std::vector<Message> slots;
+    std::vector<LogPosition> positions; // where each slot is in the log
+    size_t count;
+
+    HistorySegment(size_t capacity);
+};
+
+// Consistent view of a room's history; holds segment references
+// instead of copying messages.
+class HistorySnapshot {
+private:
+    std::vector<std::shared_ptr<const HistorySegment>> segments;
+    size_t first_offset; // messages already trimmed from the first segment
+    size_t last_count;   // messages visible in the last segment
+
+    // Segment and slot of the oldest message with sequence id >= seq
+    bool locate(uint64_t seq, size_t& segment, size_t& slot) const;
+
+public:
+    HistorySnapshot();
+    HistorySnapshot(std::vector<std::shared_ptr<const HistorySegment>> segment_list,
+                    size_t first, size_t last);
+
+    size_t size() const;
+    // Sequence id of the oldest and newest message, 0 if empty
+    uint64_t firstSeq() const;
+    uint64_t lastSeq() const;
+    // Log position of a message, invalid without a log
+    LogPosition positionOf(uint64_t seq) const;
+    // Log position just past the newest message
+    LogPosition endPosition() const;
+    // The message with that sequence id, null if not in the snapshot
+    const Message* find(uint64_t seq) const;
+
+    template <typename Visitor>
+    void forEach(Visitor visit) const {
+        forEachFrom(0, visit);
+    }
+
+    // Visit messages with sequence id >= seq, oldest first
+    template <typename Visitor>
+    void forEachFrom(uint64_t seq, Visitor visit) const {
+        for (size_t i = 0; i < segments.size(); i++) {
+            size_t begin = i == 0 ? first_offset : 0;
+            size_t end = i + 1 == segments.size() ? last_count : segments[i]->count;
+            if (end > begin && segments[i]->slots[end - 1].seq < seq) {
+                continue; // Whole segment is older
+            }
+            for (size_t j = begin; j < end; j++) {
+                if (segments[i]->slots[j].seq >= seq) {
+                    visit(segments[i]->slots[j]);
+                }
+            }
+        }
+    }
 };
 
 // Chat room class
 class ChatRoom {
 private:
-    std::string name;
-    std::vector<Message> message_history;
+    Name name;
+
+    // Bounded history: a ring of segments, oldest first
+    std::deque<std::shared_ptr<HistorySegment>> segments;
+    std::shared_ptr<HistorySegment> spare_segment;
+    size_t first_offset;
+    size_t message_count;
+    size_t history_bytes;
+    size_t max_messages;
+    size_t max_bytes;
+    uint64_t next_seq;
     mutable std::mutex history_mutex;
-    
+    // Covers exactly the messages in the history ring
+    SearchIndex search_index;
+
+    std::unique_ptr<MessageLog> message_log;
+    // Set once the room is ready for use, see prepare()
+    std::once_flag prepared;
+
+    // How many subscribers each shard has; the members themselves live
+    // on their shard (see Shard::room_members). Only joins and leaves
+    // take the lock.
+    std::vector<size_t> shard_members;
+    std::mutex members_mutex;
+    // Shards with subscribers, republished when one gains its first or
+    // loses its last; the sequencer routes every message by it lock-free
+    RcuPointer<std::vector<int>> member_shards;
+
+    // Ingest budget of the whole room, shared by every shard
+    RateLimit rate_limit;
+    std::mutex rate_mutex;
+
+    void publishMemberShards();
+
+    // Encodes msg if needed and points its text into the encoding
+    static void seal(Message& msg);
+    void storeMessage(const Message& msg, LogPosition position);
+    void trimHistory();
+    HistorySnapshot getHistoryLocked() const;
+
 public:
-    ChatRoom(const std::string& room_name);
-    void addMessage(const Message& msg);
-    std::vector<Message> getHistory() const;
-    std::string getName() const;
+    ChatRoom(const std::string& room_name, size_t history_messages, size_t history_bytes_limit);
+    ~ChatRoom();
+
+    // Runs setup (attaching the log) the first time; later callers wait
+    // until it has finished. Lets the registry publish the room before
+    // the slow part, so only users of this room wait for its replay.
+    template <typename Setup>
+    void prepare(Setup setup) {
+        std::call_once(prepared, setup);
+    }
+
+    // Persist messages to a log, replaying what it already holds
+    bool attachLog(std::unique_ptr<MessageLog> log);
+
+    // Assigns the next sequence id, stores and logs the message and
+    // returns its encoding for broadcasting
+    SharedBuffer addMessage(Message& msg);
+    HistorySnapshot getHistory() const;
+    const std::string& getName() const;
+    // Sequence id of the newest message, even if history dropped it
+    uint64_t lastSeq() const;
+    // Up to limit of the newest messages in history holding every word
+    // (and sent by sender, if not empty), oldest first. Ingest only waits
+    // while the postings are snapshotted.
+    std::vector<Message> search(const std::vector<std::string>& words, const std::string& sender,
+                                size_t limit) const;
+
+    // Hot restart: history handed over by the previous process. Messages
+    // the log already replayed are skipped; resumeAfter() continues the
+    // numbering after last_seq.
+    void restoreMessage(Message& msg);
+    void resumeAfter(uint64_t last_seq);
+    // Writes out batched records, for a successor to open the log
+    void flushLog();
+
+    // Log file ranges holding the snapshot's messages with sequence ids
+    // in [from_seq, end_seq). Returns false if they cannot be streamed
+    // from disk.
+    bool streamHistory(const HistorySnapshot& snapshot, uint64_t from_seq, uint64_t end_seq,
+                       std::vector<FileRange>& out);
+
+    void setRateLimit(double messages_per_second, double bytes_per_second);
+    // Takes a message of length bytes from the room's budget, or returns
+    // how long until it could
+    TokenBucket::Clock::duration admit(size_t length, TokenBucket::Clock::time_point now);
+
+    // Subscriber counts per shard, used to route broadcasts
+    void subscribe(int shard);
+    void unsubscribe(int shard);
+    // Shards to route a message to. Only inside an RcuReadGuard, which
+    // keeps the list valid.
+    const std::vector<int>& memberShards() const;
+};
+
+// Map from name to shared object for many threads. Names hash to
+// independently locked stripes, so lookups of different names rarely
+// contend.
+template <typename Value>
+class StripedMap {
+private:
+    static const size_t STRIPES = 16;
+
+    struct alignas(64) Stripe {
+        std::mutex mutex;
+        std::unordered_map<std::string, std::shared_ptr<Value>> entries;
+    };
+    Stripe stripes[STRIPES];
+
+    Stripe& stripeFor(const std::string& name) {
+        return stripes[std::hash<std::string>()(name) % STRIPES];
+    }
+
+public:
+    // Claims a name; false if it is already taken
+    bool insert(const std::string& name, const std::shared_ptr<Value>& value) {
+        Stripe& stripe = stripeFor(name);
+        std::lock_guard<std::mutex> lock(stripe.mutex);
+        return stripe.entries.emplace(name, value).second;
+    }
+
+    // Releases a name if it still maps to value
+    void erase(const std::string& name, const std::shared_ptr<Value>& value) {
+        Stripe& stripe = stripeFor(name);
+        std::lock_guard<std::mutex> lock(stripe.mutex);
+        auto it = stripe.entries.find(name);
+        if (it != stripe.entries.end() && it->second == value) {
+            stripe.entries.erase(it);
+        }
+    }
+
+    std::shared_ptr<Value> find(const std::string& name) {
+        Stripe& stripe = stripeFor(name);
+        std::lock_guard<std::mutex> lock(stripe.mutex);
+        auto it = stripe.entries.find(name);
+        return it != stripe.entries.end() ? it->second : nullptr;
+    }
+
+    // Returns the entry for name, calling create() under the stripe lock
+    // if there is none yet
+    template <typename Create>
+    std::shared_ptr<Value> findOrCreate(const std::string& name, Create create) {
+        Stripe& stripe = stripeFor(name);
+        std::lock_guard<std::mutex> lock(stripe.mutex);
+        std::shared_ptr<Value>& entry = stripe.entries[name];
+        if (!entry) {
+            entry = create();
+        }
+        return entry;
+    }
+
+    // Calls visit(name, value) for every entry, one stripe locked at a time
+    template <typename Visitor>
+    void forEach(Visitor visit) {
+        for (auto& stripe : stripes) {
+            std::lock_guard<std::mutex> lock(stripe.mutex);
+            for (const auto& entry : stripe.entries) {
+                visit(entry.first, entry.second);
+            }
+        }
+    }
+
+    void clear() {
+        for (auto& stripe : stripes) {
+            std::lock_guard<std::mutex> lock(stripe.mutex);
+            stripe.entries.clear();
+        }
+    }
+};
+
+// Logged in clients by username; Client::getShard() tells where to
+// route a direct message
+typedef StripedMap<Client> UsernameIndex;
+// Rooms by name, created on first join
+typedef StripedMap<ChatRoom> RoomRegistry;
+
+class ChatServer;
+
+// An encoded message on its way to a shard: for the members of room, or
+// for a single client if target is set
+struct Broadcast {
+    std::shared_ptr<ChatRoom> room;
+    uint64_t seq;
+    SharedBuffer encoded;
+    std::shared_ptr<Client> target;
+    bool disconnect = false; // close target instead: its name went to another node
+};
+
+// Room names double as log directory names
+bool validRoomName(std::string_view name);
+// Usernames follow the same rules, so a /msg target is one word
+bool validUsername(std::string_view name);
+
+// One reactor thread: its own listener, its own connections and an inbox
+// through which other shards hand it broadcasts.
+class Shard {
+private:
+    ChatServer& server;
+    int index;
+    SOCKET listen_socket;
+    std::atomic<bool> running;
+    std::thread loop_thread;
+    Poller poller;
+    ThreadMetrics* metrics; // set once the loop thread runs
+
+#ifdef HAVE_IO_URING
+    // io_uring backend, used instead of the poller if chosen
+    static const int RING_SEND_SLICES = 32;
+    struct RingConnection {
+        std::shared_ptr<Client> client;
+        int operations; // in flight; keeps the socket open after a disconnect
+        struct msghdr msg;
+        IoSlice slices[RING_SEND_SLICES];
+    };
+    std::unique_ptr<IoRing> ring;
+    std::unordered_map<SOCKET, RingConnection> ring_connections;
+
+    void ringLoop();
+    void handleCompletion(const IoRing::Completion& completion);
+    void submitWrite(const std::shared_ptr<Client>& client);
+    void finishOperation(SOCKET socket);
+    void drainRing();
+#endif
+
+    // Sockets owned by this shard (including clients still choosing a username)
+    std::map<SOCKET, std::shared_ptr<Client>> connections;
+
+    // This shard's subscribers of each room, with the last sequence id
+    // each one already got from its history replay
+    std::unordered_map<ChatRoom*, std::unordered_map<std::shared_ptr<Client>, uint64_t>> room_members;
+
+    // Handshake deadlines in accept order (they share one timeout)
+    typedef std::chrono::steady_clock Clock;
+    std::deque<std::pair<Clock::time_point, std::weak_ptr<Client>>> login_deadlines;
+
+    // When the input being handled was read
+    Clock::time_point read_time;
+
+    // Clients holding broadcasts back, by flush deadline (one window for all)
+    std::deque<std::pair<Clock::time_point, std::weak_ptr<Client>>> held_writes;
+
+    // Rate limited clients by the time their budget allows the next message
+    std::multimap<Clock::time_point, std::weak_ptr<Client>> throttled_clients;
+
+    // Broadcasts posted by any shard, delivered on this shard's thread
+    std::vector<Broadcast> inbox;
+    std::mutex inbox_mutex;
+
+    // Connections from a previous process, set up once the loop runs
+    std::vector<ConnectionState> adopting;
+
+    void eventLoop();
+    bool setupListener();
+    void wakeup();
+    void acceptClients();
+    std::shared_ptr<Client> createClient(SOCKET socket, bool local);
+    void addClient(SOCKET socket, bool local);
+    void adoptConnections();
+    void expireLogins();
+    void flushHeldWrites();
+    void resumeThrottled();
+    int nextTimeout() const;
+    void drainInbox();
+    void deliver(const Broadcast& broadcast);
+    void handleReadable(const std::shared_ptr<Client>& client);
+    // Parse and handle what was just added to the client's input
+    void handleInput(const std::shared_ptr<Client>& client, size_t bytes_read);
+    void handleWritable(const std::shared_ptr<Client>& client);
+    void handleFrame(const std::shared_ptr<Client>& client, uint8_t type, std::string_view payload);
+    void handleLine(const std::shared_ptr<Client>& client, std::string_view line);
+    void handleLogin(const std::shared_ptr<Client>& client, std::string_view username);
+    // Applies the rate limits to a message from a logged in client; false
+    // if it must not be handled (dropped, or the client is throttled or
+    // closed)
+    bool admitInput(const std::shared_ptr<Client>& client, std::string_view message);
+    void handleClientInput(const std::shared_ptr<Client>& client, std::string_view message);
+    void handleDirectMessage(const std::shared_ptr<Client>& client, std::string_view argument);
+    void handleRoomCommand(const std::shared_ptr<Client>& client, std::string_view command,
+                           std::string_view argument);
+    // Subscribe to a room and replay the history the client is missing;
+    // announce also posts a join message
+    void joinRoom(const std::shared_ptr<Client>& client, const std::shared_ptr<ChatRoom>& room, bool announce);
+    void leaveRoom(const std::shared_ptr<Client>& client, const std::shared_ptr<ChatRoom>& room, bool announce);
+    void updateInterest(const std::shared_ptr<Client>& client);
+    void disconnectClient(const std::shared_ptr<Client>& client);
+
+public:
+    Shard(ChatServer& owner, int shard_index);
+    ~Shard();
+
+    bool listen(int port, bool reuse_port);
+    bool usingRing() const;
+    const char* backendName() const;
+    void start();
+    void stop();
+
+    // Hot restart. The old process pauses the loop (connections stay
+    // open) and exports them; the new one adopts the listener and the
+    // connections before start().
+    void pause();
+    SOCKET getListenSocket() const;
+    void exportConnections(std::vector<ConnectionState>& out);
+    bool adoptListener(SOCKET socket);
+    void adopt(ConnectionState state);
+
+    // Thread-safe: queue encoded messages for this shard's clients
+    void post(const Broadcast& broadcast);
+    void post(std::vector<Broadcast>& batch);
+};
+
+// Single consumer of all inbound room messages. Shards push onto a
+// lock-free queue; the sequencer thread appends each message to its
+// room's history (assigning its sequence id) and hands the encoded
+// messages to the member shards in batches, so every shard sees one
+// order per room.
+class Sequencer {
+private:
+    struct Entry {
+        std::shared_ptr<ChatRoom> room;
+        Message msg;
+        std::chrono::steady_clock::time_point queued;
+        bool relay; // sent by a client here, so cluster peers get it too
+    };
+
+    ChatServer& server;
+    MpscQueue<Entry> queue;
+    ThreadMetrics* metrics; // set once the sequencer thread runs
+    std::atomic<bool> running;
+    std::thread sequencer_thread;
+
+    // Parking when the queue is empty
+    std::atomic<bool> sleeping;
+    std::mutex sleep_mutex;
+    std::condition_variable sleep_cv;
+
+    void run();
+    // Sequence up to max_batch queued messages; returns how many
+    size_t drain(size_t max_batch, std::vector<std::vector<Broadcast>>& batches);
+
+public:
+    Sequencer(ChatServer& owner);
+    ~Sequencer();
+
+    void start();
+    // Stops after sequencing what is already queued
+    void stop();
+
+    // Thread-safe. Messages relayed from another node pass relay = false.
+    void submit(const std::shared_ptr<ChatRoom>& room, Message msg, bool relay = true);
 };
 
 // Main ChatServer class
 class ChatServer {
 private:
-    SOCKET server_socket;
-    int port;
+    ServerConfig config;
     std::atomic<bool> running;
-    std::thread accept_thread;
-    
-    std::map<std::string, std::shared_ptr<Client>> clients;
-    std::mutex clients_mutex;
-    
-    std::shared_ptr<ChatRoom> chat_room;
-    
-    void acceptClients();
-    void handleClientMessage(const std::string& sender, const std::string& message);
-    void broadcastMessage(const Message& msg);
-    
+    std::vector<std::unique_ptr<Shard>> shards;
+
+    // Logged in clients by username (only touched on login and logout)
+    UsernameIndex clients;
+
+    RoomRegistry rooms;
+    std::shared_ptr<ChatRoom> lobby;
+
+    Sequencer sequencer;
+    MetricsEndpoint metrics_endpoint;
+    std::unique_ptr<Cluster> cluster; // set if clustered, before the threads start
+    HandoffEndpoint handoff_endpoint;
+
+    // Set by requestStop(), waited for by wait()
+    bool stop_requested;
+    std::mutex stop_mutex;
+    std::condition_variable stop_cv;
+
+    bool registerClient(const std::shared_ptr<Client>& client, const std::string& username);
+    void unregisterClient(const std::shared_ptr<Client>& client);
+    // Room by name, created (and its log replayed) on first use
+    std::shared_ptr<ChatRoom> openRoom(const std::string& name);
+    // Queue a room message for the sequencer
+    void handleClientMessage(const std::shared_ptr<ChatRoom>& room, const Name& sender,
+                             std::string_view message);
+
+    // Created (unless handed over) and listening, or false (and not set)
+    bool startCluster();
+    // Sequencer, shard and cluster threads; again after a failed handoff
+    void startThreads();
+    bool startMetrics();
+
+    // Hot restart, old side: hand everything to the successor connected
+    // on channel. True once this process is done and should exit; false
+    // if it did not take over and this process serves on.
+    bool handOff(SOCKET channel);
+    // New side: the predecessor's shard listeners, then its rooms and
+    // connections (after the shards exist)
+    bool beginTakeover(HandoffChannel& predecessor, std::vector<SOCKET>& listeners);
+    bool receiveState(HandoffChannel& predecessor, size_t& adopted);
+
+    friend class Shard;
+    friend class Sequencer;
+    friend class Cluster;
+
 public:
-    ChatServer(int server_port);
+    ChatServer(const ServerConfig& server_config);
     ~ChatServer();
-    
-    void start();
+
+    // False if the server could not start (or take over)
+    bool start();
     void stop();
-    std::string getCurrentTimestamp() const;
-}; 
\ No newline at end of file
+
+    // Blocks until requestStop(), called on a stop signal or Enter, or after
+    // a hot restart
+    void wait();
+    void requestStop();
+};
@@ -0,0 +1,114 @@
+#include "test.h"
+#include "server.h"
+#include <string>
+
+// Enough messages to fill several history segments
+static const size_t MANY = 2000;
+
+static void addMessages(ChatRoom& room, size_t count, const std::string& prefix = "m") {
+    static const Name sender = intern("ann");
+    for (size_t i = 0; i < count; i++) {
+        Message msg(sender, prefix + std::to_string(room.lastSeq() + 1));
+        room.addMessage(msg);
+    }
+}
+
+// Sequence ids are consecutive from first to last and each text matches
+static bool consecutive(const HistorySnapshot& history, uint64_t first, uint64_t last) {
+    uint64_t expected = first;
+    bool ok = true;
+    history.forEach([&](const Message& msg) {
+        ok = ok && msg.seq == expected && msg.content.view() == "m" + std::to_string(expected);
+        expected++;
+    });
+    return ok && expected == last + 1;
+}
+
+TEST(historyKeepsTheNewestMessages) {
+    ChatRoom room("history", 100, 0);
+    addMessages(room, 1000);
+    HistorySnapshot history = room.getHistory();
+    CHECK_EQ(history.size(), (size_t)100);
+    CHECK_EQ(history.firstSeq(), (uint64_t)901);
+    CHECK_EQ(history.lastSeq(), (uint64_t)1000);
+    CHECK_EQ(room.lastSeq(), (uint64_t)1000);
+    CHECK(consecutive(history, 901, 1000));
+}
+
+TEST(historyWrapsAcrossSegments) {
+    // A bound that is not a multiple of the segment size, so trimming
+    // leaves partly used segments at both ends
+    ChatRoom room("wrap", 517, 0);
+    for (size_t round = 0; round < 10; round++) {
+        addMessages(room, 333);
+        HistorySnapshot history = room.getHistory();
+        uint64_t last = (round + 1) * 333;
+        uint64_t first = last > 517 ? last - 516 : 1;
+        CHECK_EQ(history.size(), (size_t)(last - first + 1));
+        CHECK(consecutive(history, first, last));
+    }
+}
+
+TEST(historyBoundedByBytes) {
+    ChatRoom room("bytes", 0, 20000);
+    addMessages(room, MANY);
+    HistorySnapshot history = room.getHistory();
+    size_t bytes = 0;
+    history.forEach([&](const Message& msg) { bytes += msg.encoded->size(); });
+    CHECK(bytes <= 20000);
+    CHECK(history.size() > 0 && history.size() < MANY);
+    CHECK_EQ(history.lastSeq(), (uint64_t)MANY);
+    CHECK(consecutive(history, history.firstSeq(), MANY));
+}
+
+TEST(snapshotOutlivesTrimming) {
+    ChatRoom room("snapshot", 300, 0);
+    addMessages(room, 450);
+    HistorySnapshot before = room.getHistory();
+    CHECK(consecutive(before, 151, 450));
+
+    // Trims every segment the snapshot holds; freed segments must not be
+    // reused while it still points at them
+    addMessages(room, MANY);
+    CHECK(consecutive(before, 151, 450));
+    CHECK_EQ(before.size(), (size_t)300);
+    CHECK(consecutive(room.getHistory(), MANY + 450 - 299, MANY + 450));
+}
+
+TEST(snapshotDoesNotSeeLaterMessages) {
+    ChatRoom room("growing", 0, 0);
+    addMessages(room, 10);
+    HistorySnapshot before = room.getHistory();
+    addMessages(room, 1);
+    CHECK_EQ(before.size(), (size_t)10);
+    CHECK_EQ(before.lastSeq(), (uint64_t)10);
+    CHECK(before.find(11) == nullptr);
+    CHECK_EQ(room.getHistory().size(), (size_t)11);
+}
+
+TEST(snapshotLookups) {
+    ChatRoom room("lookups", 600, 0);
+    addMessages(room, 1000);
+    HistorySnapshot history = room.getHistory();
+    CHECK(history.find(400) == nullptr);
+    CHECK(history.find(401) != nullptr && history.find(401)->seq == 401);
+    CHECK(history.find(777) != nullptr && history.find(777)->content.view() == "m777");
+    CHECK(history.find(1001) == nullptr);
+
+    size_t visited = 0;
+    uint64_t first = 0;
+    history.forEachFrom(900, [&](const Message& msg) {
+        first = visited++ == 0 ? msg.seq : first;
+    });
+    CHECK_EQ(visited, (size_t)101);
+    CHECK_EQ(first, (uint64_t)900);
+}
+
+TEST(emptyHistory) {
+    ChatRoom room("empty", 10, 0);
+    HistorySnapshot history = room.getHistory();
+    CHECK_EQ(history.size(), (size_t)0);
+    CHECK_EQ(history.firstSeq(), (uint64_t)0);
+    CHECK_EQ(history.lastSeq(), (uint64_t)0);
+    CHECK(history.find(1) == nullptr);
+}
@@ -0,0 +1,160 @@
+#include "test.h"
+#include "protocol.h"
+#include <cstring>
+
+// Appends bytes as if recv() had read them
+static void feed(InputBuffer& buffer, std::string_view bytes) {
+    char* space = buffer.reserve(bytes.size());
+    memcpy(space, bytes.data(), bytes.size());
+    buffer.commit(bytes.size());
+}
+
+TEST(frameArrivingByteByByte) {
+    InputBuffer buffer;
+    std::string frame = encodeFrame(FRAME_TEXT, "hello");
+    uint8_t type = 0;
+    std::string_view payload;
+    for (size_t i = 0; i + 1 < frame.size(); i++) {
+        feed(buffer, frame.substr(i, 1));
+        CHECK(buffer.nextFrame(type, payload) == InputBuffer::NEED_MORE);
+    }
+    feed(buffer, frame.substr(frame.size() - 1));
+    CHECK(buffer.nextFrame(type, payload) == InputBuffer::COMPLETE);
+    CHECK_EQ((int)type, (int)FRAME_TEXT);
+    CHECK_EQ(payload, "hello");
+    CHECK(buffer.empty());
+}
+
+TEST(truncatedPayloadWaitsForTheRest) {
+    InputBuffer buffer;
+    std::string frame = encodeFrame(FRAME_TEXT, std::string(1000, 'x'));
+    uint8_t type;
+    std::string_view payload;
+    feed(buffer, std::string_view(frame).substr(0, FRAME_HEADER_SIZE + 10));
+    CHECK(buffer.nextFrame(type, payload) == InputBuffer::NEED_MORE);
+    // Nothing was consumed, the header is parsed again once complete
+    CHECK_EQ(buffer.unparsed().size(), FRAME_HEADER_SIZE + 10);
+    feed(buffer, std::string_view(frame).substr(FRAME_HEADER_SIZE + 10));
+    CHECK(buffer.nextFrame(type, payload) == InputBuffer::COMPLETE);
+    CHECK_EQ(payload.size(), (size_t)1000);
+}
+
+TEST(oversizedFrameIsInvalidFromItsHeader) {
+    InputBuffer buffer;
+    char header[FRAME_HEADER_SIZE];
+    writeFrameHeader(header, FRAME_TEXT, (uint32_t)MAX_PAYLOAD_SIZE + 1);
+    feed(buffer, std::string_view(header, FRAME_HEADER_SIZE));
+    uint8_t type;
+    std::string_view payload;
+    CHECK(buffer.nextFrame(type, payload) == InputBuffer::INVALID);
+}
+
+TEST(largestFrameGrowsPastAPoolBlock) {
+    InputBuffer buffer;
+    std::string frame = encodeFrame(FRAME_TEXT, std::string(MAX_PAYLOAD_SIZE, 'y'));
+    // In chunks smaller than a block, as a socket would deliver it
+    for (size_t offset = 0; offset < frame.size(); offset += 3000) {
+        feed(buffer, std::string_view(frame).substr(offset, 3000));
+    }
+    uint8_t type;
+    std::string_view payload;
+    CHECK(buffer.nextFrame(type, payload) == InputBuffer::COMPLETE);
+    CHECK_EQ(payload.size(), MAX_PAYLOAD_SIZE);
+    CHECK(payload.find_first_not_of('y') == std::string_view::npos);
+}
+
+TEST(severalFramesInOneRead) {
+    InputBuffer buffer;
+    feed(buffer, encodeFrame(FRAME_HELLO, std::string(1, '\5')) + encodeFrame(FRAME_TEXT, "") +
+                 encodeFrame(FRAME_TEXT, "ann") + encodeFrame(FRAME_TEXT, "partial").substr(0, 7));
+    uint8_t type;
+    std::string_view payload;
+    CHECK(buffer.nextFrame(type, payload) == InputBuffer::COMPLETE);
+    CHECK_EQ((int)type, (int)FRAME_HELLO);
+    CHECK(buffer.nextFrame(type, payload) == InputBuffer::COMPLETE);
+    CHECK(payload.empty());
+    CHECK(buffer.nextFrame(type, payload) == InputBuffer::COMPLETE);
+    CHECK_EQ(payload, "ann");
+    CHECK(buffer.nextFrame(type, payload) == InputBuffer::NEED_MORE);
+    CHECK_EQ(buffer.unparsed().size(), (size_t)7);
+}
+
+TEST(linesStripCarriageReturns) {
+    InputBuffer buffer;
+    feed(buffer, "ann\r\nhello\nhalf a li");
+    std::string_view line;
+    CHECK(buffer.nextLine(line) == InputBuffer::COMPLETE);
+    CHECK_EQ(line, "ann");
+    CHECK(buffer.nextLine(line) == InputBuffer::COMPLETE);
+    CHECK_EQ(line, "hello");
+    CHECK(buffer.nextLine(line) == InputBuffer::NEED_MORE);
+    feed(buffer, "ne\n");
+    CHECK(buffer.nextLine(line) == InputBuffer::COMPLETE);
+    CHECK_EQ(line, "half a line");
+}
+
+TEST(overlongLineIsInvalid) {
+    InputBuffer buffer;
+    feed(buffer, std::string(MAX_PAYLOAD_SIZE, 'z'));
+    std::string_view line;
+    CHECK(buffer.nextLine(line) == InputBuffer::NEED_MORE);
+    feed(buffer, "z");
+    CHECK(buffer.nextLine(line) == InputBuffer::INVALID);
+}
+
+TEST(rewindHandsBackParsedInput) {
+    InputBuffer buffer;
+    feed(buffer, "one\ntwo\n");
+    size_t mark = buffer.mark();
+    std::string_view line;
+    CHECK(buffer.nextLine(line) == InputBuffer::COMPLETE);
+    buffer.rewind(mark);
+    CHECK(buffer.nextLine(line) == InputBuffer::COMPLETE);
+    CHECK_EQ(line, "one");
+}
+
+TEST(releaseKeepsUnparsedInput) {
+    InputBuffer buffer;
+    feed(buffer, "one\ntw");
+    std::string_view line;
+    CHECK(buffer.nextLine(line) == InputBuffer::COMPLETE);
+    buffer.release();
+    CHECK_EQ(buffer.unparsed(), "tw");
+    CHECK(buffer.nextLine(line) == InputBuffer::NEED_MORE);
+    feed(buffer, "o\n");
+    CHECK(buffer.nextLine(line) == InputBuffer::COMPLETE);
+    buffer.release();
+    CHECK(buffer.empty());
+}
+
+TEST(varintsRoundTripAndRejectTruncation) {
+    std::string encoded;
+    const uint64_t values[] = {0, 1, 127, 128, 300, 1ull << 35, UINT64_MAX};
+    for (uint64_t value : values) {
+        putVarint(encoded, value);
+    }
+    putString(encoded, "room");
+    std::string_view in(encoded);
+    for (uint64_t value : values) {
+        uint64_t decoded;
+        CHECK(getVarint(in, decoded));
+        CHECK_EQ(decoded, value);
+    }
+    std::string_view text;
+    CHECK(getString(in, text));
+    CHECK_EQ(text, "room");
+    CHECK(in.empty());
+
+    std::string truncated;
+    putVarint(truncated, 1ull << 35);
+    truncated.pop_back();
+    std::string_view short_in(truncated);
+    uint64_t value;
+    CHECK(!getVarint(short_in, value));
+
+    std::string long_string;
+    putVarint(long_string, 10);
+    long_string += "abc";
+    std::string_view string_in(long_string);
+    CHECK(!getString(string_in, text));
+}
@@ -0,0 +1,98 @@
+#include "test.h"
+#include "rate_limit.h"
+
+using std::chrono::milliseconds;
+typedef TokenBucket::Clock Clock;
+
+static double waitMs(TokenBucket& bucket, double cost, Clock::time_point now) {
+    return std::chrono::duration<double, std::milli>(bucket.wait(cost, now)).count();
+}
+
+// configure() starts the bucket at Clock::now(); tests move time on from
+// the moment right after it
+TEST(unlimitedBucketNeverWaits) {
+    TokenBucket bucket;
+    bucket.configure(0);
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < 1000; i++) {
+        CHECK(bucket.wait(1e9, start) == Clock::duration::zero());
+        bucket.take(1e9);
+    }
+}
+
+TEST(bucketAllowsABurstOfOneSecond) {
+    TokenBucket bucket;
+    bucket.configure(10);
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < 10; i++) {
+        CHECK(bucket.wait(1, start) == Clock::duration::zero());
+        bucket.take(1);
+    }
+    double wait = waitMs(bucket, 1, start);
+    CHECK(wait > 95 && wait <= 101);
+    // Asking again does not use anything up
+    CHECK(waitMs(bucket, 1, start) <= wait);
+}
+
+TEST(bucketRefillsAtItsRate) {
+    TokenBucket bucket;
+    bucket.configure(10);
+    Clock::time_point start = Clock::now();
+    bucket.take(10);
+    CHECK(waitMs(bucket, 1, start + milliseconds(50)) > 45);
+    CHECK(bucket.wait(1, start + milliseconds(101)) == Clock::duration::zero());
+    bucket.take(1);
+    // Half a second later: five more, not a sixth
+    Clock::time_point later = start + milliseconds(601);
+    for (int i = 0; i < 5; i++) {
+        CHECK(bucket.wait(1, later) == Clock::duration::zero());
+        bucket.take(1);
+    }
+    CHECK(bucket.wait(1, later) > Clock::duration::zero());
+}
+
+TEST(bucketHoldsAtMostOneSecond) {
+    TokenBucket bucket;
+    bucket.configure(10);
+    Clock::time_point idle = Clock::now() + milliseconds(60000);
+    for (int i = 0; i < 10; i++) {
+        CHECK(bucket.wait(1, idle) == Clock::duration::zero());
+        bucket.take(1);
+    }
+    CHECK(bucket.wait(1, idle) > Clock::duration::zero());
+}
+
+TEST(oversizedCostPassesOnceAndLeavesDebt) {
+    TokenBucket bucket;
+    bucket.configure(100);
+    Clock::time_point start = Clock::now();
+    // More than the bucket holds: allowed when full, never refused forever
+    CHECK(bucket.wait(250, start) == Clock::duration::zero());
+    bucket.take(250);
+    // 150 in debt plus 1: a little over 1.5 s
+    double wait = waitMs(bucket, 1, start);
+    CHECK(wait > 1500 && wait < 1520);
+    CHECK(bucket.wait(1, start + milliseconds(1520)) == Clock::duration::zero());
+}
+
+TEST(rateLimitWaitsForTheScarcerBudget) {
+    RateLimit limit;
+    limit.configure(100, 50);
+    Clock::time_point start = Clock::now();
+    CHECK(limit.wait(40, start) == Clock::duration::zero());
+    limit.take(40);
+    // Plenty of messages left, but only 10 bytes: 30 more take 0.6 s
+    double wait = std::chrono::duration<double, std::milli>(limit.wait(40, start)).count();
+    CHECK(wait > 595 && wait < 610);
+    CHECK(limit.wait(10, start) == Clock::duration::zero());
+}
+
+TEST(rateLimitWithOnlyAMessageBudget) {
+    RateLimit limit;
+    limit.configure(2, 0);
+    Clock::time_point start = Clock::now();
+    limit.take(100000);
+    limit.take(100000);
+    CHECK(limit.wait(1, start) > Clock::duration::zero());
+    CHECK(limit.wait(1, start + milliseconds(501)) == Clock::duration::zero());
+}
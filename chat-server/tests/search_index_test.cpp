@@ -0,0 +1,210 @@
+#include "test.h"
+#include "search_index.h"
+#include <string>
+#include <vector>
+#include <algorithm>
+
+struct Indexed {
+    uint64_t seq;
+    std::string sender;
+    std::string text;
+};
+
+// Deterministic messages: seq s holds "every", "even" if s is even,
+// "three" if a multiple of 3, "rare" every 500th and one of a few
+// rotating words; senders alternate between three users
+static std::vector<Indexed> makeMessages(uint64_t first, uint64_t count) {
+    static const char* rotating[] = {"alpha", "beta", "gamma", "delta", "epsilon"};
+    std::vector<Indexed> messages;
+    for (uint64_t seq = first; seq < first + count; seq++) {
+        std::string text = "Every message, " + std::string(rotating[seq % 5]);
+        if (seq % 2 == 0) {
+            text += " even";
+        }
+        if (seq % 3 == 0) {
+            text += " THREE";
+        }
+        if (seq % 500 == 0) {
+            text += " rare";
+        }
+        messages.push_back(Indexed{seq, "user" + std::to_string(seq % 3), text});
+    }
+    return messages;
+}
+
+// What match() should return, by scanning the messages still indexed
+static std::vector<uint64_t> bruteForce(const std::vector<Indexed>& messages, uint64_t first_seq,
+                                        const std::vector<std::string>& words, const std::string& sender,
+                                        size_t limit) {
+    std::vector<uint64_t> found;
+    for (auto it = messages.rbegin(); it != messages.rend() && found.size() < limit; ++it) {
+        if (it->seq < first_seq || (!sender.empty() && it->sender != sender)) {
+            continue;
+        }
+        std::string lower = it->text;
+        std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+        bool all = true;
+        for (const auto& word : words) {
+            // Words in these texts are separated by spaces and commas
+            std::string padded = " " + lower + " ";
+            all = all && (padded.find(" " + word + " ") != std::string::npos ||
+                          padded.find(" " + word + ",") != std::string::npos);
+        }
+        if (all) {
+            found.push_back(it->seq);
+        }
+    }
+    return found;
+}
+
+static std::vector<uint64_t> search(const SearchIndex& index, const std::string& query, size_t limit) {
+    std::vector<std::string> words;
+    std::string sender;
+    SearchIndex::parseQuery(query, words, sender);
+    return index.snapshot(words, sender).match(limit);
+}
+
+static bool matchesBruteForce(const SearchIndex& index, const std::vector<Indexed>& messages,
+                              uint64_t first_seq, const std::string& query, size_t limit) {
+    std::vector<std::string> words;
+    std::string sender;
+    SearchIndex::parseQuery(query, words, sender);
+    return search(index, query, limit) == bruteForce(messages, first_seq, words, sender, limit);
+}
+
+TEST(searchAcrossBlockBoundaries) {
+    // Thousands of postings per common term: many sealed blocks, and the
+    // lists intersected have their block boundaries at different ids
+    SearchIndex index;
+    std::vector<Indexed> messages = makeMessages(1, 5000);
+    for (const auto& msg : messages) {
+        index.add(msg.seq, msg.sender, msg.text);
+    }
+    const char* queries[] = {"every", "even", "three", "even three", "rare", "rare even", "gamma three",
+                             "from:user1", "even from:user2", "every even three gamma", "missing",
+                             "even missing"};
+    for (const char* query : queries) {
+        CHECK(matchesBruteForce(index, messages, 0, query, 20));
+        CHECK(matchesBruteForce(index, messages, 0, query, 100000));
+    }
+    std::vector<uint64_t> sixes = search(index, "even three", 100000);
+    CHECK_EQ(sixes.size(), (size_t)(5000 / 6));
+    CHECK_EQ(sixes.front(), (uint64_t)4998);
+    CHECK_EQ(sixes.back(), (uint64_t)6);
+}
+
+TEST(searchOnlyCoversTheHistoryWindow) {
+    SearchIndex index;
+    std::vector<Indexed> messages = makeMessages(1, 3000);
+    for (const auto& msg : messages) {
+        index.add(msg.seq, msg.sender, msg.text);
+    }
+    // Remove up to an id inside a block, so part of it stays behind
+    uint64_t first_seq = 1;
+    for (uint64_t removed : {1000u, 1u, 299u, 500u}) {
+        for (uint64_t i = 0; i < removed; i++) {
+            const Indexed& msg = messages[first_seq - 1];
+            index.remove(msg.seq, msg.sender, msg.text);
+            first_seq++;
+        }
+        CHECK(matchesBruteForce(index, messages, first_seq, "every", 100000));
+        CHECK(matchesBruteForce(index, messages, first_seq, "even three", 100000));
+        CHECK(matchesBruteForce(index, messages, first_seq, "rare", 100000));
+        std::vector<uint64_t> all = search(index, "every", 100000);
+        CHECK_EQ(all.size(), (size_t)(3000 - first_seq + 1));
+    }
+}
+
+TEST(searchRemovesTermsWithTheirLastMessage) {
+    SearchIndex index;
+    std::vector<Indexed> messages = makeMessages(1, 600);
+    for (const auto& msg : messages) {
+        index.add(msg.seq, msg.sender, msg.text);
+    }
+    CHECK(index.termCount() > 0);
+    for (const auto& msg : messages) {
+        index.remove(msg.seq, msg.sender, msg.text);
+    }
+    CHECK_EQ(index.termCount(), (size_t)0);
+    CHECK(search(index, "every", 10).empty());
+}
+
+TEST(searchSnapshotIsStable) {
+    SearchIndex index;
+    std::vector<Indexed> messages = makeMessages(1, 1000);
+    for (const auto& msg : messages) {
+        index.add(msg.seq, msg.sender, msg.text);
+    }
+    std::vector<std::string> words = {"even"};
+    SearchIndex::Snapshot snapshot = index.snapshot(words, std::string());
+    std::vector<uint64_t> before = snapshot.match(100000);
+
+    // Grow the open block and drop whole old blocks after the snapshot
+    for (const auto& msg : makeMessages(1001, 1000)) {
+        index.add(msg.seq, msg.sender, msg.text);
+    }
+    for (uint64_t i = 0; i < 700; i++) {
+        index.remove(messages[i].seq, messages[i].sender, messages[i].text);
+    }
+    CHECK(snapshot.match(100000) == before);
+    CHECK_EQ(before.size(), (size_t)500);
+}
+
+TEST(searchHandlesLargeGaps) {
+    // Multi-byte varint gaps inside one block
+    SearchIndex index;
+    const uint64_t ids[] = {1, 2, 200, 70000, 10000000, 5000000000ull, 5000000001ull};
+    for (uint64_t seq : ids) {
+        index.add(seq, "ann", seq % 2 ? "odd word" : "word");
+    }
+    std::vector<uint64_t> found = search(index, "word", 100);
+    CHECK_EQ(found.size(), (size_t)7);
+    CHECK(std::equal(found.begin(), found.end(), std::rbegin(ids)));
+    found = search(index, "odd", 100);
+    CHECK_EQ(found.size(), (size_t)2);
+    CHECK_EQ(found[0], (uint64_t)5000000001ull);
+    CHECK_EQ(found[1], (uint64_t)1);
+}
+
+TEST(searchCountsRepeatedWordsOnce) {
+    SearchIndex index;
+    index.add(1, "ann", "echo echo ECHO");
+    index.add(2, "ann", "echo");
+    std::vector<uint64_t> found = search(index, "echo", 10);
+    CHECK_EQ(found.size(), (size_t)2);
+}
+
+TEST(searchLimitReturnsTheNewest) {
+    SearchIndex index;
+    for (const auto& msg : makeMessages(1, 1000)) {
+        index.add(msg.seq, msg.sender, msg.text);
+    }
+    std::vector<uint64_t> found = search(index, "every", 5);
+    CHECK(found == std::vector<uint64_t>({1000, 999, 998, 997, 996}));
+}
+
+TEST(parseQuerySplitsWordsAndSender) {
+    std::vector<std::string> words;
+    std::string sender;
+    CHECK(SearchIndex::parseQuery("Hello, WORLD hello from:ann", words, sender));
+    CHECK(words == std::vector<std::string>({"hello", "world"}));
+    CHECK_EQ(sender, "ann");
+
+    CHECK(SearchIndex::parseQuery("from:bob", words, sender));
+    CHECK(words.empty());
+    CHECK_EQ(sender, "bob");
+
+    CHECK(!SearchIndex::parseQuery("  ,;  ", words, sender));
+
+    CHECK(SearchIndex::parseQuery("a b c d e f g h i j", words, sender));
+    CHECK_EQ(words.size(), SearchIndex::MAX_QUERY_TERMS);
+
+    CHECK(SearchIndex::parseQuery(std::string(40, 'x'), words, sender));
+    CHECK_EQ(words[0].size(), SearchIndex::MAX_TERM_LENGTH);
+}
+
+TEST(searchMatchesLongWordsByTheirPrefix) {
+    SearchIndex index;
+    index.add(1, "ann", std::string(40, 'q'));
+    CHECK_EQ(search(index, std::string(35, 'q'), 10).size(), (size_t)1);
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <iostream>
+#include <vector>
+
+// Minimal unit test support for `make test`: TEST(name) { CHECK(...); }
+// registers a test, run_tests runs them all and exits non-zero if any
+// check failed.
+struct TestCase {
+    const char* name;
+    void (*run)();
+};
+
+std::vector<TestCase>& testCases();
+// Failed checks so far
+int& testFailures();
+
+struct TestRegistrar {
+    TestRegistrar(const char* name, void (*run)()) {
+        testCases().push_back(TestCase{name, run});
+    }
+};
+
+#define TEST(name)                                             \
+    static void name();                                        \
+    static TestRegistrar name##_registrar(#name, name);        \
+    static void name()
+
+#define CHECK(condition)                                                                       \
+    do {                                                                                       \
+        if (!(condition)) {                                                                    \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #condition ") failed"      \
+                      << std::endl;                                                            \
+            testFailures()++;                                                                  \
+        }                                                                                      \
+    } while (0)
+
+#define CHECK_EQ(actual, expected)                                                             \
+    do {                                                                                       \
+        auto check_actual = (actual);                                                          \
+        auto check_expected = (expected);                                                      \
+        if (!(check_actual == check_expected)) {                                               \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK_EQ(" #actual ", " #expected   \
+                      << ") failed: " << check_actual << " != " << check_expected << std::endl; \
+            testFailures()++;                                                                  \
+        }                                                                                      \
+    } while (0)
@@ -0,0 +1,26 @@
+#include "test.h"
+
+std::vector<TestCase>& testCases() {
+    static std::vector<TestCase> cases;
+    return cases;
+}
+
+int& testFailures() {
+    static int failures = 0;
+    return failures;
+}
+
+int main() {
+    int failed_tests = 0;
+    for (const auto& test : testCases()) {
+        int before = testFailures();
+        test.run();
+        if (testFailures() != before) {
+            std::cerr << "FAILED " << test.name << std::endl;
+            failed_tests++;
+        }
+    }
+    std::cout << testCases().size() - failed_tests << " of " << testCases().size() << " tests passed"
+              << std::endl;
+    return failed_tests == 0 ? 0 : 1;
+}